@@ -17,6 +17,9 @@
 #ifndef XPRHREAD_H
 #define XPRHREAD_H
 
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
 #ifdef _WIN32
@@ -25,14 +28,6 @@
 /** Mutex type (maps to CRITICAL_SECTION) */
 typedef CRITICAL_SECTION xpthread_mutex_t;
 
-/**
- * One-time initialization control.
- *
- * @note Uses INIT_ONCE internally.
- *       Behavior matches pthread_once() for basic use cases.
- */
-typedef INIT_ONCE xpthread_once_t;
-
 /**
  * Thread handle.
  *
@@ -49,7 +44,6 @@ typedef DWORD xpthread_attr_t;
 
 #define XPTHREADCALL __stdcall
 
-#define XPTHREAD_ONCE_INIT INIT_ONCE_STATIC_INIT
 #define XPTHREAD_MUTEX_INITIALIZER {0}
 
 #define XPTHREAD_CANCEL_ENABLE  1
@@ -60,13 +54,11 @@ typedef DWORD xpthread_attr_t;
 #include <pthread.h>
 
 typedef pthread_mutex_t	xpthread_mutex_t;
-typedef pthread_once_t	xpthread_once_t;
 typedef pthread_t	xpthread_t;
 typedef pthread_attr_t	xpthread_attr_t;
 
 #define XPTHREADCALL
 
-#define XPTHREAD_ONCE_INIT PTHREAD_ONCE_INIT
 #define XPTHREAD_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
 
 #ifdef __ANDROID__
@@ -79,6 +71,357 @@ typedef pthread_attr_t	xpthread_attr_t;
 
 #endif /* _WIN32 */
 
+/*
+ * Helpers for the inline fast paths below (not part of the API).
+ */
+#if defined(_MSC_VER) && !defined(__clang__)
+#define XPTHREAD_STATIC_INLINE static __inline
+#if defined(_M_IX86) || defined(_M_X64)
+#define XPTHREAD__ACQUIRE_FENCE() _ReadWriteBarrier()
+#else
+#define XPTHREAD__ACQUIRE_FENCE() MemoryBarrier()
+#endif
+#define XPTHREAD__LOAD_RELAXED(p) (*(p))
+#define XPTHREAD__XCHG(p, v) InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+#define XPTHREAD__STORE_RELEASE(p, v) ((void)InterlockedExchange((volatile LONG *)(p), (LONG)(v)))
+#define XPTHREAD__CAS32(p, e, d) \
+	(InterlockedCompareExchange((volatile LONG *)(p), (LONG)(d), (LONG)(e)) == (LONG)(e))
+#define XPTHREAD__CPU_RELAX() YieldProcessor()
+#else
+#define XPTHREAD_STATIC_INLINE static inline
+#define XPTHREAD__ACQUIRE_FENCE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define XPTHREAD__LOAD_RELAXED(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define XPTHREAD__XCHG(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQUIRE)
+#define XPTHREAD__STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define XPTHREAD__CAS32(p, e, d) xpthread__cas32((p), (e), (d))
+#if defined(__i386__) || defined(__x86_64__)
+#define XPTHREAD__CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define XPTHREAD__CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define XPTHREAD__CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+#endif
+
+/**
+ * One-time initialization control.
+ *
+ * A state word on every platform, so that completed calls are a single
+ * inline acquire load (see xpthread_once()).
+ */
+typedef struct {
+	volatile uint32_t state;
+} xpthread_once_t;
+
+#define XPTHREAD_ONCE_INIT { 0 }
+
+/* xpthread_once_t state after the init routine returned */
+#define XPTHREAD__ONCE_DONE 3
+
+#if !defined(_MSC_VER) || defined(__clang__)
+XPTHREAD_STATIC_INLINE int xpthread__cas32(volatile uint32_t *p, uint32_t expected, uint32_t desired) {
+	return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+#endif
+
+/**
+ * Test-and-test-and-set spinlock.
+ *
+ * Waiters spin on a plain load and back off exponentially (using the CPU
+ * pause/yield hint) between acquisition attempts. backoff_min/backoff_max
+ * are measured in pause iterations.
+ *
+ * @note Not fair. Intended for very short critical sections on threads
+ *       that are not preempted while holding the lock.
+ */
+typedef struct {
+	volatile long locked;
+	unsigned int backoff_min;
+	unsigned int backoff_max;
+} xpthread_spinlock_t;
+
+/**
+ * FIFO ticket spinlock.
+ *
+ * Waiters are served in arrival order and back off proportionally to
+ * their distance from the ticket currently being served.
+ */
+typedef struct {
+	volatile long next;
+	volatile long serving;
+	unsigned int backoff_base;
+} xpthread_ticketlock_t;
+
+#define XPTHREAD_SPIN_BACKOFF_MIN 4
+#define XPTHREAD_SPIN_BACKOFF_MAX 1024
+#define XPTHREAD_TICKET_BACKOFF_BASE 64
+
+#define XPTHREAD_SPINLOCK_INITIALIZER \
+	{ 0, XPTHREAD_SPIN_BACKOFF_MIN, XPTHREAD_SPIN_BACKOFF_MAX }
+
+#define XPTHREAD_TICKETLOCK_INITIALIZER \
+	{ 0, 0, XPTHREAD_TICKET_BACKOFF_BASE }
+
+/**
+ * Sequence lock for small, rarely written, frequently read snapshots.
+ *
+ * The sequence is odd while a write is in progress. Readers never store
+ * to the lock; they retry when a write overlapped their read.
+ */
+typedef struct {
+	volatile unsigned long seq;
+	xpthread_spinlock_t writer;
+} xpthread_seqlock_t;
+
+#define XPTHREAD_SEQLOCK_INITIALIZER { 0, XPTHREAD_SPINLOCK_INITIALIZER }
+
+/** Read-indicator stripes per left-right version. */
+#define XPTHREAD_LR_STRIPES 16
+
+/**
+ * Left-right construct: two replicas of the same data.
+ *
+ * Readers always access the replica not being written, announcing
+ * themselves on striped read indicators. The writer updates the idle
+ * replica, switches readers over, waits for the old readers to drain and
+ * replays the update on the other replica.
+ */
+typedef struct {
+	void *instances[2];
+	volatile long left_right;
+	volatile long version_index;
+	volatile long *indicators;
+	void *indicators_mem;
+	xpthread_mutex_t writer;
+} xpthread_leftright_t;
+
+/**
+ * Flat-combining operation callback.
+ *
+ * Called by whichever thread currently holds the combiner role, once per
+ * published operation, with the object protected by the combiner.
+ */
+typedef void (*xpthread_fc_fn)(void *state, void *op);
+
+/**
+ * Per-thread publication record of a flat combiner.
+ *
+ * Each thread posting operations to a combiner owns one record (usually
+ * thread-local or on the stack of a long-running loop). The record must
+ * stay valid until xpthread_fc_record_release() is called.
+ */
+typedef struct xpthread_fc_record {
+	struct xpthread_fc_record *volatile next;
+	void *volatile op;
+	volatile long pending;
+	long linked;
+} xpthread_fc_record_t;
+
+/**
+ * Flat combiner: serializes operations on one object without handing a
+ * lock from thread to thread.
+ */
+typedef struct {
+	xpthread_spinlock_t combiner;
+	xpthread_fc_record_t *volatile head;
+	void *state;
+	xpthread_fc_fn apply;
+} xpthread_fc_t;
+
+#define XPTHREAD_FC_RECORD_INITIALIZER { NULL, NULL, 0, 0 }
+
+/**
+ * Closure executed by a delegation server on behalf of a client.
+ *
+ * state is the object owned by the server, the return value is handed
+ * back to the calling client.
+ */
+typedef void *(*xpthread_delegate_fn)(void *state, void *arg);
+
+struct xpthread_delegate_slot;
+
+/**
+ * Delegation server (ffwd-style).
+ *
+ * A dedicated thread owns the state and executes closures posted by
+ * clients, so the state never leaves that core's cache.
+ */
+typedef struct {
+	xpthread_t thread;
+	struct xpthread_delegate_slot *slots;
+	void *slots_mem;
+	unsigned int nslots;
+	int cpu;
+	volatile long stop;
+	volatile long pin_status; // set by the server: 0 or the pinning error
+	void *state;
+} xpthread_delegate_t;
+
+/** Hazard pointer slots available to each thread. */
+#define XPTHREAD_HAZARD_SLOTS 4
+
+/** Minimum retired-list length before a reclamation scan. */
+#define XPTHREAD_HAZARD_SCAN_MIN 64
+
+/**
+ * Callback header for xpthread_call_rcu(), embedded in the object to free.
+ */
+typedef struct xpthread_rcu_head {
+	struct xpthread_rcu_head *next;
+	void (*func)(struct xpthread_rcu_head *head);
+} xpthread_rcu_head_t;
+
+/**
+ * Read an RCU-protected pointer inside a read-side critical section.
+ *
+ * Relies on address dependency ordering, like rcu_dereference().
+ */
+#if defined(_MSC_VER) && !defined(__clang__)
+#define xpthread_rcu_dereference(p) (*(void *volatile *)&(p))
+#define xpthread_rcu_assign_pointer(p, v) \
+	((void)InterlockedExchangePointer((void *volatile *)&(p), (void *)(v)))
+#else
+#define xpthread_rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+/** Publish an initialized object to RCU readers (release store). */
+#define xpthread_rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#endif
+
+/**
+ * Unit of work for an xpthread_pool_t.
+ *
+ * Intrusive: embed it in the caller's own structure and recover that
+ * structure in fn. The pool never allocates or frees tasks.
+ */
+typedef struct xpthread_task {
+	struct xpthread_task *next;
+	void (*fn)(struct xpthread_task *task);
+} xpthread_task_t;
+
+/** Work-stealing worker pool (opaque). */
+typedef struct xpthread_pool xpthread_pool_t;
+
+/**
+ * Fork-join task group: children spawned into it are waited for by
+ * xpthread_taskgroup_sync().
+ */
+typedef struct {
+	xpthread_pool_t *pool;
+	volatile long pending;
+} xpthread_taskgroup_t;
+
+/**
+ * Spawn record of a task group child.
+ *
+ * Embed it in the child's arguments, typically in the spawning function's
+ * stack frame; it must stay valid until the group is synced.
+ */
+typedef struct xpthread_spawn {
+	xpthread_task_t task;
+	void (*fn)(struct xpthread_spawn *spawn);
+	xpthread_taskgroup_t *group;
+} xpthread_spawn_t;
+
+/**
+ * Timer for xpthread_schedule_after() and xpthread_schedule_every().
+ *
+ * Caller-owned and intrusive, so arming a timer never allocates. Initialize
+ * with XPTHREAD_TIMER_INITIALIZER or xpthread_timer_init(); the fields are
+ * private to the library.
+ */
+typedef struct xpthread_timer {
+	struct xpthread_timer *next;
+	struct xpthread_timer **pprev;
+	void (*fn)(void *arg);
+	void *arg;
+	uint64_t expires;
+	unsigned long period;
+	int state;
+} xpthread_timer_t;
+
+#define XPTHREAD_TIMER_INITIALIZER { NULL, NULL, NULL, NULL, 0, 0, 0 }
+
+/** Task graph (opaque), see xpthread_graph_create(). */
+typedef struct xpthread_graph xpthread_graph_t;
+
+/** Fiber (opaque), see xpthread_fiber_create(). */
+typedef struct xpthread_fiber xpthread_fiber_t;
+
+/** Park permit of one thread (opaque), see xpthread_park_handle_self(). */
+typedef struct xpthread_park_handle xpthread_park_handle_t;
+
+/** Default fiber stack size, excluding the guard page. */
+#ifndef XPTHREAD_FIBER_STACK_SIZE
+#define XPTHREAD_FIBER_STACK_SIZE (64 * 1024)
+#endif
+
+struct xpthread_fwait;
+
+/**
+ * Fiber-aware mutex.
+ *
+ * A fiber that has to wait parks on the mutex's queue and its carrier
+ * runs other fibers; a plain thread sleeps on a futex instead.
+ */
+typedef struct {
+	volatile uint32_t state;
+	xpthread_spinlock_t qlock;
+	struct xpthread_fwait *head;
+	struct xpthread_fwait *tail;
+} xpthread_fmutex_t;
+
+/** Fiber-aware condition variable, used with xpthread_fmutex_t. */
+typedef struct {
+	xpthread_spinlock_t qlock;
+	struct xpthread_fwait *head;
+	struct xpthread_fwait *tail;
+} xpthread_fcond_t;
+
+#define XPTHREAD_FMUTEX_INITIALIZER { 0, XPTHREAD_SPINLOCK_INITIALIZER, NULL, NULL }
+#define XPTHREAD_FCOND_INITIALIZER { XPTHREAD_SPINLOCK_INITIALIZER, NULL, NULL }
+
+/**
+ * One-byte mutex.
+ *
+ * Holds only a locked and a has-parked bit; waiting threads queue in the
+ * library's global parking lot, keyed by the lock's address. Needs no
+ * initialization beyond zero and no destruction.
+ */
+typedef struct {
+	volatile uint8_t state;
+} xpthread_bytelock_t;
+
+/** One-byte condition variable, used with xpthread_bytelock_t. */
+typedef struct {
+	volatile uint8_t state;
+} xpthread_bytecond_t;
+
+#define XPTHREAD_BYTELOCK_INITIALIZER { 0 }
+#define XPTHREAD_BYTECOND_INITIALIZER { 0 }
+
+/** Streaming pipeline (opaque), see xpthread_pipeline_create(). */
+typedef struct xpthread_pipeline xpthread_pipeline_t;
+
+/** Pipeline stage modes for xpthread_pipeline_add_stage(). */
+#define XPTHREAD_STAGE_SERIAL 0   /* one item at a time, in input order */
+#define XPTHREAD_STAGE_PARALLEL 1 /* any number of items concurrently */
+
+/** Single-assignment result with continuations (opaque, refcounted). */
+typedef struct xpthread_future xpthread_future_t;
+
+/** Run a continuation on the thread completing the future. */
+#define XPTHREAD_FUTURE_INLINE 0
+/** Schedule a continuation on xpthread_pool_default(). */
+#define XPTHREAD_FUTURE_POOL 1
+
+/** Chunks per thread used when a parallel loop picks its own grain. */
+#define XPTHREAD_PARALLEL_SPLIT 8
+
+/** Inputs shorter than this are sorted with plain qsort(). */
+#define XPTHREAD_PARALLEL_SORT_MIN 8192
+
+/** Epoch retirements between two automatic collection attempts. */
+#define XPTHREAD_EPOCH_COLLECT_INTERVAL 64
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -86,22 +429,68 @@ extern "C" {
 /**
  * @brief Execute a function exactly once.
  *
- * POSIX: pthread_once().
- *
- * Windows: Implemented via INIT_ONCE.
+ * Same on all platforms: the first caller runs init_routine() while later
+ * callers sleep on a futex until it returns. Once it has, the call is
+ * expanded inline to one acquire load of the state word and never enters
+ * the library.
  *
  * @note Recursive calls from init_routine() have undefined behavior
- *       (matches POSIX).
+ *       (matches POSIX). init_routine() must not be cancelled.
  */
 int XPTHREADCALL xpthread_once(
 	xpthread_once_t *once_control,
 	void (*init_routine)(void)
 );
 
+/**
+ * @brief Execute init_routine(arg) exactly once.
+ *
+ * Like xpthread_once(), but passes a context pointer so lazy singletons
+ * need no global trampoline. Only the arg of the call that runs the
+ * routine is used.
+ */
+int XPTHREADCALL xpthread_once_arg(
+	xpthread_once_t *once_control,
+	void (*init_routine)(void *arg),
+	void *arg
+);
+
+XPTHREAD_STATIC_INLINE int xpthread__once_done(const xpthread_once_t *once_control) {
+	uint32_t state = XPTHREAD__LOAD_RELAXED(&once_control->state);
+	XPTHREAD__ACQUIRE_FENCE();
+	return state == XPTHREAD__ONCE_DONE;
+}
+
+/* NULL controls fall through to the library, which reports EINVAL */
+XPTHREAD_STATIC_INLINE int xpthread__inline_once(xpthread_once_t *once_control, void (*init_routine)(void)) {
+	if (once_control && xpthread__once_done(once_control)) return 0;
+	return (xpthread_once)(once_control, init_routine);
+}
+
+XPTHREAD_STATIC_INLINE int xpthread__inline_once_arg(
+	xpthread_once_t *once_control,
+	void (*init_routine)(void *arg),
+	void *arg
+) {
+	if (once_control && xpthread__once_done(once_control)) return 0;
+	return (xpthread_once_arg)(once_control, init_routine, arg);
+}
+
+#ifndef XPTHREAD_BUILDING
+#define xpthread_once(once_control, init_routine) \
+	xpthread__inline_once((once_control), (init_routine))
+#define xpthread_once_arg(once_control, init_routine, arg) \
+	xpthread__inline_once_arg((once_control), (init_routine), (arg))
+#endif
+
 /**
  * @brief Create a new thread.
  *
- * POSIX: pthread_create().
+ * POSIX: pthread_create(), through a small start trampoline.
+ *
+ * All platforms:
+ * - The thread's xpthread per-thread record (hazard pointer slots, ...)
+ *   is registered before start_routine runs and released at thread exit.
  *
  * Windows:
  * - Thread is created via _beginthreadex().
@@ -245,10 +634,13 @@ int XPTHREADCALL xpthread_mutex_destroy(xpthread_mutex_t *mutex);
 /**
  * @brief Lock a mutex.
  *
- * POSIX: pthread_mutex_lock().
+ * POSIX: pthread_mutex_trylock(), then pthread_mutex_lock() if busy.
  *
  * Windows:
  * - Enters CRITICAL_SECTION (non-cancelable).
+ *
+ * @note Before blocking, the caller's pending epoch retirements are
+ *       handed over so they can be reclaimed while it sleeps.
  */
 int XPTHREADCALL xpthread_mutex_lock(xpthread_mutex_t *mutex);
 
@@ -267,6 +659,26 @@ int XPTHREADCALL xpthread_mutex_unlock(xpthread_mutex_t *mutex);
  */
 int XPTHREADCALL xpthread_mutex_trylock(xpthread_mutex_t *mutex);
 
+/**
+ * @brief Lock several mutexes without risk of deadlock.
+ *
+ * The mutexes are locked in ascending address order, the order every
+ * xpthread_mutex_lock_n() caller uses, so threads locking overlapping
+ * sets cannot deadlock each other. Duplicate entries are locked once, and
+ * the array itself is not modified.
+ *
+ * @return 0 with every mutex held, or the first error from
+ *         xpthread_mutex_lock() with none held; EINVAL for NULL entries.
+ * @note Code that also locks two of these mutexes one by one must do so
+ *       in address order as well.
+ */
+int XPTHREADCALL xpthread_mutex_lock_n(xpthread_mutex_t *const *mutexes, size_t n);
+
+/**
+ * @brief Unlock every mutex locked by xpthread_mutex_lock_n().
+ */
+int XPTHREADCALL xpthread_mutex_unlock_n(xpthread_mutex_t *const *mutexes, size_t n);
+
 /**
  * @brief Get the current real-time clock.
  *
@@ -337,6 +749,1215 @@ int XPTHREADCALL xpthread_mutex_setprioceiling(
  */
 int XPTHREADCALL xpthread_mutex_consistent(xpthread_mutex_t *mutex);
 
+/**
+ * @brief Initialize a TTAS spinlock with the default backoff.
+ *
+ * Same on all platforms (implemented with atomic operations).
+ */
+int XPTHREADCALL xpthread_spin_init(xpthread_spinlock_t *lock);
+
+/**
+ * @brief Destroy a TTAS spinlock.
+ *
+ * @return EBUSY if the lock is currently held.
+ */
+int XPTHREADCALL xpthread_spin_destroy(xpthread_spinlock_t *lock);
+
+/**
+ * @brief Tune the exponential backoff of a TTAS spinlock.
+ *
+ * The first failed attempt waits min_spins pause iterations, every
+ * further failure doubles the wait up to max_spins. Once max_spins is
+ * reached the waiter also yields its time slice.
+ *
+ * @return EINVAL if min_spins is 0 or greater than max_spins.
+ */
+int XPTHREADCALL xpthread_spin_setbackoff(
+	xpthread_spinlock_t *lock,
+	unsigned int min_spins,
+	unsigned int max_spins
+);
+
+/**
+ * @brief Lock a TTAS spinlock, spinning until it is acquired.
+ */
+int XPTHREADCALL xpthread_spin_lock(xpthread_spinlock_t *lock);
+
+/**
+ * @brief Try to lock a TTAS spinlock.
+ *
+ * @return 0 on success, EBUSY if the lock is held.
+ */
+int XPTHREADCALL xpthread_spin_trylock(xpthread_spinlock_t *lock);
+
+/**
+ * @brief Unlock a TTAS spinlock.
+ */
+int XPTHREADCALL xpthread_spin_unlock(xpthread_spinlock_t *lock);
+
+/**
+ * @brief Initialize a ticket spinlock with the default backoff.
+ */
+int XPTHREADCALL xpthread_ticket_init(xpthread_ticketlock_t *lock);
+
+/**
+ * @brief Destroy a ticket spinlock.
+ *
+ * @return EBUSY if the lock is currently held or has waiters.
+ */
+int XPTHREADCALL xpthread_ticket_destroy(xpthread_ticketlock_t *lock);
+
+/**
+ * @brief Tune the proportional backoff of a ticket spinlock.
+ *
+ * A waiter that is N tickets away from being served waits
+ * N * spins_per_waiter pause iterations before looking again.
+ *
+ * @return EINVAL if spins_per_waiter is 0.
+ */
+int XPTHREADCALL xpthread_ticket_setbackoff(
+	xpthread_ticketlock_t *lock,
+	unsigned int spins_per_waiter
+);
+
+/**
+ * @brief Lock a ticket spinlock (FIFO order).
+ */
+int XPTHREADCALL xpthread_ticket_lock(xpthread_ticketlock_t *lock);
+
+/**
+ * @brief Try to lock a ticket spinlock.
+ *
+ * @return 0 on success, EBUSY if the lock is held or has waiters.
+ */
+int XPTHREADCALL xpthread_ticket_trylock(xpthread_ticketlock_t *lock);
+
+/**
+ * @brief Unlock a ticket spinlock, passing it to the next ticket.
+ */
+int XPTHREADCALL xpthread_ticket_unlock(xpthread_ticketlock_t *lock);
+
+/**
+ * @brief Initialize a flat combiner.
+ *
+ * @param state Object the operations are applied to.
+ * @param apply Callback applying one operation to state.
+ */
+int XPTHREADCALL xpthread_fc_init(
+	xpthread_fc_t *fc,
+	void *state,
+	xpthread_fc_fn apply
+);
+
+/**
+ * @brief Destroy a flat combiner.
+ *
+ * @return EBUSY if publication records are still registered.
+ */
+int XPTHREADCALL xpthread_fc_destroy(xpthread_fc_t *fc);
+
+/**
+ * @brief Initialize a publication record.
+ */
+int XPTHREADCALL xpthread_fc_record_init(xpthread_fc_record_t *rec);
+
+/**
+ * @brief Apply an operation through the combiner and wait for it.
+ *
+ * The operation is posted in rec. If no other thread is combining, the
+ * caller becomes the combiner and applies every pending operation of the
+ * publication list in a batch; otherwise it spins until the current
+ * combiner has applied it. On return the operation has completed and any
+ * result written by the callback into op is visible.
+ *
+ * The record is linked into the publication list on first use and stays
+ * there, so later calls cost a store and a load in the common case.
+ *
+ * @note A record may only be used by one thread at a time.
+ */
+int XPTHREADCALL xpthread_fc_execute(
+	xpthread_fc_t *fc,
+	xpthread_fc_record_t *rec,
+	void *op
+);
+
+/**
+ * @brief Remove a publication record from a combiner.
+ *
+ * Must be called before the memory of a used record is reused or freed.
+ */
+int XPTHREADCALL xpthread_fc_record_release(
+	xpthread_fc_t *fc,
+	xpthread_fc_record_t *rec
+);
+
+/**
+ * @brief Start a delegation server.
+ *
+ * Creates the server thread with xpthread_create() and pins it to cpu.
+ *
+ * POSIX: pinned with sched_setaffinity() on Linux/Android, not pinned
+ * elsewhere.
+ *
+ * Windows:
+ * - Pinned with SetThreadAffinityMask().
+ *
+ * @param state    Object owned by the server thread.
+ * @param nclients Maximum number of concurrently registered clients.
+ * @param cpu      CPU to pin the server to, or -1 to leave it unpinned.
+ * @return 0 once the server runs on cpu, EINVAL if cpu is not below the
+ *         number of online CPUs, or the error from pinning the server
+ *         (the server is then joined and nothing is left to destroy).
+ *
+ * @note The server thread busy-polls the request lines and only yields
+ *       its time slice after a long idle period. Dedicate a core to it.
+ */
+int XPTHREADCALL xpthread_delegate_init(
+	xpthread_delegate_t *d,
+	void *state,
+	unsigned int nclients,
+	int cpu
+);
+
+/**
+ * @brief Stop and join a delegation server.
+ *
+ * @note No client may be inside xpthread_delegate_call().
+ */
+int XPTHREADCALL xpthread_delegate_destroy(xpthread_delegate_t *d);
+
+/**
+ * @brief Register a client and reserve its request/response lines.
+ *
+ * @param client Receives the client id used by xpthread_delegate_call().
+ * @return EAGAIN if all nclients slots are taken.
+ */
+int XPTHREADCALL xpthread_delegate_register(xpthread_delegate_t *d, int *client);
+
+/**
+ * @brief Release a client slot.
+ */
+int XPTHREADCALL xpthread_delegate_unregister(xpthread_delegate_t *d, int client);
+
+/**
+ * @brief Run fn(state, arg) on the server thread and return its result.
+ *
+ * The closure is written to the client's own request line; the caller
+ * spins on its response line until the server has run it.
+ *
+ * @note A client id may only be used by one thread at a time.
+ * @return fn's result, or NULL without running fn if d or fn is NULL or
+ *         client is not a valid client id.
+ */
+void *XPTHREADCALL xpthread_delegate_call(
+	xpthread_delegate_t *d,
+	int client,
+	xpthread_delegate_fn fn,
+	void *arg
+);
+
+/**
+ * @brief Protect the pointer stored at src with a hazard slot.
+ *
+ * Loads *src, publishes it in the calling thread's hazard slot and
+ * re-reads *src until both agree. The returned pointer will not be freed
+ * by xpthread_hazard_retire() until the slot is cleared or overwritten.
+ *
+ * @param slot Slot index, 0 to XPTHREAD_HAZARD_SLOTS - 1.
+ * @return The protected pointer, NULL if slot is out of range.
+ */
+void *XPTHREADCALL xpthread_hazard_protect(int slot, void *const volatile *src);
+
+/**
+ * @brief Publish ptr in a hazard slot without validation.
+ *
+ * Useful to hand-over-hand protect a node already protected by another
+ * slot; the caller must validate reachability itself.
+ *
+ * @return EINVAL if slot is out of range.
+ */
+int XPTHREADCALL xpthread_hazard_set(int slot, void *ptr);
+
+/**
+ * @brief Clear a hazard slot of the calling thread.
+ *
+ * @return EINVAL if slot is out of range.
+ */
+int XPTHREADCALL xpthread_hazard_clear(int slot);
+
+/**
+ * @brief Retire an unlinked node.
+ *
+ * The node is appended to the calling thread's retired list and freed
+ * with free_fn once no hazard slot points to it. Scans are amortized:
+ * they only run once the list holds twice as many nodes as there are
+ * hazard slots in the process (at least XPTHREAD_HAZARD_SCAN_MIN).
+ *
+ * Nodes still protected when a thread exits stay queued and are freed by
+ * a later scan of another thread.
+ *
+ * @return ENOMEM if the retired list or the thread's record cannot be
+ *         allocated.
+ */
+int XPTHREADCALL xpthread_hazard_retire(void *ptr, void (*free_fn)(void *));
+
+/**
+ * @brief Force a reclamation scan of the calling thread's retired list.
+ *
+ * Also adopts nodes left behind by exited threads.
+ */
+void XPTHREADCALL xpthread_hazard_scan(void);
+
+/**
+ * @brief Enter an epoch-based reclamation critical region.
+ *
+ * Publishes the current global epoch in the calling thread's record.
+ * Nodes reachable when the region was entered are not freed by
+ * xpthread_epoch_retire() before the matching xpthread_epoch_exit().
+ *
+ * @note Regions nest. A thread outside any region never delays
+ *       reclamation; a thread blocked inside a region does.
+ */
+void XPTHREADCALL xpthread_epoch_enter(void);
+
+/**
+ * @brief Leave an epoch-based reclamation critical region.
+ */
+void XPTHREADCALL xpthread_epoch_exit(void);
+
+/**
+ * @brief Retire an unlinked node under epoch-based reclamation.
+ *
+ * The node is freed with free_fn once the global epoch has advanced twice
+ * past the epoch it was retired in. Collection is attempted every
+ * XPTHREAD_EPOCH_COLLECT_INTERVAL retirements.
+ *
+ * Pending nodes of a thread that blocks in an xpthread wait (mutex lock,
+ * join) outside a region, or exits, are handed to a shared list and freed
+ * by other threads.
+ *
+ * @return ENOMEM if the limbo list or the thread's record cannot be
+ *         allocated.
+ */
+int XPTHREADCALL xpthread_epoch_retire(void *ptr, void (*free_fn)(void *));
+
+/**
+ * @brief Try to advance the global epoch and free what became safe.
+ */
+void XPTHREADCALL xpthread_epoch_collect(void);
+
+/**
+ * @brief Wait for two epoch advances and free everything retired before.
+ *
+ * Spins (yielding) until every thread inside a region has left it or
+ * observed the new epoch.
+ *
+ * @return EDEADLK if called inside a critical region, ENOMEM if the
+ *         thread's record cannot be allocated.
+ */
+int XPTHREADCALL xpthread_epoch_barrier(void);
+
+/**
+ * @brief Enter an RCU read-side critical section.
+ *
+ * Copies the grace-period counter into the calling thread's record.
+ * Sections nest.
+ *
+ * POSIX: on Linux with membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED) the
+ * reader only issues a compiler barrier; otherwise a full fence.
+ *
+ * Windows:
+ * - Compiler barrier only; writers use FlushProcessWriteBuffers().
+ *
+ * @note Must not block for long and must not call
+ *       xpthread_synchronize_rcu().
+ */
+void XPTHREADCALL xpthread_rcu_read_lock(void);
+
+/**
+ * @brief Leave an RCU read-side critical section.
+ */
+void XPTHREADCALL xpthread_rcu_read_unlock(void);
+
+/**
+ * @brief Wait for all pre-existing RCU read-side critical sections.
+ *
+ * On return, no reader can still hold a pointer that was unlinked before
+ * the call. Spins (yielding) while waiting for readers.
+ */
+void XPTHREADCALL xpthread_synchronize_rcu(void);
+
+/**
+ * @brief Run func(head) after a grace period, asynchronously.
+ *
+ * Callbacks are queued lock-free and run in batches by a background
+ * xpthread thread (started on first use), one grace period per batch.
+ *
+ * @return 0 on success, EINVAL if head or func is NULL, or the error from
+ *         creating the background thread (EAGAIN, ENOMEM); the callback is
+ *         then not queued and the caller must free the object itself.
+ *         Starting the thread is retried on the next call.
+ */
+int XPTHREADCALL xpthread_call_rcu(
+	xpthread_rcu_head_t *head,
+	void (*func)(xpthread_rcu_head_t *head)
+);
+
+/**
+ * @brief Wait until every callback queued by xpthread_call_rcu() so far
+ *        has run.
+ */
+void XPTHREADCALL xpthread_rcu_barrier(void);
+
+/**
+ * @brief Initialize a seqlock.
+ */
+int XPTHREADCALL xpthread_seqlock_init(xpthread_seqlock_t *sl);
+
+/**
+ * @brief Destroy a seqlock.
+ *
+ * @return EBUSY if a write is in progress.
+ */
+int XPTHREADCALL xpthread_seqlock_destroy(xpthread_seqlock_t *sl);
+
+/**
+ * @brief Begin a seqlock write.
+ *
+ * Writers are serialized by an internal spinlock. Makes the sequence odd
+ * before any protected data is modified.
+ */
+int XPTHREADCALL xpthread_seqlock_write_lock(xpthread_seqlock_t *sl);
+
+/**
+ * @brief End a seqlock write, publishing the new data to readers.
+ */
+int XPTHREADCALL xpthread_seqlock_write_unlock(xpthread_seqlock_t *sl);
+
+/**
+ * @brief Begin a seqlock read (inline, no stores).
+ *
+ * Waits while a write is in progress and returns the sequence to pass to
+ * xpthread_seqlock_read_retry().
+ *
+ * @code
+ * unsigned long seq;
+ * do {
+ *     seq = xpthread_seqlock_read_begin(&sl);
+ *     snapshot = shared;
+ * } while (xpthread_seqlock_read_retry(&sl, seq));
+ * @endcode
+ *
+ * @note Data read inside the loop may be torn until read_retry() returns
+ *       0; do not dereference pointers read from it before that.
+ */
+XPTHREAD_STATIC_INLINE unsigned long xpthread_seqlock_read_begin(const xpthread_seqlock_t *sl) {
+	for (;;) {
+		unsigned long seq = XPTHREAD__LOAD_RELAXED(&sl->seq);
+		XPTHREAD__ACQUIRE_FENCE();
+		if (!(seq & 1)) return seq;
+		XPTHREAD__CPU_RELAX();
+	}
+}
+
+/**
+ * @brief Check whether a seqlock read must be retried (inline).
+ *
+ * @return Non-zero if a write started or completed since read_begin().
+ */
+XPTHREAD_STATIC_INLINE int xpthread_seqlock_read_retry(const xpthread_seqlock_t *sl, unsigned long seq) {
+	XPTHREAD__ACQUIRE_FENCE();
+	return XPTHREAD__LOAD_RELAXED(&sl->seq) != seq;
+}
+
+/**
+ * @brief Initialize a left-right construct over two identical replicas.
+ *
+ * @param left, right Replicas holding the same initial state.
+ */
+int XPTHREADCALL xpthread_lr_init(xpthread_leftright_t *lr, void *left, void *right);
+
+/**
+ * @brief Destroy a left-right construct (the replicas are not freed).
+ */
+int XPTHREADCALL xpthread_lr_destroy(xpthread_leftright_t *lr);
+
+/**
+ * @brief Start reading; returns the replica to read.
+ *
+ * Wait-free: one atomic increment on the caller's read-indicator stripe
+ * and two loads, never a retry.
+ *
+ * @param token Receives the value to pass to xpthread_lr_read_unlock().
+ */
+const void *XPTHREADCALL xpthread_lr_read_lock(xpthread_leftright_t *lr, unsigned int *token);
+
+/**
+ * @brief Finish reading.
+ */
+void XPTHREADCALL xpthread_lr_read_unlock(xpthread_leftright_t *lr, unsigned int token);
+
+/**
+ * @brief Apply a modification to both replicas.
+ *
+ * fn(instance, arg) is called twice, once per replica, and must be
+ * deterministic. Writers are serialized; the call returns after both
+ * replicas are updated and readers of the old state have drained.
+ */
+int XPTHREADCALL xpthread_lr_write(
+	xpthread_leftright_t *lr,
+	void (*fn)(void *instance, void *arg),
+	void *arg
+);
+
+/**
+ * @brief Create a work-stealing worker pool.
+ *
+ * Each worker has its own task deque; idle workers steal from the others
+ * and sleep when there is nothing to steal.
+ *
+ * @param nthreads Number of workers, 0 for one per online CPU.
+ */
+int XPTHREADCALL xpthread_pool_create(xpthread_pool_t **pool, unsigned int nthreads);
+
+/**
+ * @brief Stop and join the workers of a pool.
+ *
+ * Tasks already queued are run before the workers exit.
+ *
+ * @note Must not be called from a worker of the pool, nor on the default
+ *       pool.
+ */
+int XPTHREADCALL xpthread_pool_destroy(xpthread_pool_t *pool);
+
+/**
+ * @brief Process-wide pool, created on first use with one worker per CPU.
+ *
+ * @return NULL if the pool could not be created.
+ */
+xpthread_pool_t *XPTHREADCALL xpthread_pool_default(void);
+
+/**
+ * @brief Number of workers of a pool.
+ */
+unsigned int XPTHREADCALL xpthread_pool_size(const xpthread_pool_t *pool);
+
+/**
+ * @brief Queue a task.
+ *
+ * From a worker of the same pool the task goes to that worker's own deque,
+ * otherwise to the pool's shared injection queue.
+ *
+ * @note task must stay valid until task->fn has been called.
+ */
+int XPTHREADCALL xpthread_pool_submit(xpthread_pool_t *pool, xpthread_task_t *task);
+
+/**
+ * @brief Run fn over [begin, end) in parallel on the default pool.
+ *
+ * The range is split recursively in halves; each half is a task that
+ * idle workers can steal, down to ranges of at most grain indices, which
+ * are passed to fn. The caller takes part in the work and returns when
+ * every index has been processed.
+ *
+ * @param grain Largest range handed to fn, 0 to pick one giving about
+ *              XPTHREAD_PARALLEL_SPLIT chunks per thread.
+ */
+int XPTHREADCALL xpthread_parallel_for(
+	size_t begin,
+	size_t end,
+	size_t grain,
+	void (*fn)(size_t begin, size_t end, void *ctx),
+	void *ctx
+);
+
+/**
+ * @brief Parallel reduction over [begin, end) on the default pool.
+ *
+ * The range is cut in chunks of grain indices (0 picks one as for
+ * xpthread_parallel_for()). Each chunk gets its own accumulator of size
+ * bytes initialized from identity and is folded by fn in parallel; the
+ * accumulators are then merged into result by combine in index order, so
+ * the result is deterministic for non-commutative operations.
+ *
+ * @return ENOMEM if the accumulators cannot be allocated, including when
+ *         their total size would overflow size_t (pass a larger grain).
+ */
+int XPTHREADCALL xpthread_parallel_reduce(
+	size_t begin,
+	size_t end,
+	size_t grain,
+	void *result,
+	size_t size,
+	const void *identity,
+	void (*fn)(size_t begin, size_t end, void *acc, void *ctx),
+	void (*combine)(void *acc, const void *other, void *ctx),
+	void *ctx
+);
+
+/**
+ * @brief Sort an array in parallel on the default pool.
+ *
+ * Drop-in for qsort(): same arguments and comparator. Runs are sorted
+ * with qsort() in parallel and merged pairwise; every merge is split
+ * across all threads. Needs a scratch buffer of n * size bytes and falls
+ * back to qsort() if it cannot be allocated or n is small.
+ *
+ * @note Not stable, like qsort().
+ */
+int XPTHREADCALL xpthread_parallel_sort(
+	void *base,
+	size_t n,
+	size_t size,
+	int (*cmp)(const void *, const void *)
+);
+
+/**
+ * @brief In-place inclusive prefix scan in parallel on the default pool.
+ *
+ * After the call element i holds e[0] op e[1] op ... op e[i]. op must be
+ * associative and folds elem into acc (acc = acc op elem). Uses two
+ * passes over the data: block reductions, then a rescan of every block
+ * seeded with the combined sums of the blocks before it.
+ *
+ * @return ENOMEM if the per-block buffers cannot be allocated.
+ */
+int XPTHREADCALL xpthread_parallel_scan(
+	void *base,
+	size_t n,
+	size_t size,
+	void (*op)(void *acc, const void *elem, void *ctx),
+	void *ctx
+);
+
+/**
+ * @brief Create an empty task graph.
+ *
+ * @param pool Pool the graph runs on, NULL for xpthread_pool_default().
+ */
+int XPTHREADCALL xpthread_graph_create(xpthread_graph_t **graph, xpthread_pool_t *pool);
+
+/**
+ * @brief Destroy a task graph. It must not be running.
+ */
+int XPTHREADCALL xpthread_graph_destroy(xpthread_graph_t *graph);
+
+/**
+ * @brief Add a task to a graph.
+ *
+ * @param id Receives the task id used by xpthread_graph_add_edge().
+ */
+int XPTHREADCALL xpthread_graph_add_task(
+	xpthread_graph_t *graph,
+	void (*fn)(void *arg),
+	void *arg,
+	size_t *id
+);
+
+/**
+ * @brief Make task to depend on task from.
+ */
+int XPTHREADCALL xpthread_graph_add_edge(xpthread_graph_t *graph, size_t from, size_t to);
+
+/**
+ * @brief Run every task of the graph once, honoring dependencies.
+ *
+ * Tasks without predecessors are queued first. A task becomes ready when
+ * its atomic predecessor count reaches zero; ready successors are pushed
+ * to the deque of the worker that finished the predecessor, which runs
+ * one of them itself right away. The caller helps execute tasks and
+ * returns when all of them have finished. A graph can be run repeatedly.
+ *
+ * @return EDEADLK if the edges contain a cycle.
+ */
+int XPTHREADCALL xpthread_graph_run(xpthread_graph_t *graph);
+
+/**
+ * @brief Create an empty pipeline.
+ *
+ * @param pool Pool the stages run on, NULL for xpthread_pool_default().
+ */
+int XPTHREADCALL xpthread_pipeline_create(xpthread_pipeline_t **pipeline, xpthread_pool_t *pool);
+
+/**
+ * @brief Destroy a pipeline. It must not be running.
+ */
+int XPTHREADCALL xpthread_pipeline_destroy(xpthread_pipeline_t *pipeline);
+
+/**
+ * @brief Append a stage to a pipeline.
+ *
+ * The first stage is the source: it is called with item NULL, always
+ * serially, and returns the next item or NULL at the end of input. Every
+ * later stage receives the previous stage's result and returns its own;
+ * returning NULL drops the item. The last stage's result is ignored.
+ *
+ * @param mode XPTHREAD_STAGE_SERIAL or XPTHREAD_STAGE_PARALLEL.
+ */
+int XPTHREADCALL xpthread_pipeline_add_stage(
+	xpthread_pipeline_t *pipeline,
+	void *(*fn)(void *item, void *arg),
+	void *arg,
+	int mode
+);
+
+/**
+ * @brief Push all input through the pipeline.
+ *
+ * At most max_tokens items are in flight (0 picks twice the pool size
+ * plus one); the source is not called while the limit is reached, so slow
+ * stages hold back the input. A thread that reads an item carries it
+ * through consecutive stages itself. Serial stages see items in input
+ * order; items that arrive early wait in a bounded reorder ring and are
+ * resumed by the item ahead of them. The caller helps run stages and
+ * returns once the input is exhausted and every item has left. A
+ * pipeline can be run repeatedly.
+ *
+ * @return ENOMEM if the token and reorder buffers cannot be allocated.
+ */
+int XPTHREADCALL xpthread_pipeline_run(xpthread_pipeline_t *pipeline, size_t max_tokens);
+
+/**
+ * @brief Block while *addr equals expected.
+ *
+ * POSIX: futex(FUTEX_WAIT_PRIVATE) on Linux/Android; elsewhere emulated
+ * with a hashed table of mutex/condition variable pairs.
+ *
+ * Windows:
+ * - WaitOnAddress() (Windows 8 or later).
+ *
+ * @param reltime Relative timeout, NULL to wait forever.
+ * @return 0 when woken (spuriously or not) or the value differed,
+ *         ETIMEDOUT on timeout.
+ */
+int XPTHREADCALL xpthread_futex_wait(
+	volatile uint32_t *addr,
+	uint32_t expected,
+	const struct timespec *reltime
+);
+
+/**
+ * @brief Wake up to count threads blocked in xpthread_futex_wait(addr).
+ *
+ * @note The emulation and Windows (for count > 1) wake every waiter.
+ */
+int XPTHREADCALL xpthread_futex_wake(volatile uint32_t *addr, int count);
+
+/**
+ * @brief Block the calling thread until it is unparked.
+ *
+ * Each thread owns one permit. If an xpthread_unpark() arrived since the
+ * last park, the permit is consumed and the call returns at once;
+ * otherwise the thread sleeps on its own futex word. Spurious futex
+ * wakeups are absorbed, so a return of 0 always consumed a permit.
+ *
+ * @param reltime Relative timeout, NULL to wait forever.
+ * @return 0 when unparked, ETIMEDOUT on timeout, EINVAL for a bad timeout,
+ *         ENOMEM if the thread's record cannot be allocated.
+ */
+int XPTHREADCALL xpthread_park(const struct timespec *reltime);
+
+/**
+ * @brief Give thread its permit, waking it if it is parked.
+ *
+ * Permits do not accumulate: several unparks before a park release one
+ * park. Threads created with xpthread_create() can be unparked as soon
+ * as it returns; other threads once they have called xpthread_park().
+ *
+ * Windows: the thread is identified by GetThreadId(), so pseudo-handles
+ * from xpthread_self() work.
+ *
+ * @note Finding the thread walks the library's list of thread records, so
+ *       each call costs O(threads ever seen). Queues, pools and schedulers
+ *       that wake threads on a hot path should keep a park handle instead
+ *       and call xpthread_unpark_handle().
+ *
+ * @return ESRCH if thread is not known to the library.
+ */
+int XPTHREADCALL xpthread_unpark(xpthread_t thread);
+
+/**
+ * @brief Return the calling thread's park handle.
+ *
+ * The handle refers directly to the thread's permit, so
+ * xpthread_unpark_handle() wakes it in constant time. It stays valid
+ * until the thread exits; the storage is then reused by a later thread,
+ * which a stale unpark can only wake spuriously, so parkers must recheck
+ * their condition as usual.
+ *
+ * @return The handle, or NULL if the thread's record cannot be allocated.
+ */
+xpthread_park_handle_t *XPTHREADCALL xpthread_park_handle_self(void);
+
+/**
+ * @brief Give the thread behind handle its permit, waking it if it is
+ *        parked. Same semantics as xpthread_unpark() without the lookup.
+ *
+ * @return EINVAL if handle is NULL.
+ */
+int XPTHREADCALL xpthread_unpark_handle(xpthread_park_handle_t *handle);
+
+/**
+ * @brief Lock a byte lock.
+ *
+ * Spins briefly while the holder runs, then parks the thread in the
+ * parking lot. Parked threads are woken in FIFO order. A running thread
+ * may take the lock before a woken one, except once the oldest waiter has
+ * waited the starvation threshold (see xpthread_bytelock_setstarvation()):
+ * then unlock hands the lock to it directly. A woken thread that loses the
+ * race is queued again at the head and keeps its original waiting time,
+ * which bounds the wait of every queued thread.
+ *
+ * @note Blocks the carrier when called from a fiber.
+ */
+int XPTHREADCALL xpthread_bytelock_lock(xpthread_bytelock_t *lock);
+
+/**
+ * @brief Try to lock a byte lock without blocking.
+ *
+ * @return EBUSY if the lock is held.
+ */
+int XPTHREADCALL xpthread_bytelock_trylock(xpthread_bytelock_t *lock);
+
+/**
+ * @brief Unlock a byte lock, waking one parked thread if there is one.
+ */
+int XPTHREADCALL xpthread_bytelock_unlock(xpthread_bytelock_t *lock);
+
+/**
+ * @brief Unlock a byte lock and hand it directly to the oldest parked
+ *        thread, regardless of how long it waited.
+ *
+ * Slower than xpthread_bytelock_unlock() under contention, since the lock
+ * is idle until the woken thread runs; use it where strict FIFO order
+ * matters more than throughput.
+ */
+int XPTHREADCALL xpthread_bytelock_unlock_fair(xpthread_bytelock_t *lock);
+
+/**
+ * @brief Set the starvation threshold of all byte locks.
+ *
+ * A parked thread that has waited at least threshold_ns gets the lock
+ * handed over on the next unlock instead of competing for it. The default
+ * is 1 ms; 0 disables the handoff, so woken threads always compete.
+ */
+int XPTHREADCALL xpthread_bytelock_setstarvation(uint64_t threshold_ns);
+
+/**
+ * @brief Wait on a byte condition variable.
+ *
+ * Atomically releases lock and parks; the lock is held again on return.
+ * Every waiter of a condition variable must use the same lock.
+ */
+int XPTHREADCALL xpthread_bytecond_wait(xpthread_bytecond_t *cond, xpthread_bytelock_t *lock);
+
+/**
+ * @brief Wait on a byte condition variable with a timeout.
+ *
+ * @param reltime Relative timeout, NULL to wait forever.
+ * @return ETIMEDOUT on timeout; the lock is held again either way.
+ */
+int XPTHREADCALL xpthread_bytecond_timedwait(
+	xpthread_bytecond_t *cond,
+	xpthread_bytelock_t *lock,
+	const struct timespec *reltime
+);
+
+/**
+ * @brief Wake one waiter; a no-op without touching the parking lot when
+ *        nobody waits.
+ */
+int XPTHREADCALL xpthread_bytecond_signal(xpthread_bytecond_t *cond);
+
+/**
+ * @brief Wake every waiter.
+ */
+int XPTHREADCALL xpthread_bytecond_broadcast(xpthread_bytecond_t *cond);
+
+/**
+ * @brief Create a pending future with one reference.
+ */
+int XPTHREADCALL xpthread_future_create(xpthread_future_t **future);
+
+/**
+ * @brief Take an additional reference on a future.
+ */
+void XPTHREADCALL xpthread_future_retain(xpthread_future_t *future);
+
+/**
+ * @brief Drop a reference; the future is freed with the last one.
+ */
+void XPTHREADCALL xpthread_future_release(xpthread_future_t *future);
+
+/**
+ * @brief Complete a future with value.
+ *
+ * Wakes every waiter and runs the attached continuations.
+ *
+ * @return EINVAL if the future was already completed.
+ */
+int XPTHREADCALL xpthread_future_set(xpthread_future_t *future, void *value);
+
+/**
+ * @brief Non-zero once the future is completed.
+ */
+int XPTHREADCALL xpthread_future_is_ready(const xpthread_future_t *future);
+
+/**
+ * @brief Get the value of a completed future without blocking.
+ *
+ * @return EBUSY if the future is still pending.
+ */
+int XPTHREADCALL xpthread_future_try_get(const xpthread_future_t *future, void **value);
+
+/**
+ * @brief Wait for a future and get its value.
+ *
+ * Parks on a futex over the state word. Called from a pool worker, it
+ * runs pool tasks while waiting instead of blocking the worker.
+ */
+int XPTHREADCALL xpthread_future_wait(xpthread_future_t *future, void **value);
+
+/**
+ * @brief Chain a computation on a future.
+ *
+ * Once future completes, fn(value, arg) runs and its result completes
+ * *out. With XPTHREAD_FUTURE_INLINE fn runs on the completing thread (or
+ * immediately, if future is already complete); with XPTHREAD_FUTURE_POOL
+ * it is scheduled on the default pool.
+ *
+ * @param out Receives the new future; release it when done.
+ */
+int XPTHREADCALL xpthread_future_then(
+	xpthread_future_t *future,
+	void *(*fn)(void *value, void *arg),
+	void *arg,
+	int flags,
+	xpthread_future_t **out
+);
+
+/**
+ * @brief Future completed (with NULL) once all of futures are.
+ *
+ * The individual results stay available through the input futures.
+ */
+int XPTHREADCALL xpthread_future_when_all(
+	xpthread_future_t *const *futures,
+	size_t n,
+	xpthread_future_t **out
+);
+
+/**
+ * @brief Future completed once any of futures is.
+ *
+ * Its value is the index (cast to void *) of the first completed input.
+ *
+ * @return EINVAL if n is 0.
+ */
+int XPTHREADCALL xpthread_future_when_any(
+	xpthread_future_t *const *futures,
+	size_t n,
+	xpthread_future_t **out
+);
+
+/**
+ * @brief Run fn(arg) on a pool and return its result through a future.
+ *
+ * Replaces xpthread_create() + xpthread_join() for getting a single
+ * result back, and propagates the return value on every platform.
+ *
+ * @param pool Pool to run on, NULL for xpthread_pool_default().
+ */
+int XPTHREADCALL xpthread_future_async(
+	xpthread_pool_t *pool,
+	void *(*fn)(void *arg),
+	void *arg,
+	xpthread_future_t **out
+);
+
+/**
+ * @brief Initialize an empty task group.
+ *
+ * @param pool Pool running the children, NULL for xpthread_pool_default().
+ */
+int XPTHREADCALL xpthread_taskgroup_init(xpthread_taskgroup_t *group, xpthread_pool_t *pool);
+
+/**
+ * @brief Spawn fn(spawn) as a child of group.
+ *
+ * Costs one deque push and allocates nothing: on a pool worker the child
+ * goes to the worker's own deque, where idle workers can steal it.
+ *
+ * @note This is child stealing: the spawning thread continues with its
+ *       own code and picks unstolen children back up in sync.
+ */
+int XPTHREADCALL xpthread_taskgroup_spawn(
+	xpthread_taskgroup_t *group,
+	xpthread_spawn_t *spawn,
+	void (*fn)(xpthread_spawn_t *spawn)
+);
+
+/**
+ * @brief Wait for every child spawned into group.
+ *
+ * Never blocks: runs the caller's own pending children (most recent
+ * first), then steals other pool work until the group has drained.
+ */
+int XPTHREADCALL xpthread_taskgroup_sync(xpthread_taskgroup_t *group);
+
+/**
+ * @brief Initialize an idle timer.
+ */
+void XPTHREADCALL xpthread_timer_init(xpthread_timer_t *timer);
+
+/**
+ * @brief Call fn(arg) once, delay_ms milliseconds from now.
+ *
+ * Arming a timer that is already pending moves its deadline. Callbacks run
+ * one at a time on a shared timer thread and should be short; hand longer
+ * work to a pool. Deadlines use the monotonic clock with 1ms resolution.
+ *
+ * @note The timer thread keeps a hierarchical timing wheel: insert and
+ *       cancel are O(1), and it sleeps until the nearest deadline.
+ */
+int XPTHREADCALL xpthread_schedule_after(
+	xpthread_timer_t *timer,
+	unsigned long delay_ms,
+	void (*fn)(void *arg),
+	void *arg
+);
+
+/**
+ * @brief Call fn(arg) every period_ms milliseconds, starting one period
+ * from now.
+ *
+ * Periods are measured from the previous deadline, not from when the
+ * callback finished; periods missed by a slow callback are skipped.
+ *
+ * @return 0 on success, EINVAL if period_ms is 0.
+ */
+int XPTHREADCALL xpthread_schedule_every(
+	xpthread_timer_t *timer,
+	unsigned long period_ms,
+	void (*fn)(void *arg),
+	void *arg
+);
+
+/**
+ * @brief Disarm a timer.
+ *
+ * On return the callback is neither pending nor running, unless the call
+ * comes from the callback itself. The timer may then be freed or rearmed.
+ *
+ * @return 0 if a future call was prevented, ESRCH if the timer was idle or
+ *         a one-shot timer had already fired.
+ */
+int XPTHREADCALL xpthread_timer_cancel(xpthread_timer_t *timer);
+
+/**
+ * @brief Start fn(arg) on a new fiber.
+ *
+ * Fibers are user-mode threads multiplexed onto a shared pool of carrier
+ * threads, one pinned to each CPU, started on first use. They are
+ * scheduled cooperatively: a fiber runs until it returns, calls
+ * xpthread_fiber_yield() or waits in a fiber-aware primitive. A blocking
+ * system call or xpthread_mutex_lock() stalls its carrier.
+ *
+ * POSIX: Contexts are switched by a few instructions of assembly on
+ *        x86-64 and AArch64, and by swapcontext() elsewhere. Stacks are
+ *        mmapped with a guard page; default-sized stacks are recycled.
+ *
+ * Windows: Uses the Fibers API (CreateFiberEx / SwitchToFiber).
+ *
+ * @param stack_size Stack size in bytes, 0 for XPTHREAD_FIBER_STACK_SIZE.
+ * @note Every fiber must be joined with xpthread_fiber_join(). Fibers may
+ *       move between carriers whenever they yield or wait, so their code
+ *       must not hold thread-local state across those points.
+ */
+int XPTHREADCALL xpthread_fiber_create(
+	xpthread_fiber_t **fiber,
+	size_t stack_size,
+	void *(*fn)(void *arg),
+	void *arg
+);
+
+/**
+ * @brief Let other ready fibers run.
+ *
+ * Outside a fiber this yields the processor, like sched_yield().
+ */
+void XPTHREADCALL xpthread_fiber_yield(void);
+
+/**
+ * @brief Return the calling fiber, or NULL on a plain thread.
+ */
+xpthread_fiber_t *XPTHREADCALL xpthread_fiber_self(void);
+
+/**
+ * @brief Wait for a fiber to return and release it.
+ *
+ * A fiber caller is parked and its carrier keeps running other fibers; a
+ * thread caller blocks on a futex.
+ *
+ * @return EDEADLK if a fiber joins itself.
+ */
+int XPTHREADCALL xpthread_fiber_join(xpthread_fiber_t *fiber, void **retval);
+
+/**
+ * @brief Initialize a fiber-aware mutex.
+ */
+int XPTHREADCALL xpthread_fmutex_init(xpthread_fmutex_t *mutex);
+
+/**
+ * @brief Destroy a fiber-aware mutex.
+ *
+ * @return EBUSY if the mutex is currently held.
+ */
+int XPTHREADCALL xpthread_fmutex_destroy(xpthread_fmutex_t *mutex);
+
+/**
+ * @brief Lock a fiber-aware mutex.
+ *
+ * Uncontended, this is a single compare-and-swap. Otherwise a fiber is
+ * parked on the mutex's FIFO wait queue and its carrier switches to
+ * another ready fiber; a thread blocks on a futex. Unlock hands the
+ * mutex directly to the oldest waiter.
+ */
+int XPTHREADCALL xpthread_fmutex_lock(xpthread_fmutex_t *mutex);
+
+/**
+ * @brief Try to lock a fiber-aware mutex.
+ *
+ * @return 0 on success, EBUSY if the mutex is held.
+ */
+int XPTHREADCALL xpthread_fmutex_trylock(xpthread_fmutex_t *mutex);
+
+/**
+ * @brief Unlock a fiber-aware mutex, handing it to the oldest waiter.
+ */
+int XPTHREADCALL xpthread_fmutex_unlock(xpthread_fmutex_t *mutex);
+
+/**
+ * @brief Initialize a fiber-aware condition variable.
+ */
+int XPTHREADCALL xpthread_fcond_init(xpthread_fcond_t *cond);
+
+/**
+ * @brief Destroy a fiber-aware condition variable.
+ *
+ * @return EBUSY if fibers or threads are waiting on it.
+ */
+int XPTHREADCALL xpthread_fcond_destroy(xpthread_fcond_t *cond);
+
+/**
+ * @brief Atomically unlock mutex and wait on cond, then relock mutex.
+ *
+ * Fibers park without blocking their carrier; threads sleep on a futex.
+ * As with pthread_cond_wait(), recheck the predicate in a loop.
+ */
+int XPTHREADCALL xpthread_fcond_wait(xpthread_fcond_t *cond, xpthread_fmutex_t *mutex);
+
+/**
+ * @brief Wake the oldest waiter of cond, if any.
+ */
+int XPTHREADCALL xpthread_fcond_signal(xpthread_fcond_t *cond);
+
+/**
+ * @brief Wake every waiter of cond.
+ */
+int XPTHREADCALL xpthread_fcond_broadcast(xpthread_fcond_t *cond);
+
+/*
+ * XPTHREAD_INLINE build mode.
+ *
+ * Defining XPTHREAD_INLINE before including this header turns the hottest
+ * calls into static inline code: passthroughs become direct pthread/Win32
+ * calls, and locks take their uncontended path with a single atomic
+ * operation. Contended paths still call the library, whose exported
+ * symbols are unchanged, so inline and regular callers can share objects.
+ * Taking the address of one of these functions yields the library symbol.
+ */
+#if defined(XPTHREAD_INLINE) && !defined(XPTHREAD_BUILDING)
+
+XPTHREAD_STATIC_INLINE xpthread_t xpthread__inline_self(void) {
+#ifdef _WIN32
+	return GetCurrentThread();
+#else
+	return pthread_self();
+#endif
+}
+
+XPTHREAD_STATIC_INLINE int xpthread__inline_equal(xpthread_t t1, xpthread_t t2) {
+#ifdef _WIN32
+	return t1 == t2;
+#else
+	return pthread_equal(t1, t2);
+#endif
+}
+
+XPTHREAD_STATIC_INLINE int xpthread__inline_mutex_trylock(xpthread_mutex_t *mutex) {
+#ifdef _WIN32
+	return TryEnterCriticalSection(mutex) ? 0 : EBUSY;
+#else
+	return pthread_mutex_trylock(mutex);
+#endif
+}
+
+XPTHREAD_STATIC_INLINE int xpthread__inline_mutex_lock(xpthread_mutex_t *mutex) {
+	int ret = xpthread__inline_mutex_trylock(mutex);
+	return ret == EBUSY ? (xpthread_mutex_lock)(mutex) : ret;
+}
+
+XPTHREAD_STATIC_INLINE int xpthread__inline_mutex_unlock(xpthread_mutex_t *mutex) {
+#ifdef _WIN32
+	LeaveCriticalSection(mutex);
+	return 0;
+#else
+	return pthread_mutex_unlock(mutex);
+#endif
+}
+
+XPTHREAD_STATIC_INLINE int xpthread__inline_spin_trylock(xpthread_spinlock_t *lock) {
+	if (XPTHREAD__LOAD_RELAXED(&lock->locked)) return EBUSY;
+	return XPTHREAD__XCHG(&lock->locked, 1) ? EBUSY : 0;
+}
+
+XPTHREAD_STATIC_INLINE int xpthread__inline_spin_lock(xpthread_spinlock_t *lock) {
+	return XPTHREAD__XCHG(&lock->locked, 1) ? (xpthread_spin_lock)(lock) : 0;
+}
+
+XPTHREAD_STATIC_INLINE int xpthread__inline_spin_unlock(xpthread_spinlock_t *lock) {
+	XPTHREAD__STORE_RELEASE(&lock->locked, 0);
+	return 0;
+}
+
+/* xpthread_fmutex_t: 0 unlocked, 1 locked, 2 locked with queued waiters */
+XPTHREAD_STATIC_INLINE int xpthread__inline_fmutex_trylock(xpthread_fmutex_t *mutex) {
+	return XPTHREAD__CAS32(&mutex->state, 0, 1) ? 0 : EBUSY;
+}
+
+XPTHREAD_STATIC_INLINE int xpthread__inline_fmutex_lock(xpthread_fmutex_t *mutex) {
+	return XPTHREAD__CAS32(&mutex->state, 0, 1) ? 0 : (xpthread_fmutex_lock)(mutex);
+}
+
+XPTHREAD_STATIC_INLINE int xpthread__inline_fmutex_unlock(xpthread_fmutex_t *mutex) {
+	return XPTHREAD__CAS32(&mutex->state, 1, 0) ? 0 : (xpthread_fmutex_unlock)(mutex);
+}
+
+#define xpthread_self() xpthread__inline_self()
+#define xpthread_equal(t1, t2) xpthread__inline_equal((t1), (t2))
+#define xpthread_mutex_trylock(mutex) xpthread__inline_mutex_trylock(mutex)
+#define xpthread_mutex_lock(mutex) xpthread__inline_mutex_lock(mutex)
+#define xpthread_mutex_unlock(mutex) xpthread__inline_mutex_unlock(mutex)
+#define xpthread_spin_trylock(lock) xpthread__inline_spin_trylock(lock)
+#define xpthread_spin_lock(lock) xpthread__inline_spin_lock(lock)
+#define xpthread_spin_unlock(lock) xpthread__inline_spin_unlock(lock)
+#define xpthread_fmutex_trylock(mutex) xpthread__inline_fmutex_trylock(mutex)
+#define xpthread_fmutex_lock(mutex) xpthread__inline_fmutex_lock(mutex)
+#define xpthread_fmutex_unlock(mutex) xpthread__inline_fmutex_unlock(mutex)
+
+#endif /* XPTHREAD_INLINE */
+
 #ifdef __cplusplus
 }
 #endif
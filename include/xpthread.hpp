@@ -0,0 +1,500 @@
+/**
+ * @file xpthread.hpp
+ * @brief Header-only C++ layer over xpthread.h.
+ *
+ * Policy-based mutexes with RAII guards whose fast paths inline into the
+ * caller, so only a contended lock calls into the library.
+ *
+ * C++20 coroutine awaitables: pool scheduling, an async mutex and an async
+ * semaphore. A coroutine that has to wait is suspended, never the thread
+ * running it; it is resumed by the thread that releases the resource, or
+ * queued to a pool if the object was given one.
+ *
+ * @author MrR736
+ * @date 2026
+ * @copyright GPL-3
+ */
+
+#ifndef XPTHREAD_HPP
+#define XPTHREAD_HPP
+
+#include "xpthread.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define XPTHREAD_HAS_COROUTINES 1
+#endif
+
+namespace xpthread {
+
+/**
+ * Lock policies for basic_mutex.
+ *
+ * A policy is the lock itself: it holds the lock state and provides
+ * lock(), try_lock() and unlock().
+ */
+namespace policy {
+
+/** Test-and-test-and-set spinlock; yields the CPU after a short spin. */
+class spin {
+public:
+	void lock() noexcept {
+		while (locked_.exchange(true, std::memory_order_acquire)) {
+			for (unsigned int spins = 1; locked_.load(std::memory_order_relaxed); spins++) {
+				XPTHREAD__CPU_RELAX();
+				if (spins % 64 == 0) std::this_thread::yield();
+			}
+		}
+	}
+
+	bool try_lock() noexcept {
+		return !locked_.load(std::memory_order_relaxed) &&
+			!locked_.exchange(true, std::memory_order_acquire);
+	}
+
+	void unlock() noexcept { locked_.store(false, std::memory_order_release); }
+
+private:
+	std::atomic<bool> locked_{false};
+};
+
+/**
+ * Three-state futex lock (unlocked, locked, locked with waiters).
+ *
+ * Lock and unlock are one atomic operation each unless there is
+ * contention; only then xpthread_futex_wait() / xpthread_futex_wake() are
+ * called.
+ */
+class futex {
+public:
+	void lock() noexcept {
+		std::uint32_t c = 0;
+		if (!state_.compare_exchange_strong(c, 1, std::memory_order_acquire, std::memory_order_relaxed))
+			lock_contended(c);
+	}
+
+	bool try_lock() noexcept {
+		std::uint32_t c = 0;
+		return state_.compare_exchange_strong(c, 1, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+
+	void unlock() noexcept {
+		if (state_.exchange(0, std::memory_order_release) == 2)
+			xpthread_futex_wake(word(), 1);
+	}
+
+private:
+	void lock_contended(std::uint32_t c) noexcept {
+		for (int spins = 0; c == 1 && spins < 100; spins++) {
+			XPTHREAD__CPU_RELAX();
+			c = 0;
+			if (state_.compare_exchange_weak(c, 1, std::memory_order_acquire, std::memory_order_relaxed))
+				return;
+		}
+		if (c != 2) c = state_.exchange(2, std::memory_order_acquire);
+		while (c != 0) {
+			xpthread_futex_wait(word(), 2, nullptr);
+			c = state_.exchange(2, std::memory_order_acquire);
+		}
+	}
+
+	volatile std::uint32_t *word() noexcept {
+		static_assert(sizeof(state_) == sizeof(std::uint32_t), "futex word must be 32 bits");
+		return reinterpret_cast<volatile std::uint32_t *>(&state_);
+	}
+
+	std::atomic<std::uint32_t> state_{0};
+};
+
+/** Lock counters kept by the instrumented policy. */
+struct lock_stats {
+	std::uint64_t acquisitions;
+	std::uint64_t contentions; // acquisitions that could not lock at once
+};
+
+/**
+ * Wraps another policy and counts acquisitions and contended acquisitions
+ * with relaxed atomic increments.
+ */
+template <class Inner = futex>
+class instrumented : public Inner {
+public:
+	void lock() noexcept {
+		if (!Inner::try_lock()) {
+			contentions_.fetch_add(1, std::memory_order_relaxed);
+			Inner::lock();
+		}
+		acquisitions_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	bool try_lock() noexcept {
+		if (!Inner::try_lock()) return false;
+		acquisitions_.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	lock_stats stats() const noexcept {
+		return { acquisitions_.load(std::memory_order_relaxed), contentions_.load(std::memory_order_relaxed) };
+	}
+
+private:
+	std::atomic<std::uint64_t> acquisitions_{0};
+	std::atomic<std::uint64_t> contentions_{0};
+};
+
+} // namespace policy
+
+/**
+ * Mutex whose locking strategy is chosen at compile time.
+ *
+ * Satisfies the standard Lockable requirements, so it also works with
+ * std::lock_guard and std::condition_variable_any.
+ */
+template <class Policy>
+class basic_mutex {
+public:
+	basic_mutex() = default;
+	basic_mutex(const basic_mutex &) = delete;
+	basic_mutex &operator=(const basic_mutex &) = delete;
+
+	void lock() noexcept { policy_.lock(); }
+	bool try_lock() noexcept { return policy_.try_lock(); }
+	void unlock() noexcept { policy_.unlock(); }
+
+	/** The policy object, e.g. for instrumented<>::stats(). */
+	Policy &policy() noexcept { return policy_; }
+	const Policy &policy() const noexcept { return policy_; }
+
+private:
+	Policy policy_;
+};
+
+using spin_mutex = basic_mutex<policy::spin>;
+using futex_mutex = basic_mutex<policy::futex>;
+template <class Inner = policy::futex>
+using instrumented_mutex = basic_mutex<policy::instrumented<Inner>>;
+
+/** Holds a lock for the lifetime of a scope. */
+template <class Mutex>
+class scoped_lock {
+public:
+	explicit scoped_lock(Mutex &m) noexcept : mutex_(m) { mutex_.lock(); }
+	scoped_lock(Mutex &m, std::adopt_lock_t) noexcept : mutex_(m) {}
+	~scoped_lock() { mutex_.unlock(); }
+
+	scoped_lock(const scoped_lock &) = delete;
+	scoped_lock &operator=(const scoped_lock &) = delete;
+
+private:
+	Mutex &mutex_;
+};
+
+/** Movable lock owner that can be unlocked and relocked. */
+template <class Mutex>
+class unique_lock {
+public:
+	unique_lock() noexcept = default;
+	explicit unique_lock(Mutex &m) noexcept : mutex_(&m), owns_(true) { m.lock(); }
+	unique_lock(Mutex &m, std::defer_lock_t) noexcept : mutex_(&m) {}
+	unique_lock(Mutex &m, std::try_to_lock_t) noexcept : mutex_(&m), owns_(m.try_lock()) {}
+	unique_lock(Mutex &m, std::adopt_lock_t) noexcept : mutex_(&m), owns_(true) {}
+
+	unique_lock(unique_lock &&other) noexcept : mutex_(other.mutex_), owns_(other.owns_) {
+		other.mutex_ = nullptr;
+		other.owns_ = false;
+	}
+
+	unique_lock &operator=(unique_lock &&other) noexcept {
+		if (this != &other) {
+			if (owns_) mutex_->unlock();
+			mutex_ = other.mutex_;
+			owns_ = other.owns_;
+			other.mutex_ = nullptr;
+			other.owns_ = false;
+		}
+		return *this;
+	}
+
+	~unique_lock() {
+		if (owns_) mutex_->unlock();
+	}
+
+	unique_lock(const unique_lock &) = delete;
+	unique_lock &operator=(const unique_lock &) = delete;
+
+	void lock() noexcept {
+		mutex_->lock();
+		owns_ = true;
+	}
+
+	bool try_lock() noexcept { return owns_ = mutex_->try_lock(); }
+
+	void unlock() noexcept {
+		mutex_->unlock();
+		owns_ = false;
+	}
+
+	/** Disassociate without unlocking; returns the mutex. */
+	Mutex *release() noexcept {
+		Mutex *m = mutex_;
+		mutex_ = nullptr;
+		owns_ = false;
+		return m;
+	}
+
+	Mutex *mutex() const noexcept { return mutex_; }
+	bool owns_lock() const noexcept { return owns_; }
+	explicit operator bool() const noexcept { return owns_; }
+
+private:
+	Mutex *mutex_ = nullptr;
+	bool owns_ = false;
+};
+
+namespace detail {
+
+#ifdef XPTHREAD_HAS_COROUTINES
+/**
+ * A suspended coroutine that can be queued on a pool without allocating.
+ * task must stay the first member: the pool hands back its address.
+ */
+struct resumable {
+	xpthread_task_t task;
+	std::coroutine_handle<> handle;
+	resumable *next;
+
+	static void run(xpthread_task_t *t) {
+		reinterpret_cast<resumable *>(t)->handle.resume();
+	}
+
+	// Resume on pool, or right here without one (or if queueing fails)
+	void resume_on(xpthread_pool_t *pool) {
+		if (pool) {
+			task.fn = run;
+			if (xpthread_pool_submit(pool, &task) == 0) return;
+		}
+		handle.resume();
+	}
+};
+
+/** Intrusive FIFO of suspended coroutines. */
+struct waiter_queue {
+	resumable *head = nullptr;
+	resumable *tail = nullptr;
+
+	bool empty() const noexcept { return !head; }
+
+	void push(resumable *r) noexcept {
+		r->next = nullptr;
+		if (tail) tail->next = r;
+		else head = r;
+		tail = r;
+	}
+
+	resumable *pop() noexcept {
+		resumable *r = head;
+		if (r && !(head = r->next)) tail = nullptr;
+		return r;
+	}
+};
+#endif
+
+} // namespace detail
+
+#ifdef XPTHREAD_HAS_COROUTINES
+
+/**
+ * Non-owning handle to an xpthread_pool_t.
+ *
+ * Create and destroy pools with the C API; the default-constructed handle
+ * refers to xpthread_pool_default().
+ */
+class pool {
+public:
+	pool() noexcept : pool_(xpthread_pool_default()) {}
+	explicit pool(xpthread_pool_t *p) noexcept : pool_(p) {}
+
+	xpthread_pool_t *native_handle() const noexcept { return pool_; }
+
+	class schedule_awaiter {
+	public:
+		explicit schedule_awaiter(xpthread_pool_t *p) noexcept : pool_(p) {}
+
+		bool await_ready() const noexcept { return !pool_; }
+
+		// Continue inline if the task cannot be queued
+		bool await_suspend(std::coroutine_handle<> h) noexcept {
+			node_.handle = h;
+			node_.task.fn = detail::resumable::run;
+			return xpthread_pool_submit(pool_, &node_.task) == 0;
+		}
+
+		void await_resume() const noexcept {}
+
+	private:
+		xpthread_pool_t *pool_;
+		detail::resumable node_;
+	};
+
+	/**
+	 * @brief co_await pool.schedule() continues the coroutine on a pool
+	 *        worker.
+	 *
+	 * The wait record lives in the coroutine frame, so nothing is
+	 * allocated.
+	 */
+	schedule_awaiter schedule() const noexcept { return schedule_awaiter(pool_); }
+
+private:
+	xpthread_pool_t *pool_;
+};
+
+/**
+ * Mutex for coroutines.
+ *
+ * co_await lock_async() suspends the coroutine instead of blocking its
+ * thread. unlock() hands the mutex to the oldest waiter and resumes it on
+ * the unlocking thread, or on resume_pool when one was given.
+ */
+class async_mutex {
+public:
+	explicit async_mutex(xpthread_pool_t *resume_pool = nullptr) noexcept : pool_(resume_pool) {}
+	async_mutex(const async_mutex &) = delete;
+	async_mutex &operator=(const async_mutex &) = delete;
+
+	bool try_lock() noexcept {
+		lock_.lock();
+		bool acquired = !locked_;
+		locked_ = true;
+		lock_.unlock();
+		return acquired;
+	}
+
+	class lock_awaiter {
+	public:
+		explicit lock_awaiter(async_mutex &m) noexcept : mutex_(m) {}
+
+		bool await_ready() noexcept { return mutex_.try_lock(); }
+
+		bool await_suspend(std::coroutine_handle<> h) noexcept {
+			node_.handle = h;
+			mutex_.lock_.lock();
+			if (!mutex_.locked_) {
+				mutex_.locked_ = true;
+				mutex_.lock_.unlock();
+				return false;
+			}
+			mutex_.waiters_.push(&node_);
+			mutex_.lock_.unlock();
+			return true;
+		}
+
+		void await_resume() const noexcept {}
+
+	private:
+		async_mutex &mutex_;
+		detail::resumable node_;
+	};
+
+	/** @brief co_await to acquire the mutex. */
+	lock_awaiter lock_async() noexcept { return lock_awaiter(*this); }
+
+	void unlock() noexcept {
+		lock_.lock();
+		detail::resumable *next = waiters_.pop();
+		if (!next) locked_ = false; // otherwise ownership passes to next
+		lock_.unlock();
+		if (next) next->resume_on(pool_);
+	}
+
+private:
+	policy::spin lock_;
+	bool locked_ = false;
+	detail::waiter_queue waiters_;
+	xpthread_pool_t *pool_;
+};
+
+/**
+ * Counting semaphore for coroutines.
+ *
+ * co_await acquire() takes a unit or suspends until release() provides
+ * one. Waiters are served in FIFO order and resumed on the releasing
+ * thread, or on resume_pool when one was given.
+ */
+class async_semaphore {
+public:
+	explicit async_semaphore(std::ptrdiff_t initial, xpthread_pool_t *resume_pool = nullptr) noexcept
+		: count_(initial), pool_(resume_pool) {}
+	async_semaphore(const async_semaphore &) = delete;
+	async_semaphore &operator=(const async_semaphore &) = delete;
+
+	bool try_acquire() noexcept {
+		lock_.lock();
+		bool acquired = count_ > 0;
+		if (acquired) count_--;
+		lock_.unlock();
+		return acquired;
+	}
+
+	class acquire_awaiter {
+	public:
+		explicit acquire_awaiter(async_semaphore &s) noexcept : sem_(s) {}
+
+		bool await_ready() noexcept { return sem_.try_acquire(); }
+
+		bool await_suspend(std::coroutine_handle<> h) noexcept {
+			node_.handle = h;
+			sem_.lock_.lock();
+			if (sem_.count_ > 0) {
+				sem_.count_--;
+				sem_.lock_.unlock();
+				return false;
+			}
+			sem_.waiters_.push(&node_);
+			sem_.lock_.unlock();
+			return true;
+		}
+
+		void await_resume() const noexcept {}
+
+	private:
+		async_semaphore &sem_;
+		detail::resumable node_;
+	};
+
+	/** @brief co_await to take one unit. */
+	acquire_awaiter acquire() noexcept { return acquire_awaiter(*this); }
+
+	/** @brief Return n units, handing them to waiters first. */
+	void release(std::ptrdiff_t n = 1) noexcept {
+		detail::waiter_queue wake;
+		lock_.lock();
+		while (n > 0 && !waiters_.empty()) {
+			wake.push(waiters_.pop());
+			n--;
+		}
+		count_ += n;
+		lock_.unlock();
+
+		while (detail::resumable *r = wake.pop())
+			r->resume_on(pool_);
+	}
+
+private:
+	policy::spin lock_;
+	std::ptrdiff_t count_;
+	detail::waiter_queue waiters_;
+	xpthread_pool_t *pool_;
+};
+
+#endif /* XPTHREAD_HAS_COROUTINES */
+
+} // namespace xpthread
+
+#endif /* XPTHREAD_HPP */
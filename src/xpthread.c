@@ -1,7 +1,155 @@
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // CPU_SET and friends
+#endif
+
+// the library provides the out-of-line definitions behind the inline paths
+#define XPTHREAD_BUILDING
+
 #include <errno.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "xpthread.h"
 
+#ifndef _WIN32
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/membarrier.h>
+#endif
+
+#define XPTHREAD_CACHELINE 64
+
+/*
+ * Atomic helpers.
+ *
+ * GCC/Clang (including MinGW) use the __atomic builtins, MSVC uses the
+ * Interlocked family. Only 4- and 8-byte integers are supported by the
+ * generic macros, pointers go through the _PTR variants.
+ */
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+
+#define XPTHREAD_COMPILER_BARRIER() _ReadWriteBarrier()
+#define XPTHREAD_ATOMIC_FENCE() MemoryBarrier()
+#if defined(_M_IX86) || defined(_M_X64)
+#define XPTHREAD_RELEASE_FENCE() _ReadWriteBarrier()
+#else
+#define XPTHREAD_RELEASE_FENCE() MemoryBarrier()
+#endif
+
+#define XPTHREAD_ATOMIC_LOAD(p) \
+	(sizeof(*(p)) == 8 ? \
+		_InterlockedOr64((volatile __int64 *)(p), 0) : \
+	 sizeof(*(p)) == 1 ? \
+		_InterlockedOr8((volatile char *)(p), 0) : \
+		_InterlockedOr((volatile long *)(p), 0))
+#define XPTHREAD_ATOMIC_LOAD_RELAXED(p) (*(p))
+#define XPTHREAD_ATOMIC_STORE(p, v) \
+	(sizeof(*(p)) == 8 ? \
+		(void)_InterlockedExchange64((volatile __int64 *)(p), (__int64)(v)) : \
+	 sizeof(*(p)) == 1 ? \
+		(void)_InterlockedExchange8((volatile char *)(p), (char)(v)) : \
+		(void)_InterlockedExchange((volatile long *)(p), (long)(v)))
+#define XPTHREAD_ATOMIC_XCHG(p, v) \
+	(sizeof(*(p)) == 8 ? \
+		_InterlockedExchange64((volatile __int64 *)(p), (__int64)(v)) : \
+		_InterlockedExchange((volatile long *)(p), (long)(v)))
+#define XPTHREAD_ATOMIC_FETCH_ADD(p, v) \
+	(sizeof(*(p)) == 8 ? \
+		_InterlockedExchangeAdd64((volatile __int64 *)(p), (__int64)(v)) : \
+		_InterlockedExchangeAdd((volatile long *)(p), (long)(v)))
+#define XPTHREAD_ATOMIC_CAS(p, expected, desired) \
+	(sizeof(*(p)) == 8 ? \
+		_InterlockedCompareExchange64((volatile __int64 *)(p), \
+			(__int64)(desired), (__int64)(expected)) == (__int64)(expected) : \
+	 sizeof(*(p)) == 1 ? \
+		_InterlockedCompareExchange8((volatile char *)(p), \
+			(char)(desired), (char)(expected)) == (char)(expected) : \
+		_InterlockedCompareExchange((volatile long *)(p), \
+			(long)(desired), (long)(expected)) == (long)(expected))
+
+#define XPTHREAD_ATOMIC_LOAD_PTR(p) \
+	_InterlockedCompareExchangePointer((void *volatile *)(p), NULL, NULL)
+#define XPTHREAD_ATOMIC_STORE_PTR(p, v) \
+	((void)_InterlockedExchangePointer((void *volatile *)(p), (void *)(v)))
+#define XPTHREAD_ATOMIC_XCHG_PTR(p, v) \
+	_InterlockedExchangePointer((void *volatile *)(p), (void *)(v))
+#define XPTHREAD_ATOMIC_CAS_PTR(p, expected, desired) \
+	(_InterlockedCompareExchangePointer((void *volatile *)(p), \
+		(void *)(desired), (void *)(expected)) == (void *)(expected))
+
+#else /* GCC / Clang */
+
+#define XPTHREAD_COMPILER_BARRIER() __asm__ __volatile__("" ::: "memory")
+#define XPTHREAD_ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define XPTHREAD_RELEASE_FENCE() __atomic_thread_fence(__ATOMIC_RELEASE)
+
+#define XPTHREAD_ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define XPTHREAD_ATOMIC_LOAD_RELAXED(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define XPTHREAD_ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define XPTHREAD_ATOMIC_XCHG(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define XPTHREAD_ATOMIC_FETCH_ADD(p, v) \
+	__atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define XPTHREAD_ATOMIC_CAS(p, expected, desired) \
+	__extension__ ({ \
+		__typeof__((void)0, *(p)) xp_exp_ = (expected); \
+		__atomic_compare_exchange_n((p), &xp_exp_, (desired), 0, \
+			__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+	})
+
+#define XPTHREAD_ATOMIC_LOAD_PTR(p) XPTHREAD_ATOMIC_LOAD(p)
+#define XPTHREAD_ATOMIC_STORE_PTR(p, v) XPTHREAD_ATOMIC_STORE(p, v)
+#define XPTHREAD_ATOMIC_XCHG_PTR(p, v) XPTHREAD_ATOMIC_XCHG(p, v)
+#define XPTHREAD_ATOMIC_CAS_PTR(p, expected, desired) \
+	XPTHREAD_ATOMIC_CAS(p, expected, desired)
+
+#endif
+
+/* CPU hint for spin-wait loops */
+#define XPTHREAD_CPU_RELAX() XPTHREAD__CPU_RELAX()
+
+static void xpthread_yield_cpu(void) {
+#ifdef _WIN32
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+static unsigned int xpthread_cpu_count(void) {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors ? (unsigned int)info.dwNumberOfProcessors : 1;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (unsigned int)n : 1;
+#endif
+}
+
+// Pin the calling thread to one CPU, best effort
+static int xpthread_pin_self(int cpu) {
+	if (cpu < 0) return 0;
+#ifdef _WIN32
+	if (cpu >= (int)(sizeof(DWORD_PTR) * 8)) return EINVAL;
+	return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) ? 0 : EINVAL;
+#elif defined(__linux__)
+	cpu_set_t set;
+	if (cpu >= CPU_SETSIZE) return EINVAL;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set) ? errno : 0;
+#else
+	return ENOTSUP;
+#endif
+}
+
 #ifdef __ANDROID__
 #include <signal.h>
 #define SETUP_SIG_HANDLER(sig) \
@@ -32,54 +180,348 @@
 	} while (0)
 #endif
 
-#ifdef _WIN32
-#include <process.h>
-
 #if defined(_MSC_VER)
 # define XPTHREAD_TLS __declspec(thread)
-#else
+#elif defined(_WIN32)
 # define XPTHREAD_TLS _Thread_local
+#else
+# define XPTHREAD_TLS __thread
 #endif
 
-typedef struct { void (*fn)(void); } once_ctx;
+struct xpthread_thread_rec;
+static struct xpthread_thread_rec *thread_rec_self(void);
+static struct xpthread_thread_rec *thread_rec_acquire(void);
+static void thread_rec_bind(struct xpthread_thread_rec *rec);
+static void thread_rec_put(struct xpthread_thread_rec *rec);
+
+#ifdef _WIN32
+#include <process.h>
 
 typedef struct {
 	void *(*start_routine)(void *);
 	void *arg;
 	volatile LONG cancel_requested;
 	void *retval;
+	struct xpthread_thread_rec *rec;
 } xpthread_win_ctx;
 
 static XPTHREAD_TLS xpthread_win_ctx *xpthread_self_ctx = NULL; //
 
 XPTHREAD_TLS volatile int xpthread_cancel_flag = 0;
 
-BOOL CALLBACK once_wrapper(PINIT_ONCE InitOnce, PVOID Parameter, PVOID *Context) {
-	once_ctx* ctx = (once_ctx*)Parameter;
-	if (!ctx || !ctx->fn) return FALSE;
-	ctx->fn();
-	return TRUE;
-}
-
 // Wrap the user thread function to set up cancellation
 static unsigned __stdcall thread_wrapper(void *arg) {
 	xpthread_win_ctx *ctx = (xpthread_win_ctx *)arg;
 	xpthread_self_ctx = ctx;
+	thread_rec_bind(ctx->rec);
 	void *ret = ctx->start_routine(ctx->arg);
 	ctx->retval = ret;
 	_endthreadex(0);
 	return 0;
 }
+#else
+typedef struct {
+	void *(*start_routine)(void *);
+	void *arg;
+	struct xpthread_thread_rec *rec;
+} xpthread_start_ctx;
+
+// Bind the record xpthread_create() prepared before running user code
+static void *thread_start(void *arg) {
+	xpthread_start_ctx ctx = *(xpthread_start_ctx *)arg;
+	free(arg);
+	thread_rec_bind(ctx.rec);
+	return ctx.start_routine(ctx.arg);
+}
 #endif
 
-int XPTHREADCALL xpthread_once(xpthread_once_t *once_control, void (*init_routine)(void)) {
+/*
+ * Per-thread records.
+ *
+ * Every thread that uses a subsystem needing per-thread shared state
+ * (hazard pointers, ...) owns one record. Records live in a global
+ * list and are never freed: a record whose thread exited is marked
+ * inactive and reused by the next thread, so scanners can walk the list
+ * without synchronizing with thread exit. Threads created with
+ * xpthread_create() get their record before start_routine runs, other
+ * threads on first use. The record is released by a thread-exit
+ * destructor (pthread key / FLS callback).
+ */
+typedef struct {
+	void *ptr;
+	void (*free_fn)(void *);
+} hp_retired;
+
+typedef struct {
+	void *ptr;
+	void (*free_fn)(void *);
+	long epoch;
+} epoch_retired;
+
+typedef struct {
+	epoch_retired *items;
+	size_t count;
+	size_t cap;
+} epoch_bag;
+
+typedef struct xpthread_thread_rec {
+	struct xpthread_thread_rec *next;
+	volatile long active;
+
+	void *volatile hazards[XPTHREAD_HAZARD_SLOTS];
+	hp_retired *retired;
+	size_t nretired;
+	size_t retired_cap;
+
+	// (epoch << 1) | 1 while inside a critical region, 0 outside
+	volatile long epoch_state;
+	unsigned int epoch_nest;
+	unsigned int epoch_retires;
+	unsigned int epoch_collecting; // free_fn callbacks are running
+	epoch_bag limbo;
+
+	// snapshot of the RCU grace-period counter plus nesting count
+	volatile unsigned long rcu_ctr;
+
+	// references held by the thread and by xpthread_create() until it
+	// published the owner; the record is reusable once they are dropped
+	volatile long refs;
+
+	// owning thread, valid while owned is REC_OWNED, and its xpthread_park()
+	// permit / futex word
 #ifdef _WIN32
-	once_ctx ctx = { init_routine };
-	BOOL result = InitOnceExecuteOnce(once_control, once_wrapper, &ctx, NULL);
-	return result ? 0 : -1;
+	DWORD owner;
+#else
+	pthread_t owner;
+#endif
+	volatile long owned;
+	volatile uint32_t park_permit;
+
+	// parking lot queue node: 1 in lot_parked while queued on lot_addr
+	struct xpthread_thread_rec *lot_next;
+	const void *lot_addr;
+	uintptr_t lot_token;
+	uint64_t lot_since;
+	volatile uint32_t lot_parked;
+} xpthread_thread_rec;
+
+/* thread_rec.owned states */
+#define REC_UNOWNED 0
+#define REC_OWNED 1
+#define REC_EXITED 2
+
+static xpthread_thread_rec *volatile thread_recs = NULL;
+static volatile long thread_rec_count = 0;
+static XPTHREAD_TLS xpthread_thread_rec *thread_rec = NULL;
+
+static void hp_scan(xpthread_thread_rec *rec);
+static void epoch_orphan_limbo(xpthread_thread_rec *rec);
+
+/*
+ * Minimal internal wait set (mutex + condition variable) for background
+ * threads. Statically initializable on every platform.
+ */
+#ifdef _WIN32
+typedef struct {
+	SRWLOCK lock;
+	CONDITION_VARIABLE cond;
+} xp_waitset;
+#define XP_WAITSET_INITIALIZER { SRWLOCK_INIT, CONDITION_VARIABLE_INIT }
+#define xp_waitset_lock(w) AcquireSRWLockExclusive(&(w)->lock)
+#define xp_waitset_unlock(w) ReleaseSRWLockExclusive(&(w)->lock)
+#define xp_waitset_wait(w) SleepConditionVariableSRW(&(w)->cond, &(w)->lock, INFINITE, 0)
+#define xp_waitset_broadcast(w) WakeAllConditionVariable(&(w)->cond)
+#define xp_waitset_signal(w) WakeConditionVariable(&(w)->cond)
+#else
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} xp_waitset;
+#define XP_WAITSET_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER }
+#define xp_waitset_lock(w) pthread_mutex_lock(&(w)->lock)
+#define xp_waitset_unlock(w) pthread_mutex_unlock(&(w)->lock)
+#define xp_waitset_wait(w) pthread_cond_wait(&(w)->cond, &(w)->lock)
+#define xp_waitset_broadcast(w) pthread_cond_broadcast(&(w)->cond)
+#define xp_waitset_signal(w) pthread_cond_signal(&(w)->cond)
+#endif
+
+// Drop a reference; the last one makes the record reusable
+static void thread_rec_put(xpthread_thread_rec *rec) {
+	if (XPTHREAD_ATOMIC_FETCH_ADD(&rec->refs, -1) == 1)
+		XPTHREAD_ATOMIC_STORE(&rec->active, 0);
+}
+
+static void thread_rec_release(xpthread_thread_rec *rec) {
+	for (int i = 0; i < XPTHREAD_HAZARD_SLOTS; i++)
+		XPTHREAD_ATOMIC_STORE_PTR(&rec->hazards[i], NULL);
+	// leftovers stay in the record for the next owner or a helping scan
+	if (rec->nretired) hp_scan(rec);
+
+	rec->epoch_nest = 0;
+	XPTHREAD_ATOMIC_STORE(&rec->epoch_state, 0);
+	if (rec->limbo.count) epoch_orphan_limbo(rec);
+
+	XPTHREAD_ATOMIC_STORE(&rec->owned, REC_EXITED);
+	XPTHREAD_ATOMIC_STORE(&rec->park_permit, 0);
+
+	if (thread_rec == rec) thread_rec = NULL;
+	thread_rec_put(rec);
+}
+
+#ifdef _WIN32
+static DWORD thread_rec_fls = FLS_OUT_OF_INDEXES;
+
+static VOID WINAPI thread_rec_destructor(PVOID value) {
+	if (value) thread_rec_release((xpthread_thread_rec *)value);
+}
+
+static BOOL CALLBACK thread_rec_key_init(PINIT_ONCE once, PVOID param, PVOID *context) {
+	thread_rec_fls = FlsAlloc(thread_rec_destructor);
+	return TRUE;
+}
+#else
+static pthread_key_t thread_rec_key;
+static pthread_once_t thread_rec_key_once = PTHREAD_ONCE_INIT;
+
+static void thread_rec_destructor(void *value) {
+	if (value) thread_rec_release((xpthread_thread_rec *)value);
+}
+
+static void thread_rec_key_init(void) {
+	pthread_key_create(&thread_rec_key, thread_rec_destructor);
+}
+#endif
+
+static xpthread_thread_rec *thread_rec_acquire(void) {
+	xpthread_thread_rec *rec;
+
+	// reuse the record of an exited thread first
+	for (rec = XPTHREAD_ATOMIC_LOAD_PTR(&thread_recs); rec; rec = rec->next) {
+		if (!XPTHREAD_ATOMIC_LOAD_RELAXED(&rec->active) &&
+		    XPTHREAD_ATOMIC_CAS(&rec->active, 0, 1)) {
+			rec->refs = 1;
+			XPTHREAD_ATOMIC_STORE(&rec->owned, REC_UNOWNED);
+			return rec;
+		}
+	}
+
+	rec = calloc(1, sizeof(*rec));
+	if (!rec) return NULL;
+	rec->active = 1;
+	rec->refs = 1;
+
+	xpthread_thread_rec *head;
+	do {
+		head = XPTHREAD_ATOMIC_LOAD_PTR(&thread_recs);
+		rec->next = head;
+	} while (!XPTHREAD_ATOMIC_CAS_PTR(&thread_recs, head, rec));
+	XPTHREAD_ATOMIC_FETCH_ADD(&thread_rec_count, 1);
+	return rec;
+}
+
+/*
+ * Publish the owner for xpthread_unpark(): the id is written before the
+ * state, and not at all if the thread already exited.
+ */
+#ifdef _WIN32
+static void thread_rec_set_owner(xpthread_thread_rec *rec, DWORD owner) {
+#else
+static void thread_rec_set_owner(xpthread_thread_rec *rec, pthread_t owner) {
+#endif
+	rec->owner = owner;
+	XPTHREAD_ATOMIC_CAS(&rec->owned, REC_UNOWNED, REC_OWNED);
+}
+
+// Make rec the calling thread's record, released when the thread exits
+static void thread_rec_bind(xpthread_thread_rec *rec) {
+	thread_rec = rec;
+#ifdef _WIN32
+	static INIT_ONCE key_once = INIT_ONCE_STATIC_INIT;
+	InitOnceExecuteOnce(&key_once, thread_rec_key_init, NULL, NULL);
+	FlsSetValue(thread_rec_fls, rec);
+#else
+	pthread_once(&thread_rec_key_once, thread_rec_key_init);
+	pthread_setspecific(thread_rec_key, rec);
+#endif
+}
+
+// The calling thread's record, NULL if none exists and none can be allocated
+static xpthread_thread_rec *thread_rec_try_self(void) {
+	xpthread_thread_rec *rec = thread_rec;
+	if (rec) return rec;
+
+	rec = thread_rec_acquire();
+	if (!rec) return NULL;
+#ifdef _WIN32
+	thread_rec_set_owner(rec, GetCurrentThreadId());
 #else
-	return pthread_once(once_control, init_routine);
+	thread_rec_set_owner(rec, pthread_self());
 #endif
+	thread_rec_bind(rec);
+	return rec;
+}
+
+/*
+ * For callers without an error return (epoch and RCU read sides, hazard
+ * slots): they cannot run without a record, so out of memory is fatal.
+ */
+static xpthread_thread_rec *thread_rec_self(void) {
+	xpthread_thread_rec *rec = thread_rec_try_self();
+	if (!rec) abort();
+	return rec;
+}
+
+/*
+ * Called before a potentially blocking xpthread wait.
+ *
+ * A thread outside any epoch critical region never holds back the global
+ * epoch, but the nodes in its own limbo list are only freed when it runs
+ * again. Hand them to the shared orphan list so a parked thread does not
+ * stall reclamation.
+ */
+static void thread_rec_park(void) {
+	xpthread_thread_rec *rec = thread_rec;
+	if (rec && rec->epoch_nest == 0 && !rec->epoch_collecting && rec->limbo.count)
+		epoch_orphan_limbo(rec);
+}
+
+/*
+ * Once: INIT -> RUNNING -> DONE, with WAITING instead of RUNNING when
+ * other callers sleep on the state word.
+ */
+#define ONCE_INIT 0
+#define ONCE_RUNNING 1
+#define ONCE_WAITING 2
+#define ONCE_DONE XPTHREAD__ONCE_DONE
+
+int XPTHREADCALL xpthread_once_arg(xpthread_once_t *once_control, void (*init_routine)(void *arg), void *arg) {
+	if (!once_control || !init_routine) return EINVAL;
+	for (;;) {
+		uint32_t state = XPTHREAD_ATOMIC_LOAD(&once_control->state);
+		if (state == ONCE_DONE) return 0;
+		if (state == ONCE_INIT) {
+			if (!XPTHREAD_ATOMIC_CAS(&once_control->state, ONCE_INIT, ONCE_RUNNING)) continue;
+			init_routine(arg);
+			if (XPTHREAD_ATOMIC_XCHG(&once_control->state, ONCE_DONE) == ONCE_WAITING)
+				xpthread_futex_wake(&once_control->state, INT32_MAX);
+			return 0;
+		}
+		if (state == ONCE_RUNNING && !XPTHREAD_ATOMIC_CAS(&once_control->state, ONCE_RUNNING, ONCE_WAITING))
+			continue;
+		xpthread_futex_wait(&once_control->state, ONCE_WAITING, NULL);
+	}
+}
+
+typedef struct { void (*fn)(void); } once_ctx;
+
+static void once_call(void *arg) {
+	((once_ctx *)arg)->fn();
+}
+
+int XPTHREADCALL xpthread_once(xpthread_once_t *once_control, void (*init_routine)(void)) {
+	if (!init_routine) return EINVAL;
+	once_ctx ctx = { init_routine };
+	return xpthread_once_arg(once_control, once_call, &ctx);
 }
 
 int XPTHREADCALL xpthread_create(xpthread_t *thread,
@@ -94,24 +536,61 @@ int XPTHREADCALL xpthread_create(xpthread_t *thread,
 
 	ctx->start_routine = start_routine;
 	ctx->arg = arg;
+	xpthread_thread_rec *rec = thread_rec_acquire();
+	if (!rec) {
+		free(ctx);
+		return ENOMEM;
+	}
+	XPTHREAD_ATOMIC_FETCH_ADD(&rec->refs, 1); // ours until published
+	ctx->rec = rec;
 
+	unsigned int id;
 	HANDLE h = (HANDLE)_beginthreadex(
-		NULL, 0, thread_wrapper, ctx, 0, NULL
+		NULL, 0, thread_wrapper, ctx, 0, &id
 	);
 
 	if (!h) {
+		thread_rec_put(rec);
+		thread_rec_put(rec);
 		free(ctx);
 		return EAGAIN;
 	}
 
+	// registered before returning, so the thread can be unparked at once
+	thread_rec_set_owner(rec, id);
+	thread_rec_put(rec);
 	*thread = h;
 	return 0;
 #else
-	return pthread_create(thread, attr, start_routine, arg);
+	xpthread_start_ctx *ctx = malloc(sizeof(*ctx));
+	if (!ctx) return ENOMEM;
+
+	ctx->start_routine = start_routine;
+	ctx->arg = arg;
+	xpthread_thread_rec *rec = thread_rec_acquire();
+	if (!rec) {
+		free(ctx);
+		return ENOMEM;
+	}
+	XPTHREAD_ATOMIC_FETCH_ADD(&rec->refs, 1); // ours until published
+	ctx->rec = rec;
+
+	int ret = pthread_create(thread, attr, thread_start, ctx);
+	if (ret) {
+		thread_rec_put(rec);
+		thread_rec_put(rec);
+		free(ctx);
+		return ret;
+	}
+	// registered before returning, so the thread can be unparked at once
+	thread_rec_set_owner(rec, *thread);
+	thread_rec_put(rec);
+	return 0;
 #endif
 }
 
 int XPTHREADCALL xpthread_join(xpthread_t thread, void **retval) {
+	thread_rec_park();
 #ifdef _WIN32
 	WaitForSingleObject(thread, INFINITE);
 	DWORD code;
@@ -231,9 +710,15 @@ int XPTHREADCALL xpthread_mutex_destroy(xpthread_mutex_t *mutex) {
 
 int XPTHREADCALL xpthread_mutex_lock(xpthread_mutex_t *mutex) {
 #ifdef _WIN32
-	EnterCriticalSection(mutex);
+	if (!TryEnterCriticalSection(mutex)) {
+		thread_rec_park();
+		EnterCriticalSection(mutex);
+	}
 	return 0;
 #else
+	int ret = pthread_mutex_trylock(mutex);
+	if (ret != EBUSY) return ret;
+	thread_rec_park();
 	return pthread_mutex_lock(mutex);
 #endif
 }
@@ -255,6 +740,57 @@ int XPTHREADCALL xpthread_mutex_trylock(xpthread_mutex_t *mutex) {
 #endif
 }
 
+/*
+ * Multi-mutex locking. Mutexes are taken in ascending address order, so
+ * any set of threads locking overlapping sets this way cannot deadlock.
+ * The next mutex is found by scanning for the lowest address above the
+ * previous one: O(n^2), but n is a handful and no scratch buffer or sort
+ * is needed, and duplicate entries are skipped for free.
+ */
+static xpthread_mutex_t *mutex_next_above(xpthread_mutex_t *const *mutexes, size_t n, uintptr_t above) {
+	xpthread_mutex_t *next = NULL;
+	for (size_t i = 0; i < n; i++) {
+		uintptr_t a = (uintptr_t)mutexes[i];
+		if (a > above && (!next || a < (uintptr_t)next)) next = mutexes[i];
+	}
+	return next;
+}
+
+int XPTHREADCALL xpthread_mutex_lock_n(xpthread_mutex_t *const *mutexes, size_t n) {
+	if (!mutexes && n) return EINVAL;
+	for (size_t i = 0; i < n; i++)
+		if (!mutexes[i]) return EINVAL;
+
+	xpthread_mutex_t *m;
+	for (uintptr_t last = 0; (m = mutex_next_above(mutexes, n, last)) != NULL; last = (uintptr_t)m) {
+		int ret = xpthread_mutex_lock(m);
+		if (ret) {
+			// release what we hold, highest first
+			xpthread_mutex_t *held;
+			for (uintptr_t below = (uintptr_t)m;;) {
+				held = NULL;
+				for (size_t i = 0; i < n; i++) {
+					uintptr_t a = (uintptr_t)mutexes[i];
+					if (a < below && (!held || a > (uintptr_t)held)) held = mutexes[i];
+				}
+				if (!held) break;
+				xpthread_mutex_unlock(held);
+				below = (uintptr_t)held;
+			}
+			return ret;
+		}
+	}
+	return 0;
+}
+
+int XPTHREADCALL xpthread_mutex_unlock_n(xpthread_mutex_t *const *mutexes, size_t n) {
+	if (!mutexes && n) return EINVAL;
+	xpthread_mutex_t *m;
+	for (uintptr_t last = 0; (m = mutex_next_above(mutexes, n, last)) != NULL; last = (uintptr_t)m)
+		xpthread_mutex_unlock(m);
+	return 0;
+}
+
 void XPTHREADCALL xpthread_get_realtime(struct timespec *ts) {
 #ifdef _WIN32
 	FILETIME ft;
@@ -273,6 +809,7 @@ void XPTHREADCALL xpthread_get_realtime(struct timespec *ts) {
 
 int XPTHREADCALL xpthread_mutex_timedlock(xpthread_mutex_t *mutex, const struct timespec *abstime)
 {
+	thread_rec_park();
 #ifdef _WIN32
 	DWORD timeout_ms;
 	if (abstime) {
@@ -347,3 +884,3729 @@ void XPTHREADCALL xpthread_exit(void *retval) {
 	pthread_exit(retval);
 #endif
 }
+
+int XPTHREADCALL xpthread_spin_init(xpthread_spinlock_t *lock) {
+	if (!lock) return EINVAL;
+	lock->locked = 0;
+	lock->backoff_min = XPTHREAD_SPIN_BACKOFF_MIN;
+	lock->backoff_max = XPTHREAD_SPIN_BACKOFF_MAX;
+	return 0;
+}
+
+int XPTHREADCALL xpthread_spin_destroy(xpthread_spinlock_t *lock) {
+	if (!lock) return EINVAL;
+	return XPTHREAD_ATOMIC_LOAD(&lock->locked) ? EBUSY : 0;
+}
+
+int XPTHREADCALL xpthread_spin_setbackoff(xpthread_spinlock_t *lock, unsigned int min_spins, unsigned int max_spins) {
+	if (!lock || min_spins == 0 || min_spins > max_spins) return EINVAL;
+	lock->backoff_min = min_spins;
+	lock->backoff_max = max_spins;
+	return 0;
+}
+
+int XPTHREADCALL xpthread_spin_lock(xpthread_spinlock_t *lock) {
+	unsigned int delay = lock->backoff_min;
+	for (;;) {
+		// test first so waiters spin in their own cache instead of bouncing the line
+		if (!XPTHREAD_ATOMIC_LOAD_RELAXED(&lock->locked) &&
+		    !XPTHREAD_ATOMIC_XCHG(&lock->locked, 1))
+			return 0;
+
+		for (unsigned int i = 0; i < delay; i++)
+			XPTHREAD_CPU_RELAX();
+
+		if (delay < lock->backoff_max) {
+			delay <<= 1;
+			if (delay > lock->backoff_max) delay = lock->backoff_max;
+		} else {
+			xpthread_yield_cpu(); // holder is probably preempted
+		}
+	}
+}
+
+int XPTHREADCALL xpthread_spin_trylock(xpthread_spinlock_t *lock) {
+	if (XPTHREAD_ATOMIC_LOAD_RELAXED(&lock->locked)) return EBUSY;
+	return XPTHREAD_ATOMIC_XCHG(&lock->locked, 1) ? EBUSY : 0;
+}
+
+int XPTHREADCALL xpthread_spin_unlock(xpthread_spinlock_t *lock) {
+	XPTHREAD_ATOMIC_STORE(&lock->locked, 0);
+	return 0;
+}
+
+int XPTHREADCALL xpthread_ticket_init(xpthread_ticketlock_t *lock) {
+	if (!lock) return EINVAL;
+	lock->next = 0;
+	lock->serving = 0;
+	lock->backoff_base = XPTHREAD_TICKET_BACKOFF_BASE;
+	return 0;
+}
+
+int XPTHREADCALL xpthread_ticket_destroy(xpthread_ticketlock_t *lock) {
+	if (!lock) return EINVAL;
+	return XPTHREAD_ATOMIC_LOAD(&lock->next) != XPTHREAD_ATOMIC_LOAD(&lock->serving) ? EBUSY : 0;
+}
+
+int XPTHREADCALL xpthread_ticket_setbackoff(xpthread_ticketlock_t *lock, unsigned int spins_per_waiter) {
+	if (!lock || spins_per_waiter == 0) return EINVAL;
+	lock->backoff_base = spins_per_waiter;
+	return 0;
+}
+
+int XPTHREADCALL xpthread_ticket_lock(xpthread_ticketlock_t *lock) {
+	unsigned long ticket = (unsigned long)XPTHREAD_ATOMIC_FETCH_ADD(&lock->next, 1);
+	unsigned int rounds = 0;
+	for (;;) {
+		unsigned long serving = (unsigned long)XPTHREAD_ATOMIC_LOAD(&lock->serving);
+		if (serving == ticket) return 0;
+
+		// wait roughly as long as the waiters ahead of us need
+		unsigned long ahead = ticket - serving;
+		for (unsigned long i = 0; i < ahead * lock->backoff_base; i++)
+			XPTHREAD_CPU_RELAX();
+
+		if (++rounds >= 64) {
+			xpthread_yield_cpu();
+			rounds = 0;
+		}
+	}
+}
+
+int XPTHREADCALL xpthread_ticket_trylock(xpthread_ticketlock_t *lock) {
+	long serving = XPTHREAD_ATOMIC_LOAD(&lock->serving);
+	if (XPTHREAD_ATOMIC_LOAD_RELAXED(&lock->next) != serving) return EBUSY;
+	return XPTHREAD_ATOMIC_CAS(&lock->next, serving, (long)((unsigned long)serving + 1)) ? 0 : EBUSY;
+}
+
+int XPTHREADCALL xpthread_ticket_unlock(xpthread_ticketlock_t *lock) {
+	// only the holder writes serving, a plain read is enough
+	XPTHREAD_ATOMIC_STORE(&lock->serving,
+		(long)((unsigned long)XPTHREAD_ATOMIC_LOAD_RELAXED(&lock->serving) + 1));
+	return 0;
+}
+
+/* Upper bound of publication list scans per combining session */
+#define XPTHREAD_FC_MAX_PASSES 4
+
+int XPTHREADCALL xpthread_fc_init(xpthread_fc_t *fc, void *state, xpthread_fc_fn apply) {
+	if (!fc || !apply) return EINVAL;
+	xpthread_spin_init(&fc->combiner);
+	fc->head = NULL;
+	fc->state = state;
+	fc->apply = apply;
+	return 0;
+}
+
+int XPTHREADCALL xpthread_fc_destroy(xpthread_fc_t *fc) {
+	if (!fc) return EINVAL;
+	return XPTHREAD_ATOMIC_LOAD_PTR(&fc->head) ? EBUSY : 0;
+}
+
+int XPTHREADCALL xpthread_fc_record_init(xpthread_fc_record_t *rec) {
+	if (!rec) return EINVAL;
+	rec->next = NULL;
+	rec->op = NULL;
+	rec->pending = 0;
+	rec->linked = 0;
+	return 0;
+}
+
+// Caller holds the combiner role
+static void fc_combine(xpthread_fc_t *fc) {
+	for (int pass = 0; pass < XPTHREAD_FC_MAX_PASSES; pass++) {
+		int applied = 0;
+		xpthread_fc_record_t *r = XPTHREAD_ATOMIC_LOAD_PTR(&fc->head);
+		for (; r; r = r->next) {
+			if (!XPTHREAD_ATOMIC_LOAD(&r->pending)) continue;
+			fc->apply(fc->state, r->op);
+			XPTHREAD_ATOMIC_STORE(&r->pending, 0);
+			applied++;
+		}
+		if (!applied) break;
+	}
+}
+
+int XPTHREADCALL xpthread_fc_execute(xpthread_fc_t *fc, xpthread_fc_record_t *rec, void *op) {
+	if (!fc || !rec) return EINVAL;
+
+	rec->op = op;
+	XPTHREAD_ATOMIC_STORE(&rec->pending, 1);
+
+	if (!rec->linked) {
+		// new records are only ever pushed at the head
+		xpthread_fc_record_t *h;
+		do {
+			h = XPTHREAD_ATOMIC_LOAD_PTR(&fc->head);
+			rec->next = h;
+		} while (!XPTHREAD_ATOMIC_CAS_PTR(&fc->head, h, rec));
+		rec->linked = 1;
+	}
+
+	unsigned int spins = 0;
+	while (XPTHREAD_ATOMIC_LOAD(&rec->pending)) {
+		if (xpthread_spin_trylock(&fc->combiner) == 0) {
+			fc_combine(fc);
+			xpthread_spin_unlock(&fc->combiner);
+			continue;
+		}
+		XPTHREAD_CPU_RELAX();
+		if (++spins % 1024 == 0) xpthread_yield_cpu();
+	}
+	return 0;
+}
+
+int XPTHREADCALL xpthread_fc_record_release(xpthread_fc_t *fc, xpthread_fc_record_t *rec) {
+	if (!fc || !rec) return EINVAL;
+	if (!rec->linked) return 0;
+
+	// unlinking below the head is only safe while nobody combines
+	xpthread_spin_lock(&fc->combiner);
+	if (!XPTHREAD_ATOMIC_CAS_PTR(&fc->head, rec, rec->next)) {
+		xpthread_fc_record_t *prev = XPTHREAD_ATOMIC_LOAD_PTR(&fc->head);
+		while (prev && prev->next != rec) prev = prev->next;
+		if (prev) prev->next = rec->next;
+	}
+	xpthread_spin_unlock(&fc->combiner);
+
+	rec->next = NULL;
+	rec->linked = 0;
+	return 0;
+}
+
+struct xpthread_delegate_slot {
+	// written by the client
+	union {
+		struct {
+			xpthread_delegate_fn fn;
+			void *arg;
+			volatile long seq;
+			volatile long in_use;
+		} v;
+		char pad[XPTHREAD_CACHELINE];
+	} req;
+	// written by the server
+	union {
+		struct {
+			void *ret;
+			volatile long seq;
+		} v;
+		char pad[XPTHREAD_CACHELINE];
+	} resp;
+};
+
+/* Empty scans before the server starts yielding its time slice */
+#define XPTHREAD_DELEGATE_IDLE_SPINS 4096
+
+static void *delegate_server(void *arg) {
+	xpthread_delegate_t *d = (xpthread_delegate_t *)arg;
+	unsigned int idle = 0;
+
+	// init waits for the pin result; ENOTSUP means the platform cannot pin
+	int ret = xpthread_pin_self(d->cpu);
+	XPTHREAD_ATOMIC_STORE(&d->pin_status, ret == ENOTSUP ? 0 : ret);
+	if (ret && ret != ENOTSUP) return NULL;
+
+	while (!XPTHREAD_ATOMIC_LOAD(&d->stop)) {
+		int served = 0;
+		for (unsigned int i = 0; i < d->nslots; i++) {
+			struct xpthread_delegate_slot *slot = &d->slots[i];
+			long seq = XPTHREAD_ATOMIC_LOAD(&slot->req.v.seq);
+			if (seq == slot->resp.v.seq) continue;
+
+			slot->resp.v.ret = slot->req.v.fn(d->state, slot->req.v.arg);
+			XPTHREAD_ATOMIC_STORE(&slot->resp.v.seq, seq);
+			served = 1;
+		}
+
+		if (served) {
+			idle = 0;
+		} else if (++idle < XPTHREAD_DELEGATE_IDLE_SPINS) {
+			XPTHREAD_CPU_RELAX();
+		} else {
+			xpthread_yield_cpu();
+		}
+	}
+	return NULL;
+}
+
+int XPTHREADCALL xpthread_delegate_init(xpthread_delegate_t *d, void *state, unsigned int nclients, int cpu) {
+	if (!d || nclients == 0 || cpu >= (int)xpthread_cpu_count()) return EINVAL;
+
+	size_t size = sizeof(struct xpthread_delegate_slot) * nclients;
+	d->slots_mem = calloc(1, size + XPTHREAD_CACHELINE);
+	if (!d->slots_mem) return ENOMEM;
+	d->slots = (struct xpthread_delegate_slot *)
+		(((uintptr_t)d->slots_mem + XPTHREAD_CACHELINE - 1) & ~(uintptr_t)(XPTHREAD_CACHELINE - 1));
+	d->nslots = nclients;
+	d->cpu = cpu;
+	d->stop = 0;
+	d->pin_status = -1;
+	d->state = state;
+
+	int ret = xpthread_create(&d->thread, NULL, delegate_server, d);
+	if (ret == 0) {
+		long status;
+		while ((status = XPTHREAD_ATOMIC_LOAD(&d->pin_status)) < 0) xpthread_yield_cpu();
+		if (status) {
+			// the server returned without serving anything
+			xpthread_join(d->thread, NULL);
+			ret = (int)status;
+		}
+	}
+	if (ret) {
+		free(d->slots_mem);
+		d->slots_mem = NULL;
+		d->slots = NULL;
+	}
+	return ret;
+}
+
+int XPTHREADCALL xpthread_delegate_destroy(xpthread_delegate_t *d) {
+	if (!d || !d->slots) return EINVAL;
+	XPTHREAD_ATOMIC_STORE(&d->stop, 1);
+	xpthread_join(d->thread, NULL);
+	free(d->slots_mem);
+	d->slots_mem = NULL;
+	d->slots = NULL;
+	return 0;
+}
+
+int XPTHREADCALL xpthread_delegate_register(xpthread_delegate_t *d, int *client) {
+	if (!d || !client) return EINVAL;
+	for (unsigned int i = 0; i < d->nslots; i++) {
+		if (XPTHREAD_ATOMIC_CAS(&d->slots[i].req.v.in_use, 0, 1)) {
+			*client = (int)i;
+			return 0;
+		}
+	}
+	return EAGAIN;
+}
+
+int XPTHREADCALL xpthread_delegate_unregister(xpthread_delegate_t *d, int client) {
+	if (!d || client < 0 || (unsigned int)client >= d->nslots) return EINVAL;
+	XPTHREAD_ATOMIC_STORE(&d->slots[client].req.v.in_use, 0);
+	return 0;
+}
+
+void *XPTHREADCALL xpthread_delegate_call(xpthread_delegate_t *d, int client, xpthread_delegate_fn fn, void *arg) {
+	if (!d || !fn || client < 0 || (unsigned int)client >= d->nslots) return NULL;
+
+	struct xpthread_delegate_slot *slot = &d->slots[client];
+	long seq = (long)((unsigned long)slot->req.v.seq + 1);
+	unsigned int spins = 0;
+
+	slot->req.v.fn = fn;
+	slot->req.v.arg = arg;
+	XPTHREAD_ATOMIC_STORE(&slot->req.v.seq, seq);
+
+	while (XPTHREAD_ATOMIC_LOAD(&slot->resp.v.seq) != seq) {
+		XPTHREAD_CPU_RELAX();
+		if (++spins % 1024 == 0) xpthread_yield_cpu();
+	}
+	return slot->resp.v.ret;
+}
+
+static int hp_ptr_cmp(const void *a, const void *b) {
+	uintptr_t pa = (uintptr_t)*(void *const *)a;
+	uintptr_t pb = (uintptr_t)*(void *const *)b;
+	return pa < pb ? -1 : pa > pb;
+}
+
+// Take over the retired nodes left behind by exited threads
+static void hp_adopt_orphans(xpthread_thread_rec *rec) {
+	for (xpthread_thread_rec *r = XPTHREAD_ATOMIC_LOAD_PTR(&thread_recs); r; r = r->next) {
+		if (r == rec || XPTHREAD_ATOMIC_LOAD_RELAXED(&r->active) || !r->nretired) continue;
+		if (!XPTHREAD_ATOMIC_CAS(&r->active, 0, 1)) continue;
+
+		size_t need = rec->nretired + r->nretired;
+		if (need > rec->retired_cap) {
+			hp_retired *grown = realloc(rec->retired, need * sizeof(*grown));
+			if (!grown) {
+				XPTHREAD_ATOMIC_STORE(&r->active, 0);
+				return;
+			}
+			rec->retired = grown;
+			rec->retired_cap = need;
+		}
+		for (size_t i = 0; i < r->nretired; i++)
+			rec->retired[rec->nretired++] = r->retired[i];
+		r->nretired = 0;
+		XPTHREAD_ATOMIC_STORE(&r->active, 0);
+	}
+}
+
+static void hp_scan(xpthread_thread_rec *rec) {
+	// pairs with the fence in xpthread_hazard_protect()
+	XPTHREAD_ATOMIC_FENCE();
+
+	size_t cap = (size_t)XPTHREAD_ATOMIC_LOAD(&thread_rec_count) * XPTHREAD_HAZARD_SLOTS;
+	void **protected_ptrs = malloc((cap ? cap : 1) * sizeof(void *));
+	if (!protected_ptrs) return;
+
+	size_t nprotected = 0;
+	for (xpthread_thread_rec *r = XPTHREAD_ATOMIC_LOAD_PTR(&thread_recs); r; r = r->next) {
+		for (int i = 0; i < XPTHREAD_HAZARD_SLOTS && nprotected < cap; i++) {
+			void *p = XPTHREAD_ATOMIC_LOAD_PTR(&r->hazards[i]);
+			if (p) protected_ptrs[nprotected++] = p;
+		}
+	}
+	qsort(protected_ptrs, nprotected, sizeof(void *), hp_ptr_cmp);
+
+	size_t kept = 0;
+	for (size_t i = 0; i < rec->nretired; i++) {
+		hp_retired node = rec->retired[i];
+		if (bsearch(&node.ptr, protected_ptrs, nprotected, sizeof(void *), hp_ptr_cmp))
+			rec->retired[kept++] = node;
+		else
+			node.free_fn(node.ptr);
+	}
+	rec->nretired = kept;
+	free(protected_ptrs);
+}
+
+void *XPTHREADCALL xpthread_hazard_protect(int slot, void *const volatile *src) {
+	if (slot < 0 || slot >= XPTHREAD_HAZARD_SLOTS) return NULL;
+	xpthread_thread_rec *rec = thread_rec_self();
+	void *p = XPTHREAD_ATOMIC_LOAD_PTR(src);
+	for (;;) {
+		XPTHREAD_ATOMIC_STORE_PTR(&rec->hazards[slot], p);
+		// the hazard must be visible before src is validated
+		XPTHREAD_ATOMIC_FENCE();
+		void *again = XPTHREAD_ATOMIC_LOAD_PTR(src);
+		if (again == p) return p;
+		p = again;
+	}
+}
+
+int XPTHREADCALL xpthread_hazard_set(int slot, void *ptr) {
+	if (slot < 0 || slot >= XPTHREAD_HAZARD_SLOTS) return EINVAL;
+	xpthread_thread_rec *rec = thread_rec_self();
+	XPTHREAD_ATOMIC_STORE_PTR(&rec->hazards[slot], ptr);
+	XPTHREAD_ATOMIC_FENCE();
+	return 0;
+}
+
+int XPTHREADCALL xpthread_hazard_clear(int slot) {
+	if (slot < 0 || slot >= XPTHREAD_HAZARD_SLOTS) return EINVAL;
+	XPTHREAD_ATOMIC_STORE_PTR(&thread_rec_self()->hazards[slot], NULL);
+	return 0;
+}
+
+int XPTHREADCALL xpthread_hazard_retire(void *ptr, void (*free_fn)(void *)) {
+	if (!free_fn) return EINVAL;
+	xpthread_thread_rec *rec = thread_rec_try_self();
+	if (!rec) return ENOMEM;
+
+	if (rec->nretired == rec->retired_cap) {
+		size_t cap = rec->retired_cap ? rec->retired_cap * 2 : XPTHREAD_HAZARD_SCAN_MIN;
+		hp_retired *grown = realloc(rec->retired, cap * sizeof(*grown));
+		if (!grown) return ENOMEM;
+		rec->retired = grown;
+		rec->retired_cap = cap;
+	}
+	rec->retired[rec->nretired].ptr = ptr;
+	rec->retired[rec->nretired].free_fn = free_fn;
+	rec->nretired++;
+
+	// scanning at twice the number of hazards frees at least half the list
+	size_t threshold = (size_t)XPTHREAD_ATOMIC_LOAD_RELAXED(&thread_rec_count) * XPTHREAD_HAZARD_SLOTS * 2;
+	if (threshold < XPTHREAD_HAZARD_SCAN_MIN) threshold = XPTHREAD_HAZARD_SCAN_MIN;
+	if (rec->nretired >= threshold) {
+		hp_adopt_orphans(rec);
+		hp_scan(rec);
+	}
+	return 0;
+}
+
+void XPTHREADCALL xpthread_hazard_scan(void) {
+	xpthread_thread_rec *rec = thread_rec_self();
+	hp_adopt_orphans(rec);
+	hp_scan(rec);
+}
+
+/* Global epoch, advanced once every thread in a critical region saw it */
+static volatile long epoch_global = 0;
+
+/* Nodes handed over by exited or parked threads */
+static epoch_bag epoch_orphans;
+static xpthread_spinlock_t epoch_orphans_lock = XPTHREAD_SPINLOCK_INITIALIZER;
+
+static int epoch_bag_push(epoch_bag *bag, void *ptr, void (*free_fn)(void *), long epoch) {
+	if (bag->count == bag->cap) {
+		size_t cap = bag->cap ? bag->cap * 2 : XPTHREAD_EPOCH_COLLECT_INTERVAL;
+		epoch_retired *grown = realloc(bag->items, cap * sizeof(*grown));
+		if (!grown) return ENOMEM;
+		bag->items = grown;
+		bag->cap = cap;
+	}
+	bag->items[bag->count].ptr = ptr;
+	bag->items[bag->count].free_fn = free_fn;
+	bag->items[bag->count].epoch = epoch;
+	bag->count++;
+	return 0;
+}
+
+/*
+ * Move everything retired at least two epochs before the current one out
+ * of the bag into a new array. The callbacks run later, without the bag
+ * or its lock, since they may block, retire more nodes or park the
+ * thread. Returns 0 (nothing is collected) if the array cannot be
+ * allocated.
+ */
+static size_t epoch_bag_take_due(epoch_bag *bag, long epoch, epoch_retired **due) {
+	size_t n = 0;
+	for (size_t i = 0; i < bag->count; i++)
+		if ((unsigned long)epoch - (unsigned long)bag->items[i].epoch >= 2) n++;
+	if (!n || !(*due = malloc(n * sizeof(**due)))) return 0;
+
+	size_t kept = 0, taken = 0;
+	for (size_t i = 0; i < bag->count; i++) {
+		epoch_retired node = bag->items[i];
+		if ((unsigned long)epoch - (unsigned long)node.epoch >= 2)
+			(*due)[taken++] = node;
+		else
+			bag->items[kept++] = node;
+	}
+	bag->count = kept;
+	return n;
+}
+
+static void epoch_free_due(epoch_retired *due, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		due[i].free_fn(due[i].ptr);
+	free(due);
+}
+
+/*
+ * Free what is due in the caller's limbo list, then in the orphan list.
+ * Without wait the orphans are skipped while another thread holds them.
+ */
+static void epoch_collect_due(xpthread_thread_rec *rec, long epoch, int wait) {
+	epoch_retired *due = NULL;
+	unsigned int collecting = rec->epoch_collecting;
+	size_t n;
+
+	// a free_fn that blocks must not hand the limbo list to the orphans
+	rec->epoch_collecting = 1;
+	n = epoch_bag_take_due(&rec->limbo, epoch, &due);
+	if (n) epoch_free_due(due, n);
+
+	if (wait) {
+		xpthread_spin_lock(&epoch_orphans_lock);
+	} else if (!XPTHREAD_ATOMIC_LOAD_RELAXED(&epoch_orphans.count) ||
+		   xpthread_spin_trylock(&epoch_orphans_lock)) {
+		rec->epoch_collecting = collecting;
+		return;
+	}
+	n = epoch_bag_take_due(&epoch_orphans, epoch, &due);
+	xpthread_spin_unlock(&epoch_orphans_lock);
+	if (n) epoch_free_due(due, n);
+	rec->epoch_collecting = collecting;
+}
+
+static void epoch_orphan_limbo(xpthread_thread_rec *rec) {
+	xpthread_spin_lock(&epoch_orphans_lock);
+	size_t moved = 0;
+	for (; moved < rec->limbo.count; moved++) {
+		epoch_retired *node = &rec->limbo.items[moved];
+		if (epoch_bag_push(&epoch_orphans, node->ptr, node->free_fn, node->epoch)) break;
+	}
+	xpthread_spin_unlock(&epoch_orphans_lock);
+
+	// keep whatever did not fit
+	for (size_t i = moved; i < rec->limbo.count; i++)
+		rec->limbo.items[i - moved] = rec->limbo.items[i];
+	rec->limbo.count -= moved;
+}
+
+static long epoch_try_advance(void) {
+	long epoch = XPTHREAD_ATOMIC_LOAD(&epoch_global);
+
+	for (xpthread_thread_rec *r = XPTHREAD_ATOMIC_LOAD_PTR(&thread_recs); r; r = r->next) {
+		long state = XPTHREAD_ATOMIC_LOAD(&r->epoch_state);
+		if ((state & 1) && (state >> 1) != epoch) return epoch;
+	}
+
+	long next = (long)((unsigned long)epoch + 1);
+	if (XPTHREAD_ATOMIC_CAS(&epoch_global, epoch, next)) return next;
+	return XPTHREAD_ATOMIC_LOAD(&epoch_global);
+}
+
+static void epoch_collect(xpthread_thread_rec *rec) {
+	epoch_collect_due(rec, epoch_try_advance(), 0);
+}
+
+void XPTHREADCALL xpthread_epoch_enter(void) {
+	xpthread_thread_rec *rec = thread_rec_self();
+	if (rec->epoch_nest++) return;
+
+	// the store must be visible before any shared pointer is read
+	long epoch = XPTHREAD_ATOMIC_LOAD_RELAXED(&epoch_global);
+	XPTHREAD_ATOMIC_XCHG(&rec->epoch_state, (long)(((unsigned long)epoch << 1) | 1));
+}
+
+void XPTHREADCALL xpthread_epoch_exit(void) {
+	xpthread_thread_rec *rec = thread_rec;
+	if (!rec || !rec->epoch_nest) return;
+	if (--rec->epoch_nest) return;
+	XPTHREAD_ATOMIC_STORE(&rec->epoch_state, 0);
+}
+
+int XPTHREADCALL xpthread_epoch_retire(void *ptr, void (*free_fn)(void *)) {
+	if (!free_fn) return EINVAL;
+	xpthread_thread_rec *rec = thread_rec_try_self();
+	if (!rec) return ENOMEM;
+
+	int ret = epoch_bag_push(&rec->limbo, ptr, free_fn, XPTHREAD_ATOMIC_LOAD(&epoch_global));
+	if (ret) return ret;
+
+	if (++rec->epoch_retires >= XPTHREAD_EPOCH_COLLECT_INTERVAL) {
+		rec->epoch_retires = 0;
+		epoch_collect(rec);
+	}
+	return 0;
+}
+
+void XPTHREADCALL xpthread_epoch_collect(void) {
+	epoch_collect(thread_rec_self());
+}
+
+int XPTHREADCALL xpthread_epoch_barrier(void) {
+	xpthread_thread_rec *rec = thread_rec_try_self();
+	if (!rec) return ENOMEM;
+	if (rec->epoch_nest) return EDEADLK;
+
+	long start = XPTHREAD_ATOMIC_LOAD(&epoch_global);
+	long seen = start;
+	unsigned int spins = 0;
+	while ((unsigned long)seen - (unsigned long)start < 2) {
+		long now = epoch_try_advance();
+		if (now != seen) {
+			seen = now;
+			continue;
+		}
+		XPTHREAD_CPU_RELAX();
+		if (++spins % 64 == 0) xpthread_yield_cpu();
+	}
+
+	epoch_collect_due(rec, XPTHREAD_ATOMIC_LOAD(&epoch_global), 1);
+	return 0;
+}
+
+/*
+ * Userspace RCU.
+ *
+ * The grace-period counter carries a phase bit; readers copy it into their
+ * record when entering the outermost section. A grace period flips the
+ * phase twice and waits for every reader still running in the old phase.
+ * With an expedited process-wide barrier available (membarrier on Linux,
+ * FlushProcessWriteBuffers on Windows) the reader side only needs compiler
+ * barriers; the writer forces the fences onto running readers instead.
+ */
+#define RCU_GP_COUNT 1UL
+#define RCU_GP_CTR_PHASE (1UL << (sizeof(unsigned long) * 4))
+#define RCU_NEST_MASK (RCU_GP_CTR_PHASE - 1)
+
+static volatile unsigned long rcu_gp_ctr = RCU_GP_COUNT;
+/* Readers that still see 0 use full fences, which is always safe */
+static volatile long rcu_has_membarrier = 0;
+static xpthread_once_t rcu_init_once = XPTHREAD_ONCE_INIT;
+static xpthread_spinlock_t rcu_gp_lock = XPTHREAD_SPINLOCK_INITIALIZER;
+
+static void rcu_init(void) {
+#if defined(_WIN32)
+	XPTHREAD_ATOMIC_STORE(&rcu_has_membarrier, 1);
+#elif defined(__linux__) && defined(__NR_membarrier)
+	long cmds = syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0);
+	if (cmds > 0 && (cmds & MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+	    syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0)
+		XPTHREAD_ATOMIC_STORE(&rcu_has_membarrier, 1);
+#endif
+}
+
+static void rcu_reader_barrier(void) {
+	if (XPTHREAD_ATOMIC_LOAD_RELAXED(&rcu_has_membarrier))
+		XPTHREAD_COMPILER_BARRIER();
+	else
+		XPTHREAD_ATOMIC_FENCE();
+}
+
+// Full barrier on every running thread of the process
+static void rcu_heavy_barrier(void) {
+	if (!XPTHREAD_ATOMIC_LOAD(&rcu_has_membarrier)) {
+		XPTHREAD_ATOMIC_FENCE();
+		return;
+	}
+#if defined(_WIN32)
+	FlushProcessWriteBuffers();
+#elif defined(__linux__) && defined(__NR_membarrier)
+	if (syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) != 0)
+		XPTHREAD_ATOMIC_FENCE();
+#endif
+}
+
+void XPTHREADCALL xpthread_rcu_read_lock(void) {
+	xpthread_thread_rec *rec = thread_rec_self();
+	unsigned long tmp = rec->rcu_ctr;
+
+	if (!(tmp & RCU_NEST_MASK)) {
+		XPTHREAD_ATOMIC_STORE(&rec->rcu_ctr, XPTHREAD_ATOMIC_LOAD_RELAXED(&rcu_gp_ctr));
+		rcu_reader_barrier();
+	} else {
+		rec->rcu_ctr = tmp + RCU_GP_COUNT;
+	}
+}
+
+void XPTHREADCALL xpthread_rcu_read_unlock(void) {
+	xpthread_thread_rec *rec = thread_rec;
+	rcu_reader_barrier();
+	XPTHREAD_ATOMIC_STORE(&rec->rcu_ctr, rec->rcu_ctr - RCU_GP_COUNT);
+}
+
+static int rcu_reader_in_old_phase(xpthread_thread_rec *rec) {
+	unsigned long v = XPTHREAD_ATOMIC_LOAD(&rec->rcu_ctr);
+	return (v & RCU_NEST_MASK) && ((v ^ XPTHREAD_ATOMIC_LOAD_RELAXED(&rcu_gp_ctr)) & RCU_GP_CTR_PHASE);
+}
+
+void XPTHREADCALL xpthread_synchronize_rcu(void) {
+	xpthread_once(&rcu_init_once, rcu_init);
+	xpthread_spin_lock(&rcu_gp_lock);
+
+	// order the caller's unlink before the readers' snapshots are read
+	rcu_heavy_barrier();
+
+	for (int flip = 0; flip < 2; flip++) {
+		XPTHREAD_ATOMIC_STORE(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR_PHASE);
+		XPTHREAD_ATOMIC_FENCE();
+
+		for (xpthread_thread_rec *r = XPTHREAD_ATOMIC_LOAD_PTR(&thread_recs); r; r = r->next) {
+			unsigned int spins = 0;
+			while (rcu_reader_in_old_phase(r)) {
+				XPTHREAD_CPU_RELAX();
+				if (++spins % 64 == 0) xpthread_yield_cpu();
+			}
+		}
+	}
+
+	// readers' loads complete before the caller frees anything
+	rcu_heavy_barrier();
+	xpthread_spin_unlock(&rcu_gp_lock);
+}
+
+/* call_rcu() queue, drained in batches by a background thread */
+static xpthread_rcu_head_t *volatile rcu_cb_head = NULL;
+static volatile unsigned long rcu_cb_queued = 0;
+static volatile unsigned long rcu_cb_done = 0;
+static xp_waitset rcu_cb_waitset = XP_WAITSET_INITIALIZER;
+static volatile long rcu_cb_started = 0;
+
+static void *rcu_cb_thread(void *arg) {
+	(void)arg;
+	for (;;) {
+		xp_waitset_lock(&rcu_cb_waitset);
+		while (!XPTHREAD_ATOMIC_LOAD_PTR(&rcu_cb_head))
+			xp_waitset_wait(&rcu_cb_waitset);
+		xp_waitset_unlock(&rcu_cb_waitset);
+
+		xpthread_rcu_head_t *batch = XPTHREAD_ATOMIC_XCHG_PTR(&rcu_cb_head, NULL);
+
+		// the queue is a stack, run callbacks in submission order
+		xpthread_rcu_head_t *fifo = NULL;
+		unsigned long n = 0;
+		while (batch) {
+			xpthread_rcu_head_t *next = batch->next;
+			batch->next = fifo;
+			fifo = batch;
+			batch = next;
+			n++;
+		}
+
+		// one grace period covers the whole batch
+		xpthread_synchronize_rcu();
+		while (fifo) {
+			xpthread_rcu_head_t *next = fifo->next;
+			fifo->func(fifo);
+			fifo = next;
+		}
+
+		xp_waitset_lock(&rcu_cb_waitset);
+		XPTHREAD_ATOMIC_STORE(&rcu_cb_done, rcu_cb_done + n);
+		xp_waitset_broadcast(&rcu_cb_waitset);
+		xp_waitset_unlock(&rcu_cb_waitset);
+	}
+	return NULL;
+}
+
+// Start the callback thread unless it runs already; a failure is retried on the next call
+static int rcu_cb_start(void) {
+	int ret = 0;
+	xp_waitset_lock(&rcu_cb_waitset);
+	if (!rcu_cb_started) {
+		xpthread_t th;
+		ret = xpthread_create(&th, NULL, rcu_cb_thread, NULL);
+		if (ret == 0) {
+			xpthread_detach(th);
+			XPTHREAD_ATOMIC_STORE(&rcu_cb_started, 1);
+		}
+	}
+	xp_waitset_unlock(&rcu_cb_waitset);
+	return ret;
+}
+
+int XPTHREADCALL xpthread_call_rcu(xpthread_rcu_head_t *head, void (*func)(xpthread_rcu_head_t *head)) {
+	if (!head || !func) return EINVAL;
+	if (!XPTHREAD_ATOMIC_LOAD(&rcu_cb_started)) {
+		// nothing is queued without a thread to run it, so rcu_barrier cannot hang
+		int ret = rcu_cb_start();
+		if (ret) return ret;
+	}
+
+	head->func = func;
+	xpthread_rcu_head_t *top;
+	do {
+		top = XPTHREAD_ATOMIC_LOAD_PTR(&rcu_cb_head);
+		head->next = top;
+	} while (!XPTHREAD_ATOMIC_CAS_PTR(&rcu_cb_head, top, head));
+
+	xp_waitset_lock(&rcu_cb_waitset);
+	rcu_cb_queued++;
+	if (!top) xp_waitset_broadcast(&rcu_cb_waitset);
+	xp_waitset_unlock(&rcu_cb_waitset);
+	return 0;
+}
+
+void XPTHREADCALL xpthread_rcu_barrier(void) {
+	xp_waitset_lock(&rcu_cb_waitset);
+	unsigned long target = rcu_cb_queued;
+	while ((long)(rcu_cb_done - target) < 0)
+		xp_waitset_wait(&rcu_cb_waitset);
+	xp_waitset_unlock(&rcu_cb_waitset);
+}
+
+int XPTHREADCALL xpthread_seqlock_init(xpthread_seqlock_t *sl) {
+	if (!sl) return EINVAL;
+	sl->seq = 0;
+	return xpthread_spin_init(&sl->writer);
+}
+
+int XPTHREADCALL xpthread_seqlock_destroy(xpthread_seqlock_t *sl) {
+	if (!sl) return EINVAL;
+	return (XPTHREAD_ATOMIC_LOAD(&sl->seq) & 1) ? EBUSY : xpthread_spin_destroy(&sl->writer);
+}
+
+int XPTHREADCALL xpthread_seqlock_write_lock(xpthread_seqlock_t *sl) {
+	xpthread_spin_lock(&sl->writer);
+	XPTHREAD_ATOMIC_STORE(&sl->seq, sl->seq + 1);
+	// odd sequence must be visible before the data changes
+	XPTHREAD_RELEASE_FENCE();
+	return 0;
+}
+
+int XPTHREADCALL xpthread_seqlock_write_unlock(xpthread_seqlock_t *sl) {
+	XPTHREAD_ATOMIC_STORE(&sl->seq, sl->seq + 1);
+	xpthread_spin_unlock(&sl->writer);
+	return 0;
+}
+
+/* Each indicator stripe sits on its own cache line */
+#define LR_STRIDE (XPTHREAD_CACHELINE / sizeof(long))
+
+static volatile long lr_next_stripe = 0;
+static XPTHREAD_TLS int lr_stripe = -1;
+
+static volatile long *lr_indicator(xpthread_leftright_t *lr, long version, int stripe) {
+	return lr->indicators + ((size_t)version * XPTHREAD_LR_STRIPES + (size_t)stripe) * LR_STRIDE;
+}
+
+static void lr_wait_empty(xpthread_leftright_t *lr, long version) {
+	for (int i = 0; i < XPTHREAD_LR_STRIPES; i++) {
+		unsigned int spins = 0;
+		while (XPTHREAD_ATOMIC_LOAD(lr_indicator(lr, version, i))) {
+			XPTHREAD_CPU_RELAX();
+			if (++spins % 64 == 0) xpthread_yield_cpu();
+		}
+	}
+}
+
+int XPTHREADCALL xpthread_lr_init(xpthread_leftright_t *lr, void *left, void *right) {
+	if (!lr) return EINVAL;
+
+	size_t size = 2 * XPTHREAD_LR_STRIPES * XPTHREAD_CACHELINE;
+	lr->indicators_mem = calloc(1, size + XPTHREAD_CACHELINE);
+	if (!lr->indicators_mem) return ENOMEM;
+	lr->indicators = (volatile long *)
+		(((uintptr_t)lr->indicators_mem + XPTHREAD_CACHELINE - 1) & ~(uintptr_t)(XPTHREAD_CACHELINE - 1));
+
+	lr->instances[0] = left;
+	lr->instances[1] = right;
+	lr->left_right = 0;
+	lr->version_index = 0;
+	return xpthread_mutex_init(&lr->writer);
+}
+
+int XPTHREADCALL xpthread_lr_destroy(xpthread_leftright_t *lr) {
+	if (!lr || !lr->indicators_mem) return EINVAL;
+	free(lr->indicators_mem);
+	lr->indicators_mem = NULL;
+	lr->indicators = NULL;
+	return xpthread_mutex_destroy(&lr->writer);
+}
+
+const void *XPTHREADCALL xpthread_lr_read_lock(xpthread_leftright_t *lr, unsigned int *token) {
+	int stripe = lr_stripe;
+	if (stripe < 0) {
+		stripe = (int)((unsigned long)XPTHREAD_ATOMIC_FETCH_ADD(&lr_next_stripe, 1) % XPTHREAD_LR_STRIPES);
+		lr_stripe = stripe;
+	}
+
+	long version = XPTHREAD_ATOMIC_LOAD(&lr->version_index);
+	XPTHREAD_ATOMIC_FETCH_ADD(lr_indicator(lr, version, stripe), 1);
+	*token = (unsigned int)(version * XPTHREAD_LR_STRIPES + stripe);
+
+	return lr->instances[XPTHREAD_ATOMIC_LOAD(&lr->left_right)];
+}
+
+void XPTHREADCALL xpthread_lr_read_unlock(xpthread_leftright_t *lr, unsigned int token) {
+	XPTHREAD_ATOMIC_FETCH_ADD(lr_indicator(lr, token / XPTHREAD_LR_STRIPES, token % XPTHREAD_LR_STRIPES), -1);
+}
+
+int XPTHREADCALL xpthread_lr_write(xpthread_leftright_t *lr, void (*fn)(void *instance, void *arg), void *arg) {
+	if (!lr || !fn) return EINVAL;
+	xpthread_mutex_lock(&lr->writer);
+
+	long live = XPTHREAD_ATOMIC_LOAD_RELAXED(&lr->left_right);
+	fn(lr->instances[!live], arg);
+	XPTHREAD_ATOMIC_XCHG(&lr->left_right, !live);
+
+	// drain both indicators so no reader can still be on the old replica
+	long prev = XPTHREAD_ATOMIC_LOAD_RELAXED(&lr->version_index);
+	lr_wait_empty(lr, !prev);
+	XPTHREAD_ATOMIC_XCHG(&lr->version_index, !prev);
+	lr_wait_empty(lr, prev);
+
+	fn(lr->instances[live], arg);
+
+	xpthread_mutex_unlock(&lr->writer);
+	return 0;
+}
+
+/*
+ * Worker pool.
+ *
+ * Every worker owns a deque: it pushes and pops at the bottom (LIFO, cache
+ * friendly for recursive splitting) and idle workers steal from the top.
+ * Tasks submitted from outside the pool go through a shared injection
+ * queue. Threads waiting on pool work (including non-workers) help by
+ * running tasks instead of blocking.
+ */
+typedef struct {
+	xpthread_spinlock_t lock;
+	xpthread_task_t **buf;
+	size_t cap;
+	volatile size_t head;
+	volatile size_t tail;
+} task_deque;
+
+typedef struct {
+	struct xpthread_pool *pool;
+	xpthread_t thread;
+	unsigned int index;
+	task_deque deque;
+} pool_worker;
+
+struct xpthread_pool {
+	pool_worker *workers;
+	unsigned int nworkers;
+
+	xpthread_spinlock_t inject_lock;
+	xpthread_task_t *inject_head;
+	xpthread_task_t *inject_tail;
+	volatile long inject_count;
+
+	// sleeping workers wait for work_seq to change
+	xp_waitset idle;
+	volatile long work_seq;
+	volatile long sleepers;
+	volatile long stop;
+	int pinned; // worker i runs on CPU i
+};
+
+static XPTHREAD_TLS pool_worker *pool_self = NULL;
+
+/* Spins of an idle worker before it goes to sleep */
+#define POOL_IDLE_SPINS 256
+
+static int deque_push(task_deque *dq, xpthread_task_t *task) {
+	xpthread_spin_lock(&dq->lock);
+	if (dq->tail - dq->head == dq->cap) {
+		size_t cap = dq->cap ? dq->cap * 2 : 64;
+		xpthread_task_t **buf = malloc(cap * sizeof(*buf));
+		if (!buf) {
+			xpthread_spin_unlock(&dq->lock);
+			return ENOMEM;
+		}
+		for (size_t i = dq->head; i != dq->tail; i++)
+			buf[i & (cap - 1)] = dq->buf[i & (dq->cap - 1)];
+		free(dq->buf);
+		dq->buf = buf;
+		dq->cap = cap;
+	}
+	dq->buf[dq->tail & (dq->cap - 1)] = task;
+	XPTHREAD_ATOMIC_STORE(&dq->tail, dq->tail + 1);
+	xpthread_spin_unlock(&dq->lock);
+	return 0;
+}
+
+static xpthread_task_t *deque_pop(task_deque *dq) {
+	if (XPTHREAD_ATOMIC_LOAD_RELAXED(&dq->head) == XPTHREAD_ATOMIC_LOAD_RELAXED(&dq->tail)) return NULL;
+	xpthread_task_t *task = NULL;
+	xpthread_spin_lock(&dq->lock);
+	if (dq->head != dq->tail) {
+		XPTHREAD_ATOMIC_STORE(&dq->tail, dq->tail - 1);
+		task = dq->buf[dq->tail & (dq->cap - 1)];
+	}
+	xpthread_spin_unlock(&dq->lock);
+	return task;
+}
+
+static xpthread_task_t *deque_steal(task_deque *dq) {
+	if (XPTHREAD_ATOMIC_LOAD_RELAXED(&dq->head) == XPTHREAD_ATOMIC_LOAD_RELAXED(&dq->tail)) return NULL;
+	xpthread_task_t *task = NULL;
+	if (xpthread_spin_trylock(&dq->lock)) return NULL;
+	if (dq->head != dq->tail) {
+		task = dq->buf[dq->head & (dq->cap - 1)];
+		XPTHREAD_ATOMIC_STORE(&dq->head, dq->head + 1);
+	}
+	xpthread_spin_unlock(&dq->lock);
+	return task;
+}
+
+static void pool_notify(xpthread_pool_t *pool) {
+	XPTHREAD_ATOMIC_FETCH_ADD(&pool->work_seq, 1);
+	if (XPTHREAD_ATOMIC_LOAD(&pool->sleepers)) {
+		xp_waitset_lock(&pool->idle);
+		xp_waitset_signal(&pool->idle);
+		xp_waitset_unlock(&pool->idle);
+	}
+}
+
+static void pool_inject(xpthread_pool_t *pool, xpthread_task_t *task) {
+	task->next = NULL;
+	xpthread_spin_lock(&pool->inject_lock);
+	if (pool->inject_tail)
+		pool->inject_tail->next = task;
+	else
+		pool->inject_head = task;
+	pool->inject_tail = task;
+	XPTHREAD_ATOMIC_FETCH_ADD(&pool->inject_count, 1);
+	xpthread_spin_unlock(&pool->inject_lock);
+}
+
+static xpthread_task_t *pool_take_injected(xpthread_pool_t *pool) {
+	if (!XPTHREAD_ATOMIC_LOAD_RELAXED(&pool->inject_count)) return NULL;
+	xpthread_spin_lock(&pool->inject_lock);
+	xpthread_task_t *task = pool->inject_head;
+	if (task) {
+		pool->inject_head = task->next;
+		if (!pool->inject_head) pool->inject_tail = NULL;
+		XPTHREAD_ATOMIC_FETCH_ADD(&pool->inject_count, -1);
+	}
+	xpthread_spin_unlock(&pool->inject_lock);
+	return task;
+}
+
+// Queue on the caller's own deque when it is a worker of this pool
+static int pool_push(xpthread_pool_t *pool, xpthread_task_t *task) {
+	pool_worker *self = pool_self;
+	if (self && self->pool == pool) {
+		int ret = deque_push(&self->deque, task);
+		if (ret) return ret;
+	} else {
+		pool_inject(pool, task);
+	}
+	pool_notify(pool);
+	return 0;
+}
+
+static xpthread_task_t *pool_find_task(xpthread_pool_t *pool) {
+	pool_worker *self = pool_self;
+	xpthread_task_t *task;
+	unsigned int start = 0;
+
+	if (self && self->pool == pool) {
+		if ((task = deque_pop(&self->deque))) return task;
+		start = self->index + 1;
+	}
+	if ((task = pool_take_injected(pool))) return task;
+
+	for (unsigned int i = 0; i < pool->nworkers; i++) {
+		pool_worker *victim = &pool->workers[(start + i) % pool->nworkers];
+		if (victim == self) continue;
+		if ((task = deque_steal(&victim->deque))) return task;
+	}
+	return NULL;
+}
+
+// Run pool tasks until *counter drops to zero
+static void pool_help_until_zero(xpthread_pool_t *pool, volatile long *counter) {
+	unsigned int spins = 0;
+	while (XPTHREAD_ATOMIC_LOAD(counter)) {
+		xpthread_task_t *task = pool_find_task(pool);
+		if (task) {
+			task->fn(task);
+			spins = 0;
+			continue;
+		}
+		XPTHREAD_CPU_RELAX();
+		if (++spins % 64 == 0) xpthread_yield_cpu();
+	}
+}
+
+static void *pool_worker_main(void *arg) {
+	pool_worker *self = (pool_worker *)arg;
+	xpthread_pool_t *pool = self->pool;
+	pool_self = self;
+	if (pool->pinned) xpthread_pin_self((int)(self->index % xpthread_cpu_count()));
+
+	for (;;) {
+		long seq = XPTHREAD_ATOMIC_LOAD(&pool->work_seq);
+		xpthread_task_t *task = NULL;
+
+		for (unsigned int spins = 0; spins < POOL_IDLE_SPINS; spins++) {
+			if ((task = pool_find_task(pool))) break;
+			XPTHREAD_CPU_RELAX();
+		}
+		if (task) {
+			task->fn(task);
+			continue;
+		}
+		if (XPTHREAD_ATOMIC_LOAD(&pool->stop)) break;
+
+		thread_rec_park();
+		xp_waitset_lock(&pool->idle);
+		XPTHREAD_ATOMIC_FETCH_ADD(&pool->sleepers, 1);
+		while (XPTHREAD_ATOMIC_LOAD(&pool->work_seq) == seq && !XPTHREAD_ATOMIC_LOAD(&pool->stop))
+			xp_waitset_wait(&pool->idle);
+		XPTHREAD_ATOMIC_FETCH_ADD(&pool->sleepers, -1);
+		xp_waitset_unlock(&pool->idle);
+	}
+
+	pool_self = NULL;
+	return NULL;
+}
+
+static int pool_create(xpthread_pool_t **out, unsigned int nthreads, int pinned) {
+	if (!out) return EINVAL;
+	if (!nthreads) nthreads = xpthread_cpu_count();
+
+	xpthread_pool_t *pool = calloc(1, sizeof(*pool));
+	if (!pool) return ENOMEM;
+	pool->workers = calloc(nthreads, sizeof(*pool->workers));
+	if (!pool->workers) {
+		free(pool);
+		return ENOMEM;
+	}
+	xpthread_spin_init(&pool->inject_lock);
+	xp_waitset idle = XP_WAITSET_INITIALIZER;
+	pool->idle = idle;
+	pool->pinned = pinned;
+
+	for (unsigned int i = 0; i < nthreads; i++) {
+		pool_worker *w = &pool->workers[i];
+		w->pool = pool;
+		w->index = i;
+		xpthread_spin_init(&w->deque.lock);
+	}
+	pool->nworkers = nthreads;
+
+	for (unsigned int i = 0; i < nthreads; i++) {
+		int ret = xpthread_create(&pool->workers[i].thread, NULL, pool_worker_main, &pool->workers[i]);
+		if (ret) {
+			pool->nworkers = i;
+			xpthread_pool_destroy(pool);
+			return ret;
+		}
+	}
+
+	*out = pool;
+	return 0;
+}
+
+int XPTHREADCALL xpthread_pool_create(xpthread_pool_t **out, unsigned int nthreads) {
+	return pool_create(out, nthreads, 0);
+}
+
+int XPTHREADCALL xpthread_pool_destroy(xpthread_pool_t *pool) {
+	if (!pool) return EINVAL;
+
+	xp_waitset_lock(&pool->idle);
+	XPTHREAD_ATOMIC_STORE(&pool->stop, 1);
+	xp_waitset_broadcast(&pool->idle);
+	xp_waitset_unlock(&pool->idle);
+
+	for (unsigned int i = 0; i < pool->nworkers; i++)
+		xpthread_join(pool->workers[i].thread, NULL);
+	for (unsigned int i = 0; i < pool->nworkers; i++)
+		free(pool->workers[i].deque.buf);
+#ifndef _WIN32
+	pthread_mutex_destroy(&pool->idle.lock);
+	pthread_cond_destroy(&pool->idle.cond);
+#endif
+	free(pool->workers);
+	free(pool);
+	return 0;
+}
+
+static xpthread_pool_t *pool_default = NULL;
+static xpthread_once_t pool_default_once = XPTHREAD_ONCE_INIT;
+
+static void pool_default_init(void) {
+	xpthread_pool_create(&pool_default, 0);
+}
+
+xpthread_pool_t *XPTHREADCALL xpthread_pool_default(void) {
+	xpthread_once(&pool_default_once, pool_default_init);
+	return pool_default;
+}
+
+unsigned int XPTHREADCALL xpthread_pool_size(const xpthread_pool_t *pool) {
+	return pool ? pool->nworkers : 0;
+}
+
+int XPTHREADCALL xpthread_pool_submit(xpthread_pool_t *pool, xpthread_task_t *task) {
+	if (!pool || !task || !task->fn) return EINVAL;
+	if (XPTHREAD_ATOMIC_LOAD(&pool->stop)) return EINVAL;
+	return pool_push(pool, task);
+}
+
+/*
+ * Parallel loops.
+ *
+ * A range task keeps halving its range, pushing the upper half as a new
+ * task, until it is at most grain long and runs it. Idle workers steal
+ * the large upper halves, so work spreads in O(log n) steps.
+ */
+typedef struct {
+	xpthread_pool_t *pool;
+	void (*fn)(size_t begin, size_t end, void *ctx);
+	void *ctx;
+	size_t grain;
+	volatile long pending;
+} range_job;
+
+typedef struct {
+	xpthread_task_t task;
+	range_job *job;
+	size_t begin;
+	size_t end;
+} range_task;
+
+static void range_run(range_job *job, size_t begin, size_t end);
+
+static void range_task_fn(xpthread_task_t *task) {
+	range_task *rt = (range_task *)task;
+	range_job *job = rt->job;
+	size_t begin = rt->begin, end = rt->end;
+	free(rt);
+	range_run(job, begin, end);
+	XPTHREAD_ATOMIC_FETCH_ADD(&job->pending, -1);
+}
+
+static void range_run(range_job *job, size_t begin, size_t end) {
+	while (end - begin > job->grain) {
+		size_t mid = begin + (end - begin) / 2;
+		range_task *rt = malloc(sizeof(*rt));
+		if (!rt) break; // out of memory: finish the range here
+		rt->task.fn = range_task_fn;
+		rt->job = job;
+		rt->begin = mid;
+		rt->end = end;
+		XPTHREAD_ATOMIC_FETCH_ADD(&job->pending, 1);
+		if (pool_push(job->pool, &rt->task)) {
+			XPTHREAD_ATOMIC_FETCH_ADD(&job->pending, -1);
+			free(rt);
+			break;
+		}
+		end = mid;
+	}
+	job->fn(begin, end, job->ctx);
+}
+
+static size_t parallel_grain(xpthread_pool_t *pool, size_t n, size_t grain) {
+	if (grain) return grain;
+	size_t chunks = (size_t)(xpthread_pool_size(pool) + 1) * XPTHREAD_PARALLEL_SPLIT;
+	grain = n / chunks;
+	return grain ? grain : 1;
+}
+
+int XPTHREADCALL xpthread_parallel_for(size_t begin, size_t end, size_t grain,
+				       void (*fn)(size_t begin, size_t end, void *ctx), void *ctx)
+{
+	if (!fn) return EINVAL;
+	if (begin >= end) return 0;
+
+	xpthread_pool_t *pool = xpthread_pool_default();
+	if (!pool) {
+		fn(begin, end, ctx);
+		return 0;
+	}
+
+	range_job job;
+	job.pool = pool;
+	job.fn = fn;
+	job.ctx = ctx;
+	job.grain = parallel_grain(pool, end - begin, grain);
+	job.pending = 0;
+
+	range_run(&job, begin, end);
+	pool_help_until_zero(pool, &job.pending);
+	return 0;
+}
+
+typedef struct {
+	void (*fn)(size_t begin, size_t end, void *acc, void *ctx);
+	void *ctx;
+	unsigned char *accs;
+	size_t size;
+	size_t begin;
+	size_t end;
+	size_t grain;
+} reduce_job;
+
+static void reduce_chunks(size_t first, size_t last, void *arg) {
+	reduce_job *job = (reduce_job *)arg;
+	for (size_t i = first; i < last; i++) {
+		size_t b = job->begin + i * job->grain;
+		size_t e = job->end - b > job->grain ? b + job->grain : job->end;
+		job->fn(b, e, job->accs + i * job->size, job->ctx);
+	}
+}
+
+int XPTHREADCALL xpthread_parallel_reduce(size_t begin, size_t end, size_t grain,
+					  void *result, size_t size, const void *identity,
+					  void (*fn)(size_t begin, size_t end, void *acc, void *ctx),
+					  void (*combine)(void *acc, const void *other, void *ctx),
+					  void *ctx)
+{
+	if (!result || !size || !identity || !fn || !combine) return EINVAL;
+	memcpy(result, identity, size);
+	if (begin >= end) return 0;
+
+	reduce_job job;
+	job.fn = fn;
+	job.ctx = ctx;
+	job.size = size;
+	job.begin = begin;
+	job.end = end;
+	job.grain = parallel_grain(xpthread_pool_default(), end - begin, grain);
+
+	// one accumulator per chunk, combined left to right for determinism
+	size_t nchunks = (end - begin) / job.grain + ((end - begin) % job.grain != 0);
+	if (nchunks > SIZE_MAX / size) return ENOMEM;
+	job.accs = malloc(nchunks * size);
+	if (!job.accs) return ENOMEM;
+	for (size_t i = 0; i < nchunks; i++)
+		memcpy(job.accs + i * size, identity, size);
+
+	int ret = xpthread_parallel_for(0, nchunks, 1, reduce_chunks, &job);
+	for (size_t i = 0; i < nchunks; i++)
+		combine(result, job.accs + i * size, ctx);
+	free(job.accs);
+	return ret;
+}
+
+/*
+ * Parallel merge sort.
+ *
+ * Runs of the input are sorted with qsort() in parallel, then merged
+ * pairwise in rounds, ping-ponging with a scratch buffer. Every merge is
+ * cut into independent segments by a merge-path binary search, so all
+ * rounds, including the last one, use every thread.
+ */
+typedef int (*sort_cmp_fn)(const void *, const void *);
+
+typedef struct {
+	unsigned char *base;
+	size_t n;
+	size_t size;
+	sort_cmp_fn cmp;
+	size_t run;
+
+	// current merge round
+	unsigned char *src;
+	unsigned char *dst;
+	size_t width;
+	size_t segs_per_merge;
+} sort_job;
+
+static void sort_runs(size_t first, size_t last, void *arg) {
+	sort_job *job = (sort_job *)arg;
+	for (size_t r = first; r < last; r++) {
+		size_t begin = r * job->run;
+		size_t len = job->n - begin < job->run ? job->n - begin : job->run;
+		qsort(job->base + begin * job->size, len, job->size, job->cmp);
+	}
+}
+
+// Number of elements taken from a when the merge of a and b emits d elements
+static size_t merge_corank(const sort_job *job, const unsigned char *a, size_t na,
+			   const unsigned char *b, size_t nb, size_t d)
+{
+	size_t lo = d > nb ? d - nb : 0;
+	size_t hi = d < na ? d : na;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (job->cmp(a + mid * job->size, b + (d - mid - 1) * job->size) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void merge_segments(size_t first, size_t last, void *arg) {
+	sort_job *job = (sort_job *)arg;
+	size_t size = job->size;
+
+	for (size_t s = first; s < last; s++) {
+		size_t pair = s / job->segs_per_merge;
+		size_t seg = s % job->segs_per_merge;
+
+		size_t a0 = pair * 2 * job->width;
+		if (a0 >= job->n) continue;
+		size_t na = job->n - a0 < job->width ? job->n - a0 : job->width;
+		size_t b0 = a0 + na;
+		size_t nb = job->n - b0 < job->width ? job->n - b0 : job->width;
+		const unsigned char *a = job->src + a0 * size;
+		const unsigned char *b = job->src + b0 * size;
+
+		size_t total = na + nb;
+		size_t d0 = total * seg / job->segs_per_merge;
+		size_t d1 = total * (seg + 1) / job->segs_per_merge;
+		size_t i = merge_corank(job, a, na, b, nb, d0);
+		size_t j = d0 - i;
+		size_t i_end = merge_corank(job, a, na, b, nb, d1);
+		size_t j_end = d1 - i_end;
+
+		unsigned char *out = job->dst + (a0 + d0) * size;
+		while (i < i_end && j < j_end) {
+			if (job->cmp(a + i * size, b + j * size) <= 0) {
+				memcpy(out, a + i * size, size);
+				i++;
+			} else {
+				memcpy(out, b + j * size, size);
+				j++;
+			}
+			out += size;
+		}
+		memcpy(out, a + i * size, (i_end - i) * size);
+		out += (i_end - i) * size;
+		memcpy(out, b + j * size, (j_end - j) * size);
+	}
+}
+
+static void sort_copy_back(size_t first, size_t last, void *arg) {
+	sort_job *job = (sort_job *)arg;
+	memcpy(job->base + first * job->size, job->src + first * job->size, (last - first) * job->size);
+}
+
+int XPTHREADCALL xpthread_parallel_sort(void *base, size_t n, size_t size,
+					int (*cmp)(const void *, const void *))
+{
+	if ((!base && n) || !size || !cmp) return EINVAL;
+
+	xpthread_pool_t *pool = xpthread_pool_default();
+	size_t threads = (size_t)xpthread_pool_size(pool) + 1;
+	if (!pool || threads < 2 || n < XPTHREAD_PARALLEL_SORT_MIN) {
+		qsort(base, n, size, cmp);
+		return 0;
+	}
+
+	sort_job job;
+	job.base = (unsigned char *)base;
+	job.n = n;
+	job.size = size;
+	job.cmp = cmp;
+
+	size_t runs = 1;
+	while (runs < threads * 2 && n / (runs * 2) >= XPTHREAD_PARALLEL_SORT_MIN / 2)
+		runs *= 2;
+	job.run = (n + runs - 1) / runs;
+
+	unsigned char *scratch = malloc(n * size);
+	if (!scratch) {
+		qsort(base, n, size, cmp);
+		return 0;
+	}
+
+	xpthread_parallel_for(0, runs, 1, sort_runs, &job);
+
+	job.src = job.base;
+	job.dst = scratch;
+	for (job.width = job.run; job.width < n; job.width *= 2) {
+		size_t merges = (n + 2 * job.width - 1) / (2 * job.width);
+		job.segs_per_merge = (threads * XPTHREAD_PARALLEL_SPLIT + merges - 1) / merges;
+		xpthread_parallel_for(0, merges * job.segs_per_merge, 1, merge_segments, &job);
+
+		unsigned char *tmp = job.src;
+		job.src = job.dst;
+		job.dst = tmp;
+	}
+
+	if (job.src != job.base)
+		xpthread_parallel_for(0, n, 0, sort_copy_back, &job);
+	free(scratch);
+	return 0;
+}
+
+/*
+ * Two-pass parallel inclusive scan: reduce every block, scan the block
+ * sums sequentially, then rescan every block seeded with its carry.
+ */
+typedef struct {
+	unsigned char *base;
+	size_t n;
+	size_t size;
+	size_t block;
+	void (*op)(void *acc, const void *elem, void *ctx);
+	void *ctx;
+	unsigned char *sums;
+	unsigned char *carries;
+	unsigned char *accs;
+} scan_job;
+
+static void scan_reduce_blocks(size_t first, size_t last, void *arg) {
+	scan_job *job = (scan_job *)arg;
+	for (size_t blk = first; blk < last; blk++) {
+		size_t begin = blk * job->block;
+		size_t end = job->n - begin < job->block ? job->n : begin + job->block;
+		unsigned char *acc = job->sums + blk * job->size;
+
+		memcpy(acc, job->base + begin * job->size, job->size);
+		for (size_t i = begin + 1; i < end; i++)
+			job->op(acc, job->base + i * job->size, job->ctx);
+	}
+}
+
+static void scan_blocks(size_t first, size_t last, void *arg) {
+	scan_job *job = (scan_job *)arg;
+	for (size_t blk = first; blk < last; blk++) {
+		size_t begin = blk * job->block;
+		size_t end = job->n - begin < job->block ? job->n : begin + job->block;
+		unsigned char *acc = job->accs + blk * job->size;
+		unsigned char *elem = job->base + begin * job->size;
+
+		if (blk) {
+			memcpy(acc, job->carries + blk * job->size, job->size);
+			job->op(acc, elem, job->ctx);
+			memcpy(elem, acc, job->size);
+		} else {
+			memcpy(acc, elem, job->size);
+		}
+		for (size_t i = begin + 1; i < end; i++) {
+			elem = job->base + i * job->size;
+			job->op(acc, elem, job->ctx);
+			memcpy(elem, acc, job->size);
+		}
+	}
+}
+
+int XPTHREADCALL xpthread_parallel_scan(void *base, size_t n, size_t size,
+					void (*op)(void *acc, const void *elem, void *ctx), void *ctx)
+{
+	if ((!base && n) || !size || !op) return EINVAL;
+	if (n < 2) return 0;
+
+	xpthread_pool_t *pool = xpthread_pool_default();
+	size_t nblocks = ((size_t)xpthread_pool_size(pool) + 1) * XPTHREAD_PARALLEL_SPLIT;
+	if (nblocks > n) nblocks = n;
+
+	scan_job job;
+	job.base = (unsigned char *)base;
+	job.n = n;
+	job.size = size;
+	job.block = (n + nblocks - 1) / nblocks;
+	job.op = op;
+	job.ctx = ctx;
+	nblocks = (n + job.block - 1) / job.block;
+
+	job.sums = malloc(3 * nblocks * size);
+	if (!job.sums) return ENOMEM;
+	job.carries = job.sums + nblocks * size;
+	job.accs = job.carries + nblocks * size;
+
+	// the last block's sum is never needed
+	xpthread_parallel_for(0, nblocks - 1, 1, scan_reduce_blocks, &job);
+
+	// carries[b] = sums[0] op ... op sums[b - 1]
+	if (nblocks > 1) memcpy(job.carries + size, job.sums, size);
+	for (size_t blk = 2; blk < nblocks; blk++) {
+		memcpy(job.carries + blk * size, job.carries + (blk - 1) * size, size);
+		op(job.carries + blk * size, job.sums + (blk - 1) * size, ctx);
+	}
+
+	xpthread_parallel_for(0, nblocks, 1, scan_blocks, &job);
+	free(job.sums);
+	return 0;
+}
+
+/*
+ * Task graphs.
+ *
+ * Every node carries an atomic count of unfinished predecessors, reset at
+ * the start of each run. A finishing node decrements its successors; the
+ * ones reaching zero are pushed on the finishing worker's own deque, except
+ * one that the worker runs next directly.
+ */
+typedef struct graph_node {
+	xpthread_task_t task;
+	struct xpthread_graph *graph;
+	void (*fn)(void *arg);
+	void *arg;
+	size_t *succ;
+	size_t nsucc;
+	size_t succ_cap;
+	size_t npred;
+	volatile long pending;
+} graph_node;
+
+struct xpthread_graph {
+	xpthread_pool_t *pool;
+	graph_node **nodes;
+	size_t nnodes;
+	size_t cap;
+	int checked; // acyclic since the last edge was added
+	volatile long remaining;
+};
+
+static void graph_node_fn(xpthread_task_t *task) {
+	graph_node *node = (graph_node *)task;
+	xpthread_graph_t *g = node->graph;
+
+	while (node) {
+		node->fn(node->arg);
+
+		graph_node *next = NULL;
+		for (size_t i = 0; i < node->nsucc; i++) {
+			graph_node *succ = g->nodes[node->succ[i]];
+			if (XPTHREAD_ATOMIC_FETCH_ADD(&succ->pending, -1) != 1) continue;
+			if (!next) {
+				next = succ;
+			} else if (pool_push(g->pool, &succ->task)) {
+				succ->task.fn(&succ->task); // out of memory: run it here
+			}
+		}
+		XPTHREAD_ATOMIC_FETCH_ADD(&g->remaining, -1);
+		node = next;
+	}
+}
+
+// Kahn's algorithm: every node must become ready at some point
+static int graph_check_acyclic(xpthread_graph_t *g) {
+	size_t *indeg = malloc((g->nnodes ? g->nnodes : 1) * sizeof(size_t) * 2);
+	if (!indeg) return ENOMEM;
+	size_t *ready = indeg + g->nnodes;
+	size_t nready = 0, seen = 0;
+
+	for (size_t i = 0; i < g->nnodes; i++) {
+		indeg[i] = g->nodes[i]->npred;
+		if (!indeg[i]) ready[nready++] = i;
+	}
+	while (nready) {
+		graph_node *node = g->nodes[ready[--nready]];
+		seen++;
+		for (size_t i = 0; i < node->nsucc; i++)
+			if (--indeg[node->succ[i]] == 0) ready[nready++] = node->succ[i];
+	}
+	free(indeg);
+	return seen == g->nnodes ? 0 : EDEADLK;
+}
+
+int XPTHREADCALL xpthread_graph_create(xpthread_graph_t **out, xpthread_pool_t *pool) {
+	if (!out) return EINVAL;
+	if (!pool) pool = xpthread_pool_default();
+	if (!pool) return EAGAIN;
+
+	xpthread_graph_t *g = calloc(1, sizeof(*g));
+	if (!g) return ENOMEM;
+	g->pool = pool;
+	*out = g;
+	return 0;
+}
+
+int XPTHREADCALL xpthread_graph_destroy(xpthread_graph_t *g) {
+	if (!g) return EINVAL;
+	for (size_t i = 0; i < g->nnodes; i++) {
+		free(g->nodes[i]->succ);
+		free(g->nodes[i]);
+	}
+	free(g->nodes);
+	free(g);
+	return 0;
+}
+
+int XPTHREADCALL xpthread_graph_add_task(xpthread_graph_t *g, void (*fn)(void *arg), void *arg, size_t *id) {
+	if (!g || !fn) return EINVAL;
+
+	if (g->nnodes == g->cap) {
+		size_t cap = g->cap ? g->cap * 2 : 16;
+		graph_node **nodes = realloc(g->nodes, cap * sizeof(*nodes));
+		if (!nodes) return ENOMEM;
+		g->nodes = nodes;
+		g->cap = cap;
+	}
+
+	graph_node *node = calloc(1, sizeof(*node));
+	if (!node) return ENOMEM;
+	node->task.fn = graph_node_fn;
+	node->graph = g;
+	node->fn = fn;
+	node->arg = arg;
+
+	if (id) *id = g->nnodes;
+	g->nodes[g->nnodes++] = node;
+	return 0;
+}
+
+int XPTHREADCALL xpthread_graph_add_edge(xpthread_graph_t *g, size_t from, size_t to) {
+	if (!g || from >= g->nnodes || to >= g->nnodes || from == to) return EINVAL;
+
+	graph_node *node = g->nodes[from];
+	if (node->nsucc == node->succ_cap) {
+		size_t cap = node->succ_cap ? node->succ_cap * 2 : 4;
+		size_t *succ = realloc(node->succ, cap * sizeof(*succ));
+		if (!succ) return ENOMEM;
+		node->succ = succ;
+		node->succ_cap = cap;
+	}
+	node->succ[node->nsucc++] = to;
+	g->nodes[to]->npred++;
+	g->checked = 0;
+	return 0;
+}
+
+int XPTHREADCALL xpthread_graph_run(xpthread_graph_t *g) {
+	if (!g) return EINVAL;
+	if (!g->nnodes) return 0;
+
+	if (!g->checked) {
+		int ret = graph_check_acyclic(g);
+		if (ret) return ret;
+		g->checked = 1;
+	}
+
+	for (size_t i = 0; i < g->nnodes; i++)
+		g->nodes[i]->pending = (long)g->nodes[i]->npred;
+	XPTHREAD_ATOMIC_STORE(&g->remaining, (long)g->nnodes);
+
+	for (size_t i = 0; i < g->nnodes; i++) {
+		graph_node *node = g->nodes[i];
+		if (node->npred) continue;
+		if (pool_push(g->pool, &node->task))
+			node->task.fn(&node->task);
+	}
+
+	pool_help_until_zero(g->pool, &g->remaining);
+	return 0;
+}
+
+/*
+ * Pipelines.
+ *
+ * Tokens carry items through the stages, one pool task per token: the
+ * thread that reads an item keeps running it through parallel stages as
+ * far as it can. Serial stages admit tokens strictly by sequence number;
+ * a token arriving out of turn is parked in the stage's reorder ring
+ * (indexed by seq % max_tokens, which cannot collide while at most
+ * max_tokens are in flight) and resumed by the token ahead of it. Tokens
+ * come from a fixed free list, so a full pipeline stops reading input.
+ */
+typedef struct pipe_token {
+	xpthread_task_t task;
+	xpthread_pipeline_t *pipe;
+	struct pipe_token *next_free;
+	void *item;
+	unsigned long seq;
+	size_t stage;
+	int owned; // already admitted to the serial stage it is at
+} pipe_token;
+
+typedef struct {
+	void *(*fn)(void *item, void *arg);
+	void *arg;
+	int serial;
+	xpthread_spinlock_t lock;
+	unsigned long next_seq;
+	pipe_token **parked;
+} pipe_stage;
+
+struct xpthread_pipeline {
+	xpthread_pool_t *pool;
+	pipe_stage *stages;
+	size_t nstages;
+	size_t cap;
+
+	// per run
+	pipe_token *tokens;
+	size_t ntokens;
+	xpthread_spinlock_t lock;
+	pipe_token *free_tokens;
+	unsigned long next_input;
+	int input_busy;
+	int eof;
+	volatile long active; // tokens not on the free list
+};
+
+static void pipe_token_fn(xpthread_task_t *task);
+
+static void pipe_spawn(xpthread_pipeline_t *p, pipe_token *tok) {
+	if (pool_push(p->pool, &tok->task))
+		pipe_token_fn(&tok->task); // could not queue, run it here
+}
+
+/* return a token to the free list; the caller must not touch p afterwards */
+static void pipe_token_retire(xpthread_pipeline_t *p, pipe_token *tok) {
+	xpthread_spin_lock(&p->lock);
+	tok->next_free = p->free_tokens;
+	p->free_tokens = tok;
+	xpthread_spin_unlock(&p->lock);
+	XPTHREAD_ATOMIC_FETCH_ADD(&p->active, -1);
+}
+
+/* read the next item into tok, 0 if tok was retired instead */
+static int pipe_input(xpthread_pipeline_t *p, pipe_token *tok) {
+	xpthread_spin_lock(&p->lock);
+	if (p->eof || p->input_busy) {
+		// whoever holds the input hands out free tokens when done
+		xpthread_spin_unlock(&p->lock);
+		pipe_token_retire(p, tok);
+		return 0;
+	}
+	p->input_busy = 1;
+	xpthread_spin_unlock(&p->lock);
+
+	void *item = p->stages[0].fn(NULL, p->stages[0].arg);
+
+	pipe_token *spawn = NULL;
+	xpthread_spin_lock(&p->lock);
+	p->input_busy = 0;
+	if (!item) p->eof = 1;
+	else tok->seq = p->next_input++;
+	if (!p->eof && p->free_tokens) {
+		spawn = p->free_tokens;
+		p->free_tokens = spawn->next_free;
+		XPTHREAD_ATOMIC_FETCH_ADD(&p->active, 1);
+	}
+	xpthread_spin_unlock(&p->lock);
+
+	if (spawn) {
+		spawn->stage = 0;
+		pipe_spawn(p, spawn);
+	}
+	if (!item) {
+		pipe_token_retire(p, tok);
+		return 0;
+	}
+	tok->item = item;
+	tok->stage = 1;
+	return 1;
+}
+
+static int pipe_stage_enter(xpthread_pipeline_t *p, pipe_stage *st, pipe_token *tok) {
+	xpthread_spin_lock(&st->lock);
+	if (st->next_seq == tok->seq) {
+		xpthread_spin_unlock(&st->lock);
+		return 1;
+	}
+	st->parked[tok->seq % p->ntokens] = tok;
+	xpthread_spin_unlock(&st->lock);
+	return 0;
+}
+
+static void pipe_stage_leave(xpthread_pipeline_t *p, pipe_stage *st) {
+	xpthread_spin_lock(&st->lock);
+	unsigned long seq = ++st->next_seq;
+	pipe_token **slot = &st->parked[seq % p->ntokens];
+	pipe_token *next = *slot;
+	if (next && next->seq == seq) *slot = NULL;
+	else next = NULL;
+	xpthread_spin_unlock(&st->lock);
+
+	if (next) {
+		next->owned = 1;
+		pipe_spawn(p, next);
+	}
+}
+
+static void pipe_token_fn(xpthread_task_t *task) {
+	pipe_token *tok = (pipe_token *)task;
+	xpthread_pipeline_t *p = tok->pipe;
+
+	for (;;) {
+		if (tok->stage == 0 && !pipe_input(p, tok)) return;
+
+		for (; tok->stage < p->nstages; tok->stage++) {
+			pipe_stage *st = &p->stages[tok->stage];
+			if (st->serial && !tok->owned && !pipe_stage_enter(p, st, tok)) return;
+			tok->owned = 0;
+			// filtered tokens still pass serial stages to keep them in order
+			if (tok->item) tok->item = st->fn(tok->item, st->arg);
+			if (st->serial) pipe_stage_leave(p, st);
+		}
+		tok->item = NULL;
+		tok->stage = 0; // recycle the token for the next item
+	}
+}
+
+int XPTHREADCALL xpthread_pipeline_create(xpthread_pipeline_t **out, xpthread_pool_t *pool) {
+	if (!out) return EINVAL;
+	if (!pool) pool = xpthread_pool_default();
+	if (!pool) return EAGAIN;
+
+	xpthread_pipeline_t *p = calloc(1, sizeof(*p));
+	if (!p) return ENOMEM;
+	p->pool = pool;
+	xpthread_spin_init(&p->lock);
+	*out = p;
+	return 0;
+}
+
+int XPTHREADCALL xpthread_pipeline_destroy(xpthread_pipeline_t *p) {
+	if (!p) return EINVAL;
+	free(p->stages);
+	free(p);
+	return 0;
+}
+
+int XPTHREADCALL xpthread_pipeline_add_stage(xpthread_pipeline_t *p, void *(*fn)(void *item, void *arg),
+					     void *arg, int mode)
+{
+	if (!p || !fn || (mode != XPTHREAD_STAGE_SERIAL && mode != XPTHREAD_STAGE_PARALLEL)) return EINVAL;
+
+	if (p->nstages == p->cap) {
+		size_t cap = p->cap ? p->cap * 2 : 4;
+		pipe_stage *stages = realloc(p->stages, cap * sizeof(*stages));
+		if (!stages) return ENOMEM;
+		p->stages = stages;
+		p->cap = cap;
+	}
+
+	pipe_stage *st = &p->stages[p->nstages];
+	memset(st, 0, sizeof(*st));
+	st->fn = fn;
+	st->arg = arg;
+	st->serial = mode == XPTHREAD_STAGE_SERIAL || p->nstages == 0;
+	xpthread_spin_init(&st->lock);
+	p->nstages++;
+	return 0;
+}
+
+int XPTHREADCALL xpthread_pipeline_run(xpthread_pipeline_t *p, size_t max_tokens) {
+	if (!p || !p->nstages) return EINVAL;
+	if (!max_tokens) max_tokens = 2 * ((size_t)xpthread_pool_size(p->pool) + 1);
+
+	p->tokens = calloc(max_tokens, sizeof(*p->tokens));
+	if (!p->tokens) return ENOMEM;
+	p->ntokens = max_tokens;
+
+	int ret = 0;
+	for (size_t i = 1; i < p->nstages; i++) {
+		pipe_stage *st = &p->stages[i];
+		st->next_seq = 0;
+		st->parked = NULL;
+		if (st->serial && !(st->parked = calloc(max_tokens, sizeof(*st->parked)))) ret = ENOMEM;
+	}
+
+	if (!ret) {
+		p->free_tokens = NULL;
+		for (size_t i = max_tokens; i-- > 1;) {
+			p->tokens[i].pipe = p;
+			p->tokens[i].task.fn = pipe_token_fn;
+			p->tokens[i].next_free = p->free_tokens;
+			p->free_tokens = &p->tokens[i];
+		}
+		p->next_input = 0;
+		p->input_busy = 0;
+		p->eof = 0;
+		XPTHREAD_ATOMIC_STORE(&p->active, 1);
+
+		// the first token starts reading and fans out more as it goes
+		pipe_token *first = &p->tokens[0];
+		first->pipe = p;
+		first->task.fn = pipe_token_fn;
+		pipe_spawn(p, first);
+		pool_help_until_zero(p->pool, &p->active);
+	}
+
+	for (size_t i = 1; i < p->nstages; i++)
+		free(p->stages[i].parked);
+	free(p->tokens);
+	p->tokens = NULL;
+	return ret;
+}
+
+/*
+ * Futex.
+ *
+ * Linux: futex(2). Windows: WaitOnAddress (Windows 8+). Elsewhere the
+ * address is hashed onto a table of mutex/condition variable pairs; a wake
+ * broadcasts the whole bucket, which waiters tolerate as spurious wakeups.
+ */
+#if !defined(__linux__) && !defined(_WIN32)
+#define FUTEX_BUCKETS 64
+
+static xp_waitset futex_buckets[FUTEX_BUCKETS];
+static pthread_once_t futex_buckets_once = PTHREAD_ONCE_INIT;
+
+static void futex_buckets_init(void) {
+	for (int i = 0; i < FUTEX_BUCKETS; i++) {
+		pthread_mutex_init(&futex_buckets[i].lock, NULL);
+		pthread_cond_init(&futex_buckets[i].cond, NULL);
+	}
+}
+
+static xp_waitset *futex_bucket(volatile uint32_t *addr) {
+	pthread_once(&futex_buckets_once, futex_buckets_init);
+	uintptr_t h = (uintptr_t)addr;
+	h ^= h >> 17;
+	h *= 0x9E3779B1u;
+	return &futex_buckets[(h >> 7) % FUTEX_BUCKETS];
+}
+#endif
+
+int XPTHREADCALL xpthread_futex_wait(volatile uint32_t *addr, uint32_t expected, const struct timespec *reltime) {
+	if (!addr) return EINVAL;
+#if defined(__linux__)
+	if (syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, reltime, NULL, 0) == -1 && errno == ETIMEDOUT)
+		return ETIMEDOUT;
+	return 0;
+#elif defined(_WIN32)
+	DWORD ms = INFINITE;
+	if (reltime) {
+		uint64_t total = (uint64_t)reltime->tv_sec * 1000 + ((uint64_t)reltime->tv_nsec + 999999) / 1000000;
+		ms = total >= INFINITE ? INFINITE - 1 : (DWORD)total;
+	}
+	if (!WaitOnAddress(addr, &expected, sizeof(expected), ms) && GetLastError() == ERROR_TIMEOUT)
+		return ETIMEDOUT;
+	return 0;
+#else
+	xp_waitset *b = futex_bucket(addr);
+	int ret = 0;
+	pthread_mutex_lock(&b->lock);
+	if (*addr == expected) {
+		if (reltime) {
+			struct timespec abstime;
+			xpthread_get_realtime(&abstime);
+			abstime.tv_sec += reltime->tv_sec;
+			abstime.tv_nsec += reltime->tv_nsec;
+			if (abstime.tv_nsec >= 1000000000L) {
+				abstime.tv_sec++;
+				abstime.tv_nsec -= 1000000000L;
+			}
+			ret = pthread_cond_timedwait(&b->cond, &b->lock, &abstime);
+		} else {
+			pthread_cond_wait(&b->cond, &b->lock);
+		}
+	}
+	pthread_mutex_unlock(&b->lock);
+	return ret == ETIMEDOUT ? ETIMEDOUT : 0;
+#endif
+}
+
+int XPTHREADCALL xpthread_futex_wake(volatile uint32_t *addr, int count) {
+	if (!addr) return EINVAL;
+#if defined(__linux__)
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+#elif defined(_WIN32)
+	if (count == 1)
+		WakeByAddressSingle((PVOID)addr);
+	else
+		WakeByAddressAll((PVOID)addr);
+#else
+	(void)count;
+	xp_waitset *b = futex_bucket(addr);
+	pthread_mutex_lock(&b->lock);
+	pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+#endif
+	return 0;
+}
+
+/*
+ * Thread parking.
+ *
+ * Each thread record carries a one-bit permit that doubles as the futex
+ * word: unpark sets it and wakes the owner if it was clear, park consumes
+ * it or sleeps while it is clear. xpthread_unpark() finds the target by
+ * walking the record list, so a thread must own a record (xpthread_create()
+ * threads always do, others after their first xpthread_park()); a park
+ * handle is the record itself and skips the walk.
+ */
+static uint64_t park_clock_ns(void) {
+#ifdef _WIN32
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+int XPTHREADCALL xpthread_park(const struct timespec *reltime) {
+	xpthread_thread_rec *rec = thread_rec_try_self();
+	uint64_t deadline = 0;
+
+	if (!rec) return ENOMEM;
+	if (XPTHREAD_ATOMIC_XCHG(&rec->park_permit, 0)) return 0;
+	if (reltime) {
+		if (reltime->tv_sec < 0 || reltime->tv_nsec < 0 || reltime->tv_nsec >= 1000000000L)
+			return EINVAL;
+		deadline = park_clock_ns() + (uint64_t)reltime->tv_sec * 1000000000u + (uint64_t)reltime->tv_nsec;
+	}
+
+	thread_rec_park();
+	for (;;) {
+		struct timespec rel, *relp = NULL;
+		if (reltime) {
+			uint64_t now = park_clock_ns();
+			if (now >= deadline) break;
+			rel.tv_sec = (time_t)((deadline - now) / 1000000000u);
+			rel.tv_nsec = (long)((deadline - now) % 1000000000u);
+			relp = &rel;
+		}
+		xpthread_futex_wait(&rec->park_permit, 0, relp);
+		if (XPTHREAD_ATOMIC_XCHG(&rec->park_permit, 0)) return 0;
+	}
+	// an unpark racing with the timeout still counts
+	return XPTHREAD_ATOMIC_XCHG(&rec->park_permit, 0) ? 0 : ETIMEDOUT;
+}
+
+static void park_give_permit(xpthread_thread_rec *rec) {
+	if (!XPTHREAD_ATOMIC_XCHG(&rec->park_permit, 1))
+		xpthread_futex_wake(&rec->park_permit, 1);
+}
+
+int XPTHREADCALL xpthread_unpark(xpthread_t thread) {
+#ifdef _WIN32
+	DWORD id = GetThreadId(thread);
+	if (!id) return ESRCH;
+#endif
+	for (xpthread_thread_rec *r = XPTHREAD_ATOMIC_LOAD_PTR(&thread_recs); r; r = r->next) {
+		if (XPTHREAD_ATOMIC_LOAD(&r->owned) != REC_OWNED) continue;
+#ifdef _WIN32
+		if (r->owner != id) continue;
+#else
+		if (!pthread_equal(r->owner, thread)) continue;
+#endif
+		park_give_permit(r);
+		return 0;
+	}
+	return ESRCH;
+}
+
+xpthread_park_handle_t *XPTHREADCALL xpthread_park_handle_self(void) {
+	return (xpthread_park_handle_t *)thread_rec_try_self();
+}
+
+int XPTHREADCALL xpthread_unpark_handle(xpthread_park_handle_t *handle) {
+	if (!handle) return EINVAL;
+	park_give_permit((xpthread_thread_rec *)handle);
+	return 0;
+}
+
+/*
+ * Parking lot.
+ *
+ * Wait queues for every address live in one global hash table, so the
+ * synchronization objects themselves only need the bits their fast path
+ * uses. Each bucket holds a FIFO of parked threads for the addresses that
+ * hash to it; the queue node is the thread's record, which is never freed,
+ * so an unparker may still touch it after the parked thread moved on.
+ *
+ * Callbacks run with the bucket locked: validate() decides whether to park
+ * at all, timed_out() and the unpark callback update the object's state
+ * while the queue cannot change.
+ */
+#define LOT_BUCKETS 1024
+
+typedef struct {
+	volatile long lock;
+	xpthread_thread_rec *head;
+	xpthread_thread_rec *tail;
+} lot_bucket;
+
+typedef struct {
+	int unparked;  // a thread was taken off the queue
+	int have_more; // more threads are parked on the address
+	uint64_t waited_ns; // how long the unparked thread was queued
+} lot_result;
+
+static lot_bucket lot_buckets[LOT_BUCKETS];
+
+static lot_bucket *lot_lock_bucket(const void *addr) {
+	uintptr_t h = (uintptr_t)addr;
+	h ^= h >> 17;
+	h *= 0x9E3779B1u;
+	lot_bucket *b = &lot_buckets[(h >> 7) % LOT_BUCKETS];
+	for (unsigned int spins = 0;; spins++) {
+		if (!XPTHREAD_ATOMIC_LOAD_RELAXED(&b->lock) && !XPTHREAD_ATOMIC_XCHG(&b->lock, 1))
+			return b;
+		if (spins < 64) XPTHREAD_CPU_RELAX();
+		else xpthread_yield_cpu();
+	}
+}
+
+static void lot_unlock_bucket(lot_bucket *b) {
+	XPTHREAD_ATOMIC_STORE(&b->lock, 0);
+}
+
+// unlink rec given its predecessor, returns whether addr still has waiters
+static int lot_unlink(lot_bucket *b, xpthread_thread_rec *prev, xpthread_thread_rec *rec) {
+	if (prev) prev->lot_next = rec->lot_next;
+	else b->head = rec->lot_next;
+	if (b->tail == rec) b->tail = prev;
+	for (xpthread_thread_rec *r = rec->lot_next; r; r = r->lot_next)
+		if (r->lot_addr == rec->lot_addr) return 1;
+	return 0;
+}
+
+/*
+ * Park the calling thread on addr if validate(arg) holds, then call
+ * before_sleep(arg) with the bucket unlocked. Returns 0 with the token
+ * passed by the unparker, EAGAIN if validation failed, ETIMEDOUT after
+ * calling timed_out(arg, was_last), or ENOMEM without calling anything
+ * if the thread has no record.
+ *
+ * since carries the time of a thread's first park across retries: if it
+ * is non-zero the thread was woken before and lost the race, so it goes
+ * back to the head of the queue and keeps its waiting time; otherwise it
+ * is set when the thread is queued at the tail.
+ */
+static int lot_park(const void *addr, int (*validate)(void *), void (*before_sleep)(void *),
+		    void (*timed_out)(void *, int), void *arg,
+		    const struct timespec *reltime, uint64_t *since, uintptr_t *token) {
+	xpthread_thread_rec *self = thread_rec_try_self();
+	uint64_t deadline = 0;
+
+	if (!self) return ENOMEM;
+	if (reltime)
+		deadline = park_clock_ns() + (uint64_t)reltime->tv_sec * 1000000000u + (uint64_t)reltime->tv_nsec;
+
+	lot_bucket *b = lot_lock_bucket(addr);
+	if (validate && !validate(arg)) {
+		lot_unlock_bucket(b);
+		return EAGAIN;
+	}
+	self->lot_addr = addr;
+	self->lot_token = 0;
+	XPTHREAD_ATOMIC_STORE(&self->lot_parked, 1);
+	if (since && *since) {
+		self->lot_since = *since;
+		self->lot_next = b->head;
+		b->head = self;
+		if (!b->tail) b->tail = self;
+	} else {
+		self->lot_since = park_clock_ns();
+		if (since) *since = self->lot_since;
+		self->lot_next = NULL;
+		if (b->tail) b->tail->lot_next = self;
+		else b->head = self;
+		b->tail = self;
+	}
+	lot_unlock_bucket(b);
+
+	if (before_sleep) before_sleep(arg);
+	thread_rec_park();
+
+	while (XPTHREAD_ATOMIC_LOAD(&self->lot_parked)) {
+		struct timespec rel, *relp = NULL;
+		if (reltime) {
+			uint64_t now = park_clock_ns();
+			if (now >= deadline) break;
+			rel.tv_sec = (time_t)((deadline - now) / 1000000000u);
+			rel.tv_nsec = (long)((deadline - now) % 1000000000u);
+			relp = &rel;
+		}
+		xpthread_futex_wait(&self->lot_parked, 1, relp);
+	}
+
+	if (XPTHREAD_ATOMIC_LOAD(&self->lot_parked)) {
+		// timed out, unless an unparker dequeued us in the meantime
+		b = lot_lock_bucket(addr);
+		if (XPTHREAD_ATOMIC_LOAD(&self->lot_parked)) {
+			xpthread_thread_rec *prev = NULL, *r;
+			for (r = b->head; r && r != self; r = r->lot_next) prev = r;
+			if (r) {
+				int more = lot_unlink(b, prev, self);
+				if (timed_out) timed_out(arg, !more);
+				XPTHREAD_ATOMIC_STORE(&self->lot_parked, 0);
+				lot_unlock_bucket(b);
+				return ETIMEDOUT;
+			}
+			// already off the queue: count it as unparked
+			XPTHREAD_ATOMIC_STORE(&self->lot_parked, 0);
+		}
+		lot_unlock_bucket(b);
+	}
+	if (token) *token = self->lot_token;
+	return 0;
+}
+
+/*
+ * Unpark the oldest thread parked on addr. callback(arg, result) runs
+ * with the bucket locked, even if nobody was parked, and returns the
+ * token handed to the woken thread.
+ */
+static void lot_unpark_one(const void *addr, uintptr_t (*callback)(void *, const lot_result *), void *arg) {
+	lot_bucket *b = lot_lock_bucket(addr);
+	lot_result result = { 0, 0, 0 };
+	xpthread_thread_rec *prev = NULL, *rec;
+
+	for (rec = b->head; rec; prev = rec, rec = rec->lot_next) {
+		if (rec->lot_addr == addr) {
+			result.unparked = 1;
+			result.have_more = lot_unlink(b, prev, rec);
+			result.waited_ns = park_clock_ns() - rec->lot_since;
+			break;
+		}
+	}
+	uintptr_t token = callback ? callback(arg, &result) : 0;
+	if (rec) {
+		// the thread cannot leave before lot_parked is cleared
+		rec->lot_token = token;
+		XPTHREAD_ATOMIC_STORE(&rec->lot_parked, 0);
+	}
+	lot_unlock_bucket(b);
+	if (rec) xpthread_futex_wake(&rec->lot_parked, 1);
+}
+
+/*
+ * Unpark every thread parked on addr, returns how many were woken.
+ * Each thread is released with the bucket locked, like lot_unpark_one(),
+ * so a timed waiter never finds itself parked but off the queue; once
+ * released it may park again and reuse lot_next, so the futex wakes are
+ * issued afterwards from a batch on the stack. Only the threads parked
+ * when the call started are woken.
+ */
+#define LOT_WAKE_BATCH 32
+
+static int lot_unpark_all(const void *addr) {
+	xpthread_thread_rec *batch[LOT_WAKE_BATCH];
+	int n = 0, limit = -1;
+
+	for (;;) {
+		lot_bucket *b = lot_lock_bucket(addr);
+		xpthread_thread_rec *prev = NULL, *rec, *next;
+		int count = 0, more = 0;
+
+		if (limit < 0) {
+			limit = 0;
+			for (rec = b->head; rec; rec = rec->lot_next)
+				if (rec->lot_addr == addr) limit++;
+		}
+		for (rec = b->head; rec; rec = next) {
+			next = rec->lot_next;
+			if (rec->lot_addr != addr) {
+				prev = rec;
+				continue;
+			}
+			if (count == LOT_WAKE_BATCH || n + count == limit) {
+				more = n + count < limit;
+				break;
+			}
+			lot_unlink(b, prev, rec);
+			rec->lot_token = 0;
+			XPTHREAD_ATOMIC_STORE(&rec->lot_parked, 0);
+			batch[count++] = rec;
+		}
+		lot_unlock_bucket(b);
+
+		// records are never freed, so a late wake is at worst spurious
+		for (int i = 0; i < count; i++) xpthread_futex_wake(&batch[i]->lot_parked, 1);
+		n += count;
+		if (!more) return n;
+	}
+}
+
+/*
+ * Byte lock: LOCKED plus PARKED once a thread queued in the parking lot.
+ * A few rounds of spinning cover short critical sections; afterwards the
+ * thread sets PARKED and parks until an unlock sees the bit.
+ *
+ * Unlock normally releases the lock and lets the woken thread compete
+ * with running ones. Once the oldest waiter has been queued for
+ * bytelock_starvation_ns (or on xpthread_bytelock_unlock_fair())
+ * the lock stays LOCKED and is handed to it instead, so no new arrival can
+ * barge in ahead of it. The waiting time counts from the first park: a
+ * woken thread that lost the race parks again at the head of the queue.
+ */
+#define BYTELOCK_LOCKED 1
+#define BYTELOCK_PARKED 2
+#define BYTELOCK_SPINS 10
+#define BYTELOCK_HANDOFF 1 // unpark token: the lock now belongs to the woken thread
+#define BYTELOCK_STARVATION_NS 1000000u
+
+static volatile uint64_t bytelock_starvation_ns = BYTELOCK_STARVATION_NS;
+
+typedef struct {
+	xpthread_bytelock_t *lock;
+	int fair;
+} bytelock_unlock_ctx;
+
+static int bytelock_validate(void *arg) {
+	xpthread_bytelock_t *lock = arg;
+	return XPTHREAD_ATOMIC_LOAD_RELAXED(&lock->state) == (BYTELOCK_LOCKED | BYTELOCK_PARKED);
+}
+
+static uintptr_t bytelock_unlock_callback(void *arg, const lot_result *result) {
+	bytelock_unlock_ctx *ctx = arg;
+	uint8_t parked = result->have_more ? BYTELOCK_PARKED : 0;
+
+	uint64_t threshold = XPTHREAD_ATOMIC_LOAD_RELAXED(&bytelock_starvation_ns);
+
+	if (result->unparked && (ctx->fair || (threshold && result->waited_ns >= threshold))) {
+		XPTHREAD_ATOMIC_STORE(&ctx->lock->state, (uint8_t)(BYTELOCK_LOCKED | parked));
+		return BYTELOCK_HANDOFF;
+	}
+	XPTHREAD_ATOMIC_STORE(&ctx->lock->state, parked);
+	return 0;
+}
+
+int XPTHREADCALL xpthread_bytelock_lock(xpthread_bytelock_t *lock) {
+	unsigned int spins = 0;
+	uint64_t since = 0;
+	uint8_t state = XPTHREAD_ATOMIC_LOAD_RELAXED(&lock->state);
+
+	if (state == 0 && XPTHREAD_ATOMIC_CAS(&lock->state, 0, BYTELOCK_LOCKED)) return 0;
+	for (;;) {
+		state = XPTHREAD_ATOMIC_LOAD_RELAXED(&lock->state);
+		if (!(state & BYTELOCK_LOCKED)) {
+			if (XPTHREAD_ATOMIC_CAS(&lock->state, state, (uint8_t)(state | BYTELOCK_LOCKED))) return 0;
+			continue;
+		}
+		// spin only while nobody is parked, queued threads go first
+		if (!(state & BYTELOCK_PARKED) && spins < BYTELOCK_SPINS) {
+			if (spins++ < 3) {
+				for (unsigned int i = 0; i < (4u << spins); i++) XPTHREAD_CPU_RELAX();
+			} else {
+				xpthread_yield_cpu();
+			}
+			continue;
+		}
+		if (!(state & BYTELOCK_PARKED) &&
+		    !XPTHREAD_ATOMIC_CAS(&lock->state, state, (uint8_t)(state | BYTELOCK_PARKED)))
+			continue;
+		uintptr_t token = 0;
+		int ret = lot_park((const void *)lock, bytelock_validate, NULL, NULL, lock, NULL, &since, &token);
+		if (ret == ENOMEM) return ret;
+		if (ret == 0 && token == BYTELOCK_HANDOFF) return 0;
+		spins = 0;
+	}
+}
+
+int XPTHREADCALL xpthread_bytelock_trylock(xpthread_bytelock_t *lock) {
+	uint8_t state = XPTHREAD_ATOMIC_LOAD_RELAXED(&lock->state);
+	while (!(state & BYTELOCK_LOCKED)) {
+		if (XPTHREAD_ATOMIC_CAS(&lock->state, state, (uint8_t)(state | BYTELOCK_LOCKED))) return 0;
+		state = XPTHREAD_ATOMIC_LOAD_RELAXED(&lock->state);
+	}
+	return EBUSY;
+}
+
+static int bytelock_unlock_slow(xpthread_bytelock_t *lock, int fair) {
+	bytelock_unlock_ctx ctx = { lock, fair };
+	lot_unpark_one((const void *)lock, bytelock_unlock_callback, &ctx);
+	return 0;
+}
+
+int XPTHREADCALL xpthread_bytelock_unlock(xpthread_bytelock_t *lock) {
+	if (XPTHREAD_ATOMIC_CAS(&lock->state, BYTELOCK_LOCKED, 0)) return 0;
+	return bytelock_unlock_slow(lock, 0);
+}
+
+int XPTHREADCALL xpthread_bytelock_unlock_fair(xpthread_bytelock_t *lock) {
+	if (XPTHREAD_ATOMIC_CAS(&lock->state, BYTELOCK_LOCKED, 0)) return 0;
+	return bytelock_unlock_slow(lock, 1);
+}
+
+int XPTHREADCALL xpthread_bytelock_setstarvation(uint64_t threshold_ns) {
+	XPTHREAD_ATOMIC_STORE(&bytelock_starvation_ns, threshold_ns);
+	return 0;
+}
+
+/*
+ * Byte condition variable: the byte is non-zero while threads may be
+ * parked on it, so signal and broadcast skip the parking lot otherwise.
+ * Waiters queue before they release the lock, so no wakeup is lost.
+ */
+typedef struct {
+	xpthread_bytecond_t *cond;
+	xpthread_bytelock_t *lock;
+} bytecond_wait_ctx;
+
+static int bytecond_validate(void *arg) {
+	bytecond_wait_ctx *ctx = arg;
+	XPTHREAD_ATOMIC_STORE(&ctx->cond->state, 1);
+	return 1;
+}
+
+static void bytecond_before_sleep(void *arg) {
+	bytecond_wait_ctx *ctx = arg;
+	xpthread_bytelock_unlock(ctx->lock);
+}
+
+static void bytecond_timed_out(void *arg, int was_last) {
+	bytecond_wait_ctx *ctx = arg;
+	if (was_last) XPTHREAD_ATOMIC_STORE(&ctx->cond->state, 0);
+}
+
+static uintptr_t bytecond_signal_callback(void *arg, const lot_result *result) {
+	xpthread_bytecond_t *cond = arg;
+	if (!result->have_more) XPTHREAD_ATOMIC_STORE(&cond->state, 0);
+	return 0;
+}
+
+int XPTHREADCALL xpthread_bytecond_timedwait(xpthread_bytecond_t *cond, xpthread_bytelock_t *lock,
+					     const struct timespec *reltime) {
+	bytecond_wait_ctx ctx = { cond, lock };
+	if (reltime && (reltime->tv_sec < 0 || reltime->tv_nsec < 0 || reltime->tv_nsec >= 1000000000L))
+		return EINVAL;
+	int ret = lot_park((const void *)cond, bytecond_validate, bytecond_before_sleep,
+			   bytecond_timed_out, &ctx, reltime, NULL, NULL);
+	if (ret == ENOMEM) return ret; // never released the lock
+	xpthread_bytelock_lock(lock);
+	return ret == ETIMEDOUT ? ETIMEDOUT : 0;
+}
+
+int XPTHREADCALL xpthread_bytecond_wait(xpthread_bytecond_t *cond, xpthread_bytelock_t *lock) {
+	return xpthread_bytecond_timedwait(cond, lock, NULL);
+}
+
+int XPTHREADCALL xpthread_bytecond_signal(xpthread_bytecond_t *cond) {
+	if (!XPTHREAD_ATOMIC_LOAD(&cond->state)) return 0;
+	lot_unpark_one((const void *)cond, bytecond_signal_callback, cond);
+	return 0;
+}
+
+int XPTHREADCALL xpthread_bytecond_broadcast(xpthread_bytecond_t *cond) {
+	if (!XPTHREAD_ATOMIC_LOAD(&cond->state)) return 0;
+	XPTHREAD_ATOMIC_STORE(&cond->state, 0);
+	lot_unpark_all((const void *)cond);
+	return 0;
+}
+
+/*
+ * Futures.
+ *
+ * The state word is READY once the value is set, with WAITERS set by
+ * threads parked on it. Continuations are pushed on a lock-free stack
+ * that set() closes by swapping in FUTURE_CLOSED; a continuation attached
+ * after that runs immediately.
+ */
+#define FUTURE_READY 1u
+#define FUTURE_WAITERS 2u
+#define FUTURE_CLOSED ((fut_cont *)1)
+
+typedef struct fut_cont {
+	struct fut_cont *next;
+	void (*run)(struct fut_cont *cont, void *value);
+} fut_cont;
+
+struct xpthread_future {
+	volatile uint32_t state;
+	volatile long refs;
+	void *value;
+	fut_cont *volatile conts;
+};
+
+int XPTHREADCALL xpthread_future_create(xpthread_future_t **out) {
+	if (!out) return EINVAL;
+	xpthread_future_t *f = calloc(1, sizeof(*f));
+	if (!f) return ENOMEM;
+	f->refs = 1;
+	*out = f;
+	return 0;
+}
+
+void XPTHREADCALL xpthread_future_retain(xpthread_future_t *f) {
+	XPTHREAD_ATOMIC_FETCH_ADD(&f->refs, 1);
+}
+
+void XPTHREADCALL xpthread_future_release(xpthread_future_t *f) {
+	if (f && XPTHREAD_ATOMIC_FETCH_ADD(&f->refs, -1) == 1) free(f);
+}
+
+int XPTHREADCALL xpthread_future_set(xpthread_future_t *f, void *value) {
+	if (!f) return EINVAL;
+
+	fut_cont *conts = XPTHREAD_ATOMIC_XCHG_PTR(&f->conts, FUTURE_CLOSED);
+	if (conts == FUTURE_CLOSED) return EINVAL; // already completed
+
+	f->value = value;
+	uint32_t old = XPTHREAD_ATOMIC_XCHG(&f->state, FUTURE_READY);
+	if (old & FUTURE_WAITERS) xpthread_futex_wake(&f->state, INT32_MAX);
+
+	// the stack holds the latest continuation first
+	fut_cont *fifo = NULL;
+	while (conts) {
+		fut_cont *next = conts->next;
+		conts->next = fifo;
+		fifo = conts;
+		conts = next;
+	}
+	while (fifo) {
+		fut_cont *next = fifo->next;
+		fifo->run(fifo, value);
+		fifo = next;
+	}
+	return 0;
+}
+
+int XPTHREADCALL xpthread_future_is_ready(const xpthread_future_t *f) {
+	return f && (XPTHREAD_ATOMIC_LOAD(&f->state) & FUTURE_READY);
+}
+
+int XPTHREADCALL xpthread_future_try_get(const xpthread_future_t *f, void **value) {
+	if (!f) return EINVAL;
+	if (!(XPTHREAD_ATOMIC_LOAD(&f->state) & FUTURE_READY)) return EBUSY;
+	if (value) *value = f->value;
+	return 0;
+}
+
+int XPTHREADCALL xpthread_future_wait(xpthread_future_t *f, void **value) {
+	if (!f) return EINVAL;
+
+	// a pool worker keeps running tasks, the future may depend on them
+	pool_worker *self = pool_self;
+	unsigned int spins = 0;
+	while (self && !(XPTHREAD_ATOMIC_LOAD(&f->state) & FUTURE_READY)) {
+		xpthread_task_t *task = pool_find_task(self->pool);
+		if (task) {
+			task->fn(task);
+			continue;
+		}
+		XPTHREAD_CPU_RELAX();
+		if (++spins % 64 == 0) xpthread_yield_cpu();
+	}
+
+	for (;;) {
+		uint32_t state = XPTHREAD_ATOMIC_LOAD(&f->state);
+		if (state & FUTURE_READY) break;
+		if (!(state & FUTURE_WAITERS) &&
+		    !XPTHREAD_ATOMIC_CAS(&f->state, state, state | FUTURE_WAITERS))
+			continue;
+		thread_rec_park();
+		xpthread_futex_wait(&f->state, state | FUTURE_WAITERS, NULL);
+	}
+
+	if (value) *value = f->value;
+	return 0;
+}
+
+// Attach a continuation, or run it now if f already completed
+static void future_attach(xpthread_future_t *f, fut_cont *cont) {
+	fut_cont *top;
+	do {
+		top = XPTHREAD_ATOMIC_LOAD_PTR(&f->conts);
+		if (top == FUTURE_CLOSED) {
+			// set() publishes the value before closing the stack
+			while (!(XPTHREAD_ATOMIC_LOAD(&f->state) & FUTURE_READY))
+				XPTHREAD_CPU_RELAX();
+			cont->next = NULL;
+			cont->run(cont, f->value);
+			return;
+		}
+		cont->next = top;
+	} while (!XPTHREAD_ATOMIC_CAS_PTR(&f->conts, top, cont));
+}
+
+typedef struct {
+	fut_cont cont;
+	xpthread_task_t task;
+	void *(*fn)(void *value, void *arg);
+	void *arg;
+	void *value;
+	xpthread_future_t *target;
+} then_cont;
+
+static void then_task_fn(xpthread_task_t *task) {
+	then_cont *tc = (then_cont *)((char *)task - offsetof(then_cont, task));
+	xpthread_future_t *target = tc->target;
+	void *result = tc->fn(tc->value, tc->arg);
+	free(tc);
+	xpthread_future_set(target, result);
+	xpthread_future_release(target);
+}
+
+static void then_run_inline(fut_cont *cont, void *value) {
+	then_cont *tc = (then_cont *)cont;
+	tc->value = value;
+	then_task_fn(&tc->task);
+}
+
+static void then_run_pool(fut_cont *cont, void *value) {
+	then_cont *tc = (then_cont *)cont;
+	tc->value = value;
+	xpthread_pool_t *pool = xpthread_pool_default();
+	if (!pool || pool_push(pool, &tc->task))
+		then_task_fn(&tc->task);
+}
+
+int XPTHREADCALL xpthread_future_then(xpthread_future_t *f, void *(*fn)(void *value, void *arg), void *arg,
+				      int flags, xpthread_future_t **out)
+{
+	if (!f || !fn || !out) return EINVAL;
+
+	then_cont *tc = calloc(1, sizeof(*tc));
+	if (!tc) return ENOMEM;
+	int ret = xpthread_future_create(&tc->target);
+	if (ret) {
+		free(tc);
+		return ret;
+	}
+	tc->cont.run = (flags & XPTHREAD_FUTURE_POOL) ? then_run_pool : then_run_inline;
+	tc->task.fn = then_task_fn;
+	tc->fn = fn;
+	tc->arg = arg;
+
+	// one reference for the caller, one held until the continuation ran
+	*out = tc->target;
+	xpthread_future_retain(tc->target);
+	future_attach(f, &tc->cont);
+	return 0;
+}
+
+typedef struct {
+	xpthread_future_t *target;
+	volatile long remaining;
+	volatile long refs;
+	int any;
+} combine_state;
+
+typedef struct {
+	fut_cont cont;
+	combine_state *state;
+	size_t index;
+} combine_cont;
+
+static void combine_release(combine_state *cs) {
+	if (XPTHREAD_ATOMIC_FETCH_ADD(&cs->refs, -1) == 1) {
+		xpthread_future_release(cs->target);
+		free(cs);
+	}
+}
+
+static void combine_run(fut_cont *cont, void *value) {
+	combine_cont *cc = (combine_cont *)cont;
+	combine_state *cs = cc->state;
+	(void)value;
+
+	if (cs->any) {
+		// first completion wins, set() rejects the others
+		xpthread_future_set(cs->target, (void *)(uintptr_t)cc->index);
+	} else if (XPTHREAD_ATOMIC_FETCH_ADD(&cs->remaining, -1) == 1) {
+		xpthread_future_set(cs->target, NULL);
+	}
+	free(cc);
+	combine_release(cs);
+}
+
+static int future_combine(xpthread_future_t *const *fs, size_t n, int any, xpthread_future_t **out) {
+	if ((!fs && n) || !out) return EINVAL;
+
+	combine_state *cs = calloc(1, sizeof(*cs));
+	if (!cs) return ENOMEM;
+	int ret = xpthread_future_create(&cs->target);
+	if (ret) {
+		free(cs);
+		return ret;
+	}
+	combine_cont **conts = calloc(n ? n : 1, sizeof(*conts));
+	for (size_t i = 0; conts && i < n; i++) {
+		conts[i] = calloc(1, sizeof(**conts));
+		if (!conts[i]) {
+			while (i--) free(conts[i]);
+			free(conts);
+			conts = NULL;
+		}
+	}
+	if (!conts) {
+		xpthread_future_release(cs->target);
+		free(cs);
+		return ENOMEM;
+	}
+
+	cs->any = any;
+	cs->remaining = (long)n;
+	cs->refs = (long)n + 1;
+	*out = cs->target;
+	xpthread_future_retain(cs->target);
+
+	for (size_t i = 0; i < n; i++) {
+		conts[i]->cont.run = combine_run;
+		conts[i]->state = cs;
+		conts[i]->index = i;
+		future_attach(fs[i], &conts[i]->cont);
+	}
+	free(conts);
+
+	if (!n && !any) xpthread_future_set(cs->target, NULL);
+	combine_release(cs);
+	return 0;
+}
+
+int XPTHREADCALL xpthread_future_when_all(xpthread_future_t *const *futures, size_t n, xpthread_future_t **out) {
+	return future_combine(futures, n, 0, out);
+}
+
+int XPTHREADCALL xpthread_future_when_any(xpthread_future_t *const *futures, size_t n, xpthread_future_t **out) {
+	if (!n) return EINVAL;
+	return future_combine(futures, n, 1, out);
+}
+
+typedef struct {
+	xpthread_task_t task;
+	void *(*fn)(void *arg);
+	void *arg;
+	xpthread_future_t *target;
+} async_task;
+
+static void async_task_fn(xpthread_task_t *task) {
+	async_task *at = (async_task *)task;
+	xpthread_future_t *target = at->target;
+	void *result = at->fn(at->arg);
+	free(at);
+	xpthread_future_set(target, result);
+	xpthread_future_release(target);
+}
+
+int XPTHREADCALL xpthread_future_async(xpthread_pool_t *pool, void *(*fn)(void *arg), void *arg,
+				       xpthread_future_t **out)
+{
+	if (!fn || !out) return EINVAL;
+	if (!pool) pool = xpthread_pool_default();
+	if (!pool) return EAGAIN;
+
+	async_task *at = malloc(sizeof(*at));
+	if (!at) return ENOMEM;
+	int ret = xpthread_future_create(&at->target);
+	if (ret) {
+		free(at);
+		return ret;
+	}
+	at->task.fn = async_task_fn;
+	at->fn = fn;
+	at->arg = arg;
+
+	*out = at->target;
+	xpthread_future_retain(at->target);
+	ret = pool_push(pool, &at->task);
+	if (ret) {
+		xpthread_future_release(at->target);
+		xpthread_future_release(at->target);
+		free(at);
+	}
+	return ret;
+}
+
+/*
+ * Fork-join task groups.
+ *
+ * Spawned tasks live in the caller's frame and go to the spawning worker's
+ * own deque. sync() pops them back LIFO and runs them inline unless a thief
+ * took them first, and keeps stealing until the group drains.
+ */
+static void taskgroup_task_fn(xpthread_task_t *task) {
+	xpthread_spawn_t *spawn = (xpthread_spawn_t *)task;
+	xpthread_taskgroup_t *tg = spawn->group;
+
+	// the spawn record may be gone once the group count drops
+	spawn->fn(spawn);
+	XPTHREAD_ATOMIC_FETCH_ADD(&tg->pending, -1);
+}
+
+int XPTHREADCALL xpthread_taskgroup_init(xpthread_taskgroup_t *tg, xpthread_pool_t *pool) {
+	if (!tg) return EINVAL;
+	if (!pool) pool = xpthread_pool_default();
+	if (!pool) return EAGAIN;
+	tg->pool = pool;
+	tg->pending = 0;
+	return 0;
+}
+
+int XPTHREADCALL xpthread_taskgroup_spawn(xpthread_taskgroup_t *tg, xpthread_spawn_t *spawn,
+					  void (*fn)(xpthread_spawn_t *spawn))
+{
+	if (!tg || !spawn || !fn) return EINVAL;
+
+	spawn->task.fn = taskgroup_task_fn;
+	spawn->fn = fn;
+	spawn->group = tg;
+	XPTHREAD_ATOMIC_FETCH_ADD(&tg->pending, 1);
+	if (pool_push(tg->pool, &spawn->task))
+		taskgroup_task_fn(&spawn->task); // could not queue, run it now
+	return 0;
+}
+
+int XPTHREADCALL xpthread_taskgroup_sync(xpthread_taskgroup_t *tg) {
+	if (!tg) return EINVAL;
+	pool_help_until_zero(tg->pool, &tg->pending);
+	return 0;
+}
+
+/*
+ * Timers.
+ *
+ * A hashed hierarchical timing wheel (Varghese & Lauck) with 1ms ticks:
+ * four levels of 64 slots cover ~4.6 hours, later deadlines park in the
+ * top level and are re-hashed when it cascades. Slots are intrusive
+ * lists, so insert and cancel are O(1). One background thread advances
+ * the wheel and runs callbacks; it sleeps on a futex until the nearest
+ * event and is only woken when an insert moves that event earlier.
+ */
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4
+#define TIMER_SPAN ((uint64_t)1 << (TIMER_BITS * TIMER_LEVELS))
+
+#define TIMER_IDLE 0
+#define TIMER_PENDING 1
+#define TIMER_RUNNING 2
+
+static struct {
+	xp_waitset ws;
+	xpthread_timer_t *slots[TIMER_LEVELS][TIMER_SLOTS];
+	xpthread_timer_t *expired;  // due, waiting for their callback
+	xpthread_timer_t *running;
+	uint64_t now;               // next tick to process
+	uint64_t next_wake;         // tick the timer thread sleeps until
+	unsigned long count;
+	int cancel_waiters;
+	volatile uint32_t wake_seq;
+} timer_wheel = { XP_WAITSET_INITIALIZER, { { NULL } }, NULL, NULL, 0, 0, 0, 0, 0 };
+
+static xpthread_once_t timer_once = XPTHREAD_ONCE_INIT;
+static XPTHREAD_TLS int timer_thread_self = 0;
+
+static uint64_t timer_clock_ms(void) {
+#ifdef _WIN32
+	return GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+static void timer_link(xpthread_timer_t **head, xpthread_timer_t *t) {
+	t->next = *head;
+	if (t->next) t->next->pprev = &t->next;
+	t->pprev = head;
+	*head = t;
+}
+
+static void timer_unlink(xpthread_timer_t *t) {
+	*t->pprev = t->next;
+	if (t->next) t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+static void timer_hash(xpthread_timer_t *t) {
+	uint64_t expires = t->expires;
+	if (expires < timer_wheel.now) expires = timer_wheel.now;
+	uint64_t delta = expires - timer_wheel.now;
+	if (delta >= TIMER_SPAN) {
+		delta = TIMER_SPAN - 1;
+		expires = timer_wheel.now + delta;
+	}
+	int level = 0;
+	while (delta >= (uint64_t)1 << (TIMER_BITS * (level + 1)))
+		level++;
+	timer_link(&timer_wheel.slots[level][(expires >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)], t);
+}
+
+/* first tick at or after now that expires a timer or cascades a slot */
+static uint64_t timer_next_event(void) {
+	uint64_t best = UINT64_MAX;
+	for (int level = 0; level < TIMER_LEVELS; level++) {
+		int shift = TIMER_BITS * level;
+		uint64_t base = timer_wheel.now >> shift;
+		// past its first tick, a slot has cascaded and holds the next lap
+		int first = (timer_wheel.now & (((uint64_t)1 << shift) - 1)) != 0;
+		for (int i = first; i < first + TIMER_SLOTS; i++) {
+			if (timer_wheel.slots[level][(base + i) & (TIMER_SLOTS - 1)]) {
+				uint64_t tick = (base + i) << shift;
+				if (tick < best) best = tick;
+				break;
+			}
+		}
+	}
+	return best;
+}
+
+/* process tick timer_wheel.now, moving due timers to the expired list */
+static void timer_tick(void) {
+	uint64_t now = timer_wheel.now;
+	for (int level = 1; level < TIMER_LEVELS; level++) {
+		int shift = TIMER_BITS * level;
+		if (now & (((uint64_t)1 << shift) - 1)) break;
+		xpthread_timer_t **slot = &timer_wheel.slots[level][(now >> shift) & (TIMER_SLOTS - 1)];
+		xpthread_timer_t *t = *slot;
+		*slot = NULL;
+		while (t) {
+			xpthread_timer_t *next = t->next;
+			timer_hash(t);
+			t = next;
+		}
+	}
+
+	xpthread_timer_t **slot = &timer_wheel.slots[0][now & (TIMER_SLOTS - 1)];
+	while (*slot) {
+		xpthread_timer_t *t = *slot;
+		timer_unlink(t);
+		timer_link(&timer_wheel.expired, t);
+	}
+	timer_wheel.now = now + 1;
+}
+
+static void timer_advance(uint64_t target) {
+	while (timer_wheel.now <= target && !timer_wheel.expired) {
+		uint64_t next = timer_wheel.count ? timer_next_event() : UINT64_MAX;
+		if (next > target) {
+			timer_wheel.now = target + 1;
+			break;
+		}
+		timer_wheel.now = next;
+		timer_tick();
+	}
+}
+
+static void *timer_thread(void *arg) {
+	(void)arg;
+	timer_thread_self = 1;
+	xp_waitset_lock(&timer_wheel.ws);
+	for (;;) {
+		timer_advance(timer_clock_ms());
+
+		xpthread_timer_t *t = timer_wheel.expired;
+		if (t) {
+			timer_unlink(t);
+			timer_wheel.count--;
+			t->state = TIMER_RUNNING;
+			timer_wheel.running = t;
+			xp_waitset_unlock(&timer_wheel.ws);
+
+			t->fn(t->arg);
+
+			xp_waitset_lock(&timer_wheel.ws);
+			timer_wheel.running = NULL;
+			// rearmed or cancelled meanwhile: leave it alone
+			if (t->state == TIMER_RUNNING) {
+				if (t->period) {
+					uint64_t now = timer_clock_ms();
+					t->expires += t->period;
+					if (t->expires <= now) // overran, skip missed periods
+						t->expires += (now - t->expires) / t->period * t->period + t->period;
+					t->state = TIMER_PENDING;
+					timer_wheel.count++;
+					timer_hash(t);
+				} else {
+					t->state = TIMER_IDLE;
+				}
+			}
+			if (timer_wheel.cancel_waiters) xp_waitset_broadcast(&timer_wheel.ws);
+			continue;
+		}
+
+		uint64_t next = timer_wheel.count ? timer_next_event() : UINT64_MAX;
+		uint32_t seq = timer_wheel.wake_seq;
+		timer_wheel.next_wake = next;
+		xp_waitset_unlock(&timer_wheel.ws);
+
+		thread_rec_park();
+		uint64_t now = timer_clock_ms();
+		if (next == UINT64_MAX) {
+			xpthread_futex_wait(&timer_wheel.wake_seq, seq, NULL);
+		} else if (next > now) {
+			struct timespec rel;
+			rel.tv_sec = (time_t)((next - now) / 1000);
+			rel.tv_nsec = (long)((next - now) % 1000) * 1000000L;
+			xpthread_futex_wait(&timer_wheel.wake_seq, seq, &rel);
+		}
+		xp_waitset_lock(&timer_wheel.ws);
+		timer_wheel.next_wake = 0; // awake: inserts need not wake us
+	}
+	return NULL;
+}
+
+static void timer_start(void) {
+	xpthread_t th;
+	timer_wheel.now = timer_clock_ms();
+	if (xpthread_create(&th, NULL, timer_thread, NULL) == 0)
+		xpthread_detach(th);
+}
+
+void XPTHREADCALL xpthread_timer_init(xpthread_timer_t *timer) {
+	memset(timer, 0, sizeof(*timer));
+}
+
+static int timer_schedule(xpthread_timer_t *t, unsigned long delay_ms, unsigned long period_ms,
+			  void (*fn)(void *arg), void *arg)
+{
+	if (!t || !fn) return EINVAL;
+	xpthread_once(&timer_once, timer_start);
+
+	xp_waitset_lock(&timer_wheel.ws);
+	if (t->state == TIMER_PENDING) {
+		timer_unlink(t);
+		timer_wheel.count--;
+	}
+	t->fn = fn;
+	t->arg = arg;
+	t->period = period_ms;
+	t->expires = timer_clock_ms() + delay_ms + 1; // never early: the clock truncates
+	t->state = TIMER_PENDING;
+	timer_wheel.count++;
+	timer_hash(t);
+
+	// only an earlier deadline needs the timer thread's attention
+	int wake = t->expires < timer_wheel.next_wake;
+	if (wake) {
+		timer_wheel.next_wake = t->expires;
+		XPTHREAD_ATOMIC_FETCH_ADD(&timer_wheel.wake_seq, 1);
+	}
+	xp_waitset_unlock(&timer_wheel.ws);
+
+	if (wake) xpthread_futex_wake(&timer_wheel.wake_seq, 1);
+	return 0;
+}
+
+int XPTHREADCALL xpthread_schedule_after(xpthread_timer_t *timer, unsigned long delay_ms,
+					 void (*fn)(void *arg), void *arg)
+{
+	return timer_schedule(timer, delay_ms, 0, fn, arg);
+}
+
+int XPTHREADCALL xpthread_schedule_every(xpthread_timer_t *timer, unsigned long period_ms,
+					 void (*fn)(void *arg), void *arg)
+{
+	if (!period_ms) return EINVAL;
+	return timer_schedule(timer, period_ms, period_ms, fn, arg);
+}
+
+int XPTHREADCALL xpthread_timer_cancel(xpthread_timer_t *timer) {
+	if (!timer) return EINVAL;
+	xpthread_once(&timer_once, timer_start);
+
+	int ret = ESRCH;
+	xp_waitset_lock(&timer_wheel.ws);
+	if (timer->state == TIMER_PENDING) {
+		timer_unlink(timer);
+		timer_wheel.count--;
+		ret = 0;
+	} else if (timer->state == TIMER_RUNNING && timer->period) {
+		ret = 0;
+	}
+	timer->state = TIMER_IDLE;
+
+	// a callback cancelling its own timer must not wait for itself
+	while (timer_wheel.running == timer && !timer_thread_self) {
+		timer_wheel.cancel_waiters++;
+		xp_waitset_wait(&timer_wheel.ws);
+		timer_wheel.cancel_waiters--;
+	}
+	xp_waitset_unlock(&timer_wheel.ws);
+	return ret;
+}
+
+/*
+ * Fibers.
+ *
+ * Fibers are pool tasks: a carrier (worker of a pinned pool) resumes one
+ * by switching from its own stack to the fiber's, and gets control back
+ * when the fiber yields, parks or returns. Whatever must happen once the
+ * fiber is off its stack (requeue it, drop a wait queue lock, free the
+ * stack) is left to the carrier as an "after" callback, so a waker can
+ * never resume a fiber that is still running.
+ *
+ * A fiber may resume on another carrier than it parked on, so code that
+ * runs on fiber stacks must not cache thread-local addresses across a
+ * switch; fiber_self() is kept out of line for that reason.
+ */
+#if defined(_MSC_VER)
+#define XPTHREAD_NOINLINE __declspec(noinline)
+#else
+#define XPTHREAD_NOINLINE __attribute__((noinline))
+#endif
+
+#if defined(_WIN32)
+typedef struct { LPVOID fiber; } fiber_ctx;
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+#define FIBER_ASM 1
+typedef struct { void *sp; } fiber_ctx;
+#else
+#include <ucontext.h>
+typedef struct { ucontext_t uc; } fiber_ctx;
+#endif
+
+typedef struct {
+	fiber_ctx ctx;
+	void (*after)(void *arg);
+	void *after_arg;
+} fiber_carrier;
+
+struct xpthread_fiber {
+	xpthread_task_t task; // resumes the fiber
+	fiber_ctx ctx;
+	fiber_carrier *carrier;
+	void *(*fn)(void *arg);
+	void *arg;
+	void *retval;
+	void *stack;
+	size_t stack_size;
+	xpthread_spinlock_t lock; // guards done and joiner
+	volatile uint32_t done;
+	xpthread_fiber_t *joiner;
+};
+
+static xpthread_pool_t *fiber_pool = NULL;
+static xpthread_once_t fiber_pool_once = XPTHREAD_ONCE_INIT;
+static XPTHREAD_TLS xpthread_fiber_t *fiber_current = NULL;
+
+static void fiber_pool_init(void) {
+	pool_create(&fiber_pool, 0, 1);
+}
+
+static void fiber_main(xpthread_fiber_t *f);
+
+#if defined(FIBER_ASM)
+/*
+ * fiber_switch(&from->sp, to->sp): push the callee-saved registers, swap
+ * stack pointers, pop the other side's registers and return into it.
+ * fiber_start is the return address of a fresh stack and calls
+ * fn(arg), which were planted in callee-saved registers.
+ */
+#define FIBER_ASM_STR2(x) #x
+#define FIBER_ASM_STR(x) FIBER_ASM_STR2(x)
+#define FIBER_ASM_SYM(name) FIBER_ASM_STR(__USER_LABEL_PREFIX__) #name
+#ifdef __ELF__
+#define FIBER_ASM_HIDDEN(name) ".hidden " FIBER_ASM_SYM(name) "\n"
+#else
+#define FIBER_ASM_HIDDEN(name) ".private_extern " FIBER_ASM_SYM(name) "\n"
+#endif
+
+void xpthread__fiber_switch(void **from_sp, void *to_sp);
+void xpthread__fiber_start(void);
+
+#if defined(__x86_64__)
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".globl " FIBER_ASM_SYM(xpthread__fiber_switch) "\n"
+	FIBER_ASM_HIDDEN(xpthread__fiber_switch)
+	FIBER_ASM_SYM(xpthread__fiber_switch) ":\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".p2align 4\n"
+	".globl " FIBER_ASM_SYM(xpthread__fiber_start) "\n"
+	FIBER_ASM_HIDDEN(xpthread__fiber_start)
+	FIBER_ASM_SYM(xpthread__fiber_start) ":\n"
+	"	movq %r12, %rdi\n"
+	"	callq *%r13\n"
+	"	ud2\n"
+);
+
+static void fiber_ctx_init(fiber_ctx *ctx, void *stack, size_t size, xpthread_fiber_t *f) {
+	uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+	uint64_t *sp = (uint64_t *)(top - 80);
+	sp[0] = 0x1F80 | ((uint64_t)0x037F << 32); // default MXCSR and x87 control word
+	sp[1] = 0;                                 // r15
+	sp[2] = 0;                                 // r14
+	sp[3] = (uint64_t)(uintptr_t)fiber_main;   // r13
+	sp[4] = (uint64_t)(uintptr_t)f;            // r12
+	sp[5] = 0;                                 // rbx
+	sp[6] = 0;                                 // rbp
+	sp[7] = (uint64_t)(uintptr_t)xpthread__fiber_start;
+	ctx->sp = sp;
+}
+#else /* __aarch64__ */
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".globl " FIBER_ASM_SYM(xpthread__fiber_switch) "\n"
+	FIBER_ASM_HIDDEN(xpthread__fiber_switch)
+	FIBER_ASM_SYM(xpthread__fiber_switch) ":\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".p2align 4\n"
+	".globl " FIBER_ASM_SYM(xpthread__fiber_start) "\n"
+	FIBER_ASM_HIDDEN(xpthread__fiber_start)
+	FIBER_ASM_SYM(xpthread__fiber_start) ":\n"
+	"	mov x0, x20\n"
+	"	blr x19\n"
+	"	brk #0\n"
+);
+
+static void fiber_ctx_init(fiber_ctx *ctx, void *stack, size_t size, xpthread_fiber_t *f) {
+	uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+	uint64_t *sp = (uint64_t *)(top - 160);
+	memset(sp, 0, 160);
+	sp[0] = (uint64_t)(uintptr_t)fiber_main;             // x19
+	sp[1] = (uint64_t)(uintptr_t)f;                      // x20
+	sp[11] = (uint64_t)(uintptr_t)xpthread__fiber_start; // x30
+	ctx->sp = sp;
+}
+#endif
+
+static void fiber_ctx_switch(fiber_ctx *from, fiber_ctx *to) {
+	xpthread__fiber_switch(&from->sp, to->sp);
+}
+#elif defined(_WIN32)
+static XPTHREAD_TLS LPVOID fiber_carrier_handle = NULL;
+
+static void WINAPI fiber_entry_win(LPVOID arg) {
+	fiber_main((xpthread_fiber_t *)arg);
+}
+
+static void fiber_ctx_switch(fiber_ctx *from, fiber_ctx *to) {
+	(void)from;
+	SwitchToFiber(to->fiber);
+}
+#else
+static void fiber_entry_uc(void) {
+	fiber_main(fiber_current);
+}
+
+static void fiber_ctx_init(fiber_ctx *ctx, void *stack, size_t size, xpthread_fiber_t *f) {
+	(void)f; // picked up from fiber_current on first resume
+	getcontext(&ctx->uc);
+	ctx->uc.uc_stack.ss_sp = stack;
+	ctx->uc.uc_stack.ss_size = size;
+	ctx->uc.uc_link = NULL;
+	makecontext(&ctx->uc, fiber_entry_uc, 0);
+}
+
+static void fiber_ctx_switch(fiber_ctx *from, fiber_ctx *to) {
+	swapcontext(&from->uc, &to->uc);
+}
+#endif
+
+#ifndef _WIN32
+/*
+ * Stacks are mmapped with a PROT_NONE guard page below them. Default-sized
+ * stacks are cached, since munmap costs a TLB shootdown.
+ */
+#define FIBER_STACK_CACHE 64
+
+static xpthread_spinlock_t fiber_stack_lock = XPTHREAD_SPINLOCK_INITIALIZER;
+static void *fiber_stack_cache[FIBER_STACK_CACHE];
+static int fiber_stack_cached = 0;
+
+static size_t fiber_page_size(void) {
+	static volatile long page = 0;
+	long p = XPTHREAD_ATOMIC_LOAD(&page);
+	if (!p) {
+		p = sysconf(_SC_PAGESIZE);
+		if (p <= 0) p = 4096;
+		XPTHREAD_ATOMIC_STORE(&page, p);
+	}
+	return (size_t)p;
+}
+
+static void *fiber_stack_alloc(size_t size) {
+	if (size == XPTHREAD_FIBER_STACK_SIZE) {
+		void *stack = NULL;
+		xpthread_spin_lock(&fiber_stack_lock);
+		if (fiber_stack_cached) stack = fiber_stack_cache[--fiber_stack_cached];
+		xpthread_spin_unlock(&fiber_stack_lock);
+		if (stack) return stack;
+	}
+
+	size_t page = fiber_page_size();
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_STACK
+	flags |= MAP_STACK;
+#endif
+	char *base = mmap(NULL, size + page, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (base == MAP_FAILED) return NULL;
+	if (mprotect(base, page, PROT_NONE)) {
+		munmap(base, size + page);
+		return NULL;
+	}
+	return base + page;
+}
+
+static void fiber_stack_free(void *stack, size_t size) {
+	if (size == XPTHREAD_FIBER_STACK_SIZE) {
+		xpthread_spin_lock(&fiber_stack_lock);
+		if (fiber_stack_cached < FIBER_STACK_CACHE) {
+			fiber_stack_cache[fiber_stack_cached++] = stack;
+			stack = NULL;
+		}
+		xpthread_spin_unlock(&fiber_stack_lock);
+		if (!stack) return;
+	}
+	size_t page = fiber_page_size();
+	munmap((char *)stack - page, size + page);
+}
+#endif
+
+static XPTHREAD_NOINLINE xpthread_fiber_t *fiber_self(void) {
+	return fiber_current;
+}
+
+static void fiber_ready(xpthread_fiber_t *f) {
+	if (pool_push(fiber_pool, &f->task)) {
+		pool_inject(fiber_pool, &f->task);
+		pool_notify(fiber_pool);
+	}
+}
+
+/*
+ * Switch away from fiber f (the caller) and have its carrier run
+ * after(arg) once f is off its stack. Returns when f is made ready again.
+ */
+static void fiber_park(xpthread_fiber_t *f, void (*after)(void *arg), void *arg) {
+	fiber_carrier *c = f->carrier;
+	c->after = after;
+	c->after_arg = arg;
+	fiber_ctx_switch(&f->ctx, &c->ctx);
+}
+
+static void fiber_task_fn(xpthread_task_t *task) {
+	xpthread_fiber_t *f = (xpthread_fiber_t *)task;
+	fiber_carrier c;
+	c.after = NULL;
+#ifdef _WIN32
+	if (!fiber_carrier_handle) fiber_carrier_handle = ConvertThreadToFiber(NULL);
+	c.ctx.fiber = fiber_carrier_handle;
+#endif
+	f->carrier = &c;
+	fiber_current = f;
+	fiber_ctx_switch(&c.ctx, &f->ctx);
+	fiber_current = NULL;
+	if (c.after) c.after(c.after_arg);
+}
+
+static void fiber_requeue_after(void *arg) {
+	xpthread_fiber_t *f = (xpthread_fiber_t *)arg;
+	// behind the carrier's other ready fibers: its own deque is LIFO
+	pool_inject(fiber_pool, &f->task);
+	pool_notify(fiber_pool);
+}
+
+static void fiber_unlock_after(void *arg) {
+	xpthread_spin_unlock((xpthread_spinlock_t *)arg);
+}
+
+static void fiber_exit_after(void *arg) {
+	xpthread_fiber_t *f = (xpthread_fiber_t *)arg;
+#ifdef _WIN32
+	DeleteFiber(f->ctx.fiber);
+#else
+	fiber_stack_free(f->stack, f->stack_size);
+#endif
+	f->stack = NULL;
+
+	xpthread_spin_lock(&f->lock);
+	XPTHREAD_ATOMIC_STORE(&f->done, 1);
+	xpthread_fiber_t *joiner = f->joiner;
+	// a thread joiner frees f once it can take the lock
+	if (!joiner) xpthread_futex_wake(&f->done, INT32_MAX);
+	xpthread_spin_unlock(&f->lock);
+	if (joiner) fiber_ready(joiner);
+}
+
+static void fiber_main(xpthread_fiber_t *f) {
+	f->retval = f->fn(f->arg);
+	fiber_park(f, fiber_exit_after, f);
+}
+
+int XPTHREADCALL xpthread_fiber_create(xpthread_fiber_t **out, size_t stack_size,
+				       void *(*fn)(void *arg), void *arg)
+{
+	if (!out || !fn) return EINVAL;
+	xpthread_once(&fiber_pool_once, fiber_pool_init);
+	if (!fiber_pool) return EAGAIN;
+	if (!stack_size) stack_size = XPTHREAD_FIBER_STACK_SIZE;
+
+	xpthread_fiber_t *f = calloc(1, sizeof(*f));
+	if (!f) return ENOMEM;
+	f->task.fn = fiber_task_fn;
+	f->fn = fn;
+	f->arg = arg;
+	f->stack_size = stack_size;
+	xpthread_spin_init(&f->lock);
+
+#ifdef _WIN32
+	f->ctx.fiber = CreateFiberEx(0, stack_size, FIBER_FLAG_FLOAT_SWITCH, fiber_entry_win, f);
+	if (!f->ctx.fiber) {
+		free(f);
+		return ENOMEM;
+	}
+#else
+	stack_size = (stack_size + fiber_page_size() - 1) & ~(fiber_page_size() - 1);
+	f->stack_size = stack_size;
+	f->stack = fiber_stack_alloc(stack_size);
+	if (!f->stack) {
+		free(f);
+		return ENOMEM;
+	}
+	fiber_ctx_init(&f->ctx, f->stack, stack_size, f);
+#endif
+
+	*out = f;
+	fiber_ready(f);
+	return 0;
+}
+
+void XPTHREADCALL xpthread_fiber_yield(void) {
+	xpthread_fiber_t *f = fiber_self();
+	if (!f) {
+		xpthread_yield_cpu();
+		return;
+	}
+	fiber_park(f, fiber_requeue_after, f);
+}
+
+xpthread_fiber_t *XPTHREADCALL xpthread_fiber_self(void) {
+	return fiber_self();
+}
+
+int XPTHREADCALL xpthread_fiber_join(xpthread_fiber_t *f, void **retval) {
+	if (!f) return EINVAL;
+	xpthread_fiber_t *self = fiber_self();
+	if (self == f) return EDEADLK;
+
+	if (self) {
+		xpthread_spin_lock(&f->lock);
+		if (!f->done) {
+			f->joiner = self;
+			fiber_park(self, fiber_unlock_after, &f->lock);
+		} else {
+			xpthread_spin_unlock(&f->lock);
+		}
+	} else {
+		thread_rec_park();
+		while (!XPTHREAD_ATOMIC_LOAD(&f->done))
+			xpthread_futex_wait(&f->done, 0, NULL);
+	}
+
+	// the exiting carrier is done with f once it drops the lock
+	xpthread_spin_lock(&f->lock);
+	xpthread_spin_unlock(&f->lock);
+	if (retval) *retval = f->retval;
+	free(f);
+	return 0;
+}
+
+/*
+ * Fiber-aware mutex and condition variable.
+ *
+ * Waiters queue a node on their own stack under the object's queue lock.
+ * A fiber parks and lets its carrier drop the queue lock after the
+ * switch; a plain thread drops it and sleeps on the node's futex word.
+ * Mutex ownership is handed directly to the first waiter on unlock.
+ */
+struct xpthread_fwait {
+	struct xpthread_fwait *next;
+	xpthread_fiber_t *fiber;  // NULL for a thread waiter
+	volatile uint32_t ready;
+};
+
+static void fwait_enqueue(struct xpthread_fwait **head, struct xpthread_fwait **tail, struct xpthread_fwait *w) {
+	w->next = NULL;
+	if (*tail) (*tail)->next = w;
+	else *head = w;
+	*tail = w;
+}
+
+/* block until w is woken; qlock is held on entry and released */
+static void fwait_block(struct xpthread_fwait *w, xpthread_spinlock_t *qlock) {
+	if (w->fiber) {
+		fiber_park(w->fiber, fiber_unlock_after, qlock);
+		return;
+	}
+	xpthread_spin_unlock(qlock);
+	thread_rec_park();
+	while (!XPTHREAD_ATOMIC_LOAD(&w->ready))
+		xpthread_futex_wait(&w->ready, 0, NULL);
+	// the waker touches w until it drops the queue lock
+	xpthread_spin_lock(qlock);
+	xpthread_spin_unlock(qlock);
+}
+
+/* wake w; called with the queue lock held */
+static void fwait_wake(struct xpthread_fwait *w) {
+	if (w->fiber) {
+		fiber_ready(w->fiber);
+	} else {
+		XPTHREAD_ATOMIC_STORE(&w->ready, 1);
+		xpthread_futex_wake(&w->ready, 1);
+	}
+}
+
+#define FMUTEX_UNLOCKED 0
+#define FMUTEX_LOCKED 1
+#define FMUTEX_QUEUED 2
+
+int XPTHREADCALL xpthread_fmutex_init(xpthread_fmutex_t *m) {
+	if (!m) return EINVAL;
+	m->state = FMUTEX_UNLOCKED;
+	xpthread_spin_init(&m->qlock);
+	m->head = m->tail = NULL;
+	return 0;
+}
+
+int XPTHREADCALL xpthread_fmutex_destroy(xpthread_fmutex_t *m) {
+	if (!m) return EINVAL;
+	return XPTHREAD_ATOMIC_LOAD(&m->state) != FMUTEX_UNLOCKED ? EBUSY : 0;
+}
+
+int XPTHREADCALL xpthread_fmutex_trylock(xpthread_fmutex_t *m) {
+	if (!m) return EINVAL;
+	return XPTHREAD_ATOMIC_CAS(&m->state, FMUTEX_UNLOCKED, FMUTEX_LOCKED) ? 0 : EBUSY;
+}
+
+int XPTHREADCALL xpthread_fmutex_lock(xpthread_fmutex_t *m) {
+	if (!m) return EINVAL;
+	if (XPTHREAD_ATOMIC_CAS(&m->state, FMUTEX_UNLOCKED, FMUTEX_LOCKED)) return 0;
+
+	struct xpthread_fwait w;
+	w.fiber = fiber_self();
+	w.ready = 0;
+
+	xpthread_spin_lock(&m->qlock);
+	for (;;) {
+		uint32_t state = XPTHREAD_ATOMIC_LOAD(&m->state);
+		if (state == FMUTEX_UNLOCKED) {
+			if (XPTHREAD_ATOMIC_CAS(&m->state, FMUTEX_UNLOCKED, FMUTEX_LOCKED)) {
+				xpthread_spin_unlock(&m->qlock);
+				return 0;
+			}
+		} else if (state == FMUTEX_QUEUED || XPTHREAD_ATOMIC_CAS(&m->state, FMUTEX_LOCKED, FMUTEX_QUEUED)) {
+			break;
+		}
+	}
+	fwait_enqueue(&m->head, &m->tail, &w);
+	fwait_block(&w, &m->qlock); // returns owning the mutex
+	return 0;
+}
+
+int XPTHREADCALL xpthread_fmutex_unlock(xpthread_fmutex_t *m) {
+	if (!m) return EINVAL;
+	if (XPTHREAD_ATOMIC_CAS(&m->state, FMUTEX_LOCKED, FMUTEX_UNLOCKED)) return 0;
+
+	// queued waiters: hand the lock to the oldest one
+	xpthread_spin_lock(&m->qlock);
+	struct xpthread_fwait *w = m->head;
+	m->head = w->next;
+	if (!m->head) {
+		m->tail = NULL;
+		XPTHREAD_ATOMIC_STORE(&m->state, FMUTEX_LOCKED);
+	}
+	fwait_wake(w);
+	xpthread_spin_unlock(&m->qlock);
+	return 0;
+}
+
+int XPTHREADCALL xpthread_fcond_init(xpthread_fcond_t *c) {
+	if (!c) return EINVAL;
+	xpthread_spin_init(&c->qlock);
+	c->head = c->tail = NULL;
+	return 0;
+}
+
+int XPTHREADCALL xpthread_fcond_destroy(xpthread_fcond_t *c) {
+	if (!c) return EINVAL;
+	return c->head ? EBUSY : 0;
+}
+
+int XPTHREADCALL xpthread_fcond_wait(xpthread_fcond_t *c, xpthread_fmutex_t *m) {
+	if (!c || !m) return EINVAL;
+
+	struct xpthread_fwait w;
+	w.fiber = fiber_self();
+	w.ready = 0;
+
+	xpthread_spin_lock(&c->qlock);
+	fwait_enqueue(&c->head, &c->tail, &w);
+	xpthread_fmutex_unlock(m);
+	fwait_block(&w, &c->qlock);
+	return xpthread_fmutex_lock(m);
+}
+
+int XPTHREADCALL xpthread_fcond_signal(xpthread_fcond_t *c) {
+	if (!c) return EINVAL;
+	xpthread_spin_lock(&c->qlock);
+	struct xpthread_fwait *w = c->head;
+	if (w) {
+		c->head = w->next;
+		if (!c->head) c->tail = NULL;
+		fwait_wake(w);
+	}
+	xpthread_spin_unlock(&c->qlock);
+	return 0;
+}
+
+int XPTHREADCALL xpthread_fcond_broadcast(xpthread_fcond_t *c) {
+	if (!c) return EINVAL;
+	xpthread_spin_lock(&c->qlock);
+	struct xpthread_fwait *w = c->head;
+	c->head = c->tail = NULL;
+	while (w) {
+		struct xpthread_fwait *next = w->next;
+		fwait_wake(w);
+		w = next;
+	}
+	xpthread_spin_unlock(&c->qlock);
+	return 0;
+}
@@ -0,0 +1,148 @@
+#include <atomic>
+#include <cstdio>
+#include <exception>
+#include "xpthread.hpp"
+
+// Fire-and-forget coroutine type for the tests
+struct detached {
+    struct promise_type {
+        detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// Shared data
+static const int COROS = 100;
+static const int ROUNDS = 100;
+static xpthread::async_mutex mutex;
+static xpthread::async_semaphore sem(3);
+static long counter = 0;
+static std::atomic<int> inside{0};
+static std::atomic<int> max_inside{0};
+static std::atomic<int> done{0};
+
+detached worker(xpthread::pool pool) {
+    co_await pool.schedule();
+    for (int i = 0; i < ROUNDS; i++) {
+        co_await mutex.lock_async();
+        long old = counter;
+        if (i % 10 == 0) co_await pool.schedule(); // hold the lock across a hop
+        counter = old + 1;
+        mutex.unlock();
+
+        co_await sem.acquire();
+        int now = ++inside;
+        int seen = max_inside.load();
+        while (now > seen && !max_inside.compare_exchange_weak(seen, now)) {}
+        co_await pool.schedule();
+        --inside;
+        sem.release();
+    }
+    ++done;
+}
+
+detached waiter(xpthread::async_mutex &m, xpthread::async_semaphore &s, int &stage) {
+    co_await m.lock_async();
+    stage = 1;
+    m.unlock();
+    co_await s.acquire();
+    stage = 2;
+}
+
+// Lock wrapper test data
+static const int LOCK_THREADS = 4;
+static const int LOCK_ITERS = 100000;
+
+template <class Mutex>
+struct lock_test {
+    Mutex mutex;
+    long value = 0;
+
+    static void *run(void *arg) {
+        lock_test *t = static_cast<lock_test *>(arg);
+        for (int i = 0; i < LOCK_ITERS; i++) {
+            if (i % 2) {
+                xpthread::scoped_lock<Mutex> guard(t->mutex);
+                t->value++;
+            } else {
+                xpthread::unique_lock<Mutex> guard(t->mutex, std::defer_lock);
+                guard.lock();
+                t->value++;
+            }
+        }
+        return nullptr;
+    }
+
+    long go() {
+        xpthread_t threads[LOCK_THREADS];
+        for (int i = 0; i < LOCK_THREADS; i++)
+            xpthread_create(&threads[i], NULL, run, this);
+        for (int i = 0; i < LOCK_THREADS; i++)
+            xpthread_join(threads[i], NULL);
+        return value;
+    }
+};
+
+int main() {
+    printf("xpthread C++ test start\n");
+
+    // --- Test policy mutexes ---
+    {
+        lock_test<xpthread::spin_mutex> spin;
+        lock_test<xpthread::futex_mutex> futex;
+        lock_test<xpthread::instrumented_mutex<>> counted;
+        long expect = (long)LOCK_THREADS * LOCK_ITERS;
+        long a = spin.go(), b = futex.go(), c = counted.go();
+        xpthread::policy::lock_stats stats = counted.mutex.policy().stats();
+        printf("Policy mutexes: spin = %ld, futex = %ld, instrumented = %ld (%llu contended)\n",
+               a, b, c, (unsigned long long)stats.contentions);
+        if (a != expect || b != expect || c != expect || stats.acquisitions != (std::uint64_t)expect) {
+            fprintf(stderr, "Policy mutex result mismatch\n");
+            return 1;
+        }
+    }
+
+    // --- Test hand-off to suspended coroutines ---
+    {
+        xpthread::async_mutex m;
+        xpthread::async_semaphore s(0);
+        int stage = 0;
+        m.try_lock();
+        waiter(m, s, stage); // suspends on the mutex
+        int before = stage;
+        m.unlock();          // resumes it here, it then waits on s
+        int between = stage;
+        s.release();
+        printf("Hand-off: stages %d -> %d -> %d\n", before, between, stage);
+        if (before != 0 || between != 1 || stage != 2 || !m.try_lock() || s.try_acquire()) {
+            fprintf(stderr, "Hand-off result mismatch\n");
+            return 1;
+        }
+        m.unlock();
+    }
+
+    // --- Test coroutine mutex / semaphore ---
+    xpthread_pool_t *workers;
+    if (xpthread_pool_create(&workers, 4)) {
+        fprintf(stderr, "Failed to create pool\n");
+        return 1;
+    }
+    xpthread::pool pool(workers);
+    for (int i = 0; i < COROS; i++)
+        worker(pool);
+    while (done.load() != COROS)
+        xpthread_fiber_yield();
+    xpthread_pool_destroy(workers);
+
+    printf("Coroutines: counter = %ld, max inside semaphore = %d\n", counter, max_inside.load());
+    if (counter != (long)COROS * ROUNDS || max_inside.load() > 3) {
+        fprintf(stderr, "Coroutine result mismatch\n");
+        return 1;
+    }
+
+    printf("xpthread C++ test finished\n");
+    return 0;
+}
@@ -1,5 +1,7 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include "xpthread.h"
 
@@ -29,6 +31,562 @@ void *thread_func(void *arg) {
     return (void *)(size_t)(id * 10); // return value
 }
 
+// Spinlock test data
+static xpthread_spinlock_t spin = XPTHREAD_SPINLOCK_INITIALIZER;
+static xpthread_ticketlock_t ticket = XPTHREAD_TICKETLOCK_INITIALIZER;
+static int spin_counter = 0;
+static int ticket_counter = 0;
+
+void *spin_func(void *arg) {
+    (void)arg;
+    for (int i = 0; i < 10000; i++) {
+        xpthread_spin_lock(&spin);
+        spin_counter++;
+        xpthread_spin_unlock(&spin);
+
+        xpthread_ticket_lock(&ticket);
+        ticket_counter++;
+        xpthread_ticket_unlock(&ticket);
+    }
+    return NULL;
+}
+
+// Flat-combining test data
+static xpthread_fc_t fc;
+static long fc_counter = 0;
+
+void fc_add(void *state, void *op) {
+    *(long *)state += *(long *)op;
+}
+
+void *fc_func(void *arg) {
+    (void)arg;
+    xpthread_fc_record_t rec = XPTHREAD_FC_RECORD_INITIALIZER;
+    long one = 1;
+    for (int i = 0; i < 10000; i++)
+        xpthread_fc_execute(&fc, &rec, &one);
+    xpthread_fc_record_release(&fc, &rec);
+    return NULL;
+}
+
+// Delegation test data
+static xpthread_delegate_t delegate;
+static long delegate_counter = 0;
+
+void *delegate_add(void *state, void *arg) {
+    *(long *)state += (long)(size_t)arg;
+    return (void *)(size_t)*(long *)state;
+}
+
+void *delegate_func(void *arg) {
+    (void)arg;
+    int client;
+    if (xpthread_delegate_register(&delegate, &client) != 0)
+        return NULL;
+    for (int i = 0; i < 1000; i++)
+        xpthread_delegate_call(&delegate, client, delegate_add, (void *)1);
+    xpthread_delegate_unregister(&delegate, client);
+    return NULL;
+}
+
+// Hazard pointer test data
+typedef struct { int value; } hp_node;
+static hp_node *volatile hp_shared = NULL;
+static xpthread_spinlock_t hp_lock = XPTHREAD_SPINLOCK_INITIALIZER;
+static long hp_allocated = 0;
+static long hp_freed = 0;
+
+void hp_free(void *p) {
+    xpthread_spin_lock(&hp_lock);
+    hp_freed++;
+    xpthread_spin_unlock(&hp_lock);
+    free(p);
+}
+
+void *hp_func(void *arg) {
+    (void)arg;
+    for (int i = 0; i < 1000; i++) {
+        hp_node *n = xpthread_hazard_protect(0, (void *const volatile *)&hp_shared);
+        if (n && n->value < 0) printf("Hazard: bad node\n");
+        xpthread_hazard_clear(0);
+
+        hp_node *fresh = malloc(sizeof(*fresh));
+        fresh->value = i;
+        xpthread_spin_lock(&hp_lock);
+        hp_node *old = hp_shared;
+        hp_shared = fresh;
+        hp_allocated++;
+        xpthread_spin_unlock(&hp_lock);
+        if (old) xpthread_hazard_retire(old, hp_free);
+    }
+    return NULL;
+}
+
+// Epoch reclamation test data
+static hp_node *volatile ebr_shared = NULL;
+static long ebr_allocated = 0;
+static long ebr_freed = 0;
+
+void ebr_free(void *p) {
+    xpthread_spin_lock(&hp_lock);
+    ebr_freed++;
+    xpthread_spin_unlock(&hp_lock);
+    free(p);
+}
+
+void *ebr_func(void *arg) {
+    (void)arg;
+    for (int i = 0; i < 1000; i++) {
+        xpthread_epoch_enter();
+        hp_node *n = ebr_shared;
+        if (n && n->value < 0) printf("Epoch: bad node\n");
+        xpthread_epoch_exit();
+
+        hp_node *fresh = malloc(sizeof(*fresh));
+        fresh->value = i;
+        xpthread_spin_lock(&hp_lock);
+        hp_node *old = ebr_shared;
+        ebr_shared = fresh;
+        ebr_allocated++;
+        xpthread_spin_unlock(&hp_lock);
+        if (old) xpthread_epoch_retire(old, ebr_free);
+    }
+    return NULL;
+}
+
+// A free_fn that blocks in the library while the collector runs
+static long ebr_park_freed = 0;
+
+void ebr_park_free(void *p) {
+    struct timespec none = { 0, 0 };
+    xpthread_park(&none);
+    ebr_park_freed++;
+    free(p);
+}
+
+// RCU test data
+typedef struct {
+    xpthread_rcu_head_t rcu;
+    int value;
+} rcu_node;
+static rcu_node *rcu_shared = NULL;
+static long rcu_freed = 0;
+
+void rcu_free(xpthread_rcu_head_t *head) {
+    rcu_freed++; // only ever called from the RCU callback thread
+    free(head);
+}
+
+void *rcu_func(void *arg) {
+    (void)arg;
+    for (int i = 0; i < 1000; i++) {
+        xpthread_rcu_read_lock();
+        rcu_node *n = xpthread_rcu_dereference(rcu_shared);
+        if (n && n->value < 0) printf("RCU: bad node\n");
+        xpthread_rcu_read_unlock();
+
+        if (i % 10 == 0) {
+            rcu_node *fresh = malloc(sizeof(*fresh));
+            fresh->value = i;
+            xpthread_spin_lock(&hp_lock);
+            rcu_node *old = rcu_shared;
+            xpthread_rcu_assign_pointer(rcu_shared, fresh);
+            xpthread_spin_unlock(&hp_lock);
+            if (old && xpthread_call_rcu(&old->rcu, rcu_free) != 0) {
+                // no callback thread: wait for readers and free it here
+                xpthread_synchronize_rcu();
+                rcu_free(&old->rcu);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Seqlock test data
+static xpthread_seqlock_t seqlock = XPTHREAD_SEQLOCK_INITIALIZER;
+static struct { long a, b; } seq_snapshot;
+static volatile int seq_done = 0;
+static volatile int seq_torn = 0;
+
+void *seq_reader(void *arg) {
+    (void)arg;
+    while (!seq_done) {
+        long a, b;
+        unsigned long seq;
+        do {
+            seq = xpthread_seqlock_read_begin(&seqlock);
+            a = seq_snapshot.a;
+            b = seq_snapshot.b;
+        } while (xpthread_seqlock_read_retry(&seqlock, seq));
+        if (a != -b) seq_torn = 1;
+    }
+    return NULL;
+}
+
+// Left-right test data
+static xpthread_leftright_t lr;
+static struct { long a, b; } lr_replicas[2];
+
+void lr_update(void *instance, void *arg) {
+    long v = *(long *)arg;
+    long *pair = (long *)instance;
+    pair[0] = v;
+    pair[1] = -v;
+}
+
+void *lr_reader(void *arg) {
+    (void)arg;
+    while (!seq_done) {
+        unsigned int token;
+        const long *pair = xpthread_lr_read_lock(&lr, &token);
+        if (pair[0] != -pair[1]) seq_torn = 1;
+        xpthread_lr_read_unlock(&lr, token);
+    }
+    return NULL;
+}
+
+// Parallel loop test data
+static unsigned char *pfor_hits;
+
+void pfor_mark(size_t begin, size_t end, void *ctx) {
+    (void)ctx;
+    for (size_t i = begin; i < end; i++)
+        pfor_hits[i]++;
+}
+
+void preduce_sum(size_t begin, size_t end, void *acc, void *ctx) {
+    (void)ctx;
+    for (size_t i = begin; i < end; i++)
+        *(unsigned long long *)acc += i;
+}
+
+void preduce_combine(void *acc, const void *other, void *ctx) {
+    (void)ctx;
+    *(unsigned long long *)acc += *(const unsigned long long *)other;
+}
+
+// Parallel sort / scan test data
+int psort_cmp(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+void pscan_add(void *acc, const void *elem, void *ctx) {
+    (void)ctx;
+    *(unsigned long long *)acc += *(const unsigned long long *)elem;
+}
+
+// Task graph test data: parse -> analyze -> emit per file, emit in order
+#define GRAPH_FILES 16
+static volatile long graph_stage[GRAPH_FILES];
+static volatile int graph_order_ok = 1;
+
+void graph_step(void *arg) {
+    size_t id = (size_t)arg;
+    size_t file = id / 3, stage = id % 3;
+    if (graph_stage[file] != (long)stage) graph_order_ok = 0;
+    graph_stage[file] = (long)stage + 1;
+}
+
+// Future test data
+void *future_square(void *arg) {
+    size_t v = (size_t)arg;
+    return (void *)(v * v);
+}
+
+void *future_add_one(void *value, void *arg) {
+    (void)arg;
+    return (void *)((size_t)value + 1);
+}
+
+// Task group test data
+typedef struct {
+    xpthread_spawn_t spawn;
+    unsigned int n;
+    unsigned long result;
+} fib_frame;
+
+void fib_task(xpthread_spawn_t *spawn) {
+    fib_frame *f = (fib_frame *)spawn;
+    if (f->n < 2) {
+        f->result = f->n;
+        return;
+    }
+    xpthread_taskgroup_t tg;
+    fib_frame a = { .n = f->n - 1 }, b = { .n = f->n - 2 };
+    xpthread_taskgroup_init(&tg, NULL);
+    xpthread_taskgroup_spawn(&tg, &a.spawn, fib_task);
+    fib_task(&b.spawn); // continue with the other half ourselves
+    xpthread_taskgroup_sync(&tg);
+    f->result = a.result + b.result;
+}
+
+// Timer test data
+volatile long timer_fired = 0;
+
+void timer_cb(void *arg) {
+    __atomic_fetch_add((volatile long *)arg, 1, __ATOMIC_SEQ_CST);
+}
+
+// Pipeline test data
+#define PIPE_N 20000
+long pipe_items[PIPE_N];
+long pipe_next = 0;
+long pipe_last = -1;
+long pipe_sum = 0;
+int pipe_out_of_order = 0;
+
+void *pipe_source(void *item, void *arg) {
+    (void)item; (void)arg;
+    if (pipe_next == PIPE_N) return NULL;
+    pipe_items[pipe_next] = pipe_next;
+    return &pipe_items[pipe_next++];
+}
+
+void *pipe_square(void *item, void *arg) {
+    (void)arg;
+    long *v = item;
+    *v = *v * 2 + 1;
+    return v;
+}
+
+void *pipe_filter(void *item, void *arg) {
+    (void)arg;
+    return *(long *)item % 3 == 0 ? NULL : item;
+}
+
+void *pipe_sink(void *item, void *arg) {
+    (void)arg;
+    long v = *(long *)item;
+    if (v <= pipe_last) pipe_out_of_order++;
+    pipe_last = v;
+    pipe_sum += v;
+    return NULL;
+}
+
+// Fiber test data
+#define FIBERS 1000
+#define FIBER_YIELDS 10
+volatile long fiber_steps = 0;
+
+void *fiber_fn(void *arg) {
+    for (int i = 0; i < FIBER_YIELDS; i++) {
+        __atomic_fetch_add(&fiber_steps, 1, __ATOMIC_SEQ_CST);
+        xpthread_fiber_yield();
+    }
+    return arg;
+}
+
+void *fiber_parent(void *arg) {
+    xpthread_fiber_t *child;
+    void *ret = NULL;
+    xpthread_fiber_create(&child, 0, fiber_fn, arg);
+    xpthread_fiber_join(child, &ret);
+    return (void *)((intptr_t)ret + 1);
+}
+
+// Fiber mutex test data: fibers and a thread pass a token around
+#define FM_FIBERS 64
+#define FM_ROUNDS 50
+xpthread_fmutex_t fm_lock = XPTHREAD_FMUTEX_INITIALIZER;
+xpthread_fcond_t fm_cond = XPTHREAD_FCOND_INITIALIZER;
+long fm_turn = 0;
+long fm_count = 0;
+
+void *fm_fiber(void *arg) {
+    long id = (long)(intptr_t)arg;
+    for (int r = 0; r < FM_ROUNDS; r++) {
+        xpthread_fmutex_lock(&fm_lock);
+        while (fm_turn % (FM_FIBERS + 1) != id)
+            xpthread_fcond_wait(&fm_cond, &fm_lock);
+        fm_turn++;
+        fm_count++;
+        xpthread_fcond_broadcast(&fm_cond);
+        xpthread_fmutex_unlock(&fm_lock);
+    }
+    return NULL;
+}
+
+// xpthread_once_arg test data
+typedef struct {
+    int value;
+    int inits;
+} lazy_singleton;
+
+void lazy_init(void *arg) {
+    lazy_singleton *s = arg;
+    s->value = 42;
+    s->inits++;
+}
+
+void *lazy_user(void *arg) {
+    static xpthread_once_t lazy_once = XPTHREAD_ONCE_INIT;
+    lazy_singleton *s = arg;
+    for (int i = 0; i < 1000; i++) {
+        xpthread_once_arg(&lazy_once, lazy_init, s);
+        if (s->value != 42) return (void *)1;
+    }
+    return NULL;
+}
+
+// xpthread_park test: ping-pong between two threads
+typedef struct {
+    xpthread_park_handle_t *main_handle;
+    volatile int turn;
+    int rounds;
+} park_pingpong;
+
+void *park_partner(void *arg) {
+    park_pingpong *p = arg;
+    for (int i = 0; i < p->rounds; i++) {
+        while (p->turn != 1) xpthread_park(NULL);
+        p->turn = 0;
+        xpthread_unpark_handle(p->main_handle);
+    }
+    return NULL;
+}
+
+// Byte lock test: cache entries with an embedded one-byte lock
+typedef struct {
+    xpthread_bytelock_t lock;
+    long total;
+} byte_entry;
+
+static byte_entry byte_entries[4];
+
+void *byte_worker(void *arg) {
+    (void)arg;
+    for (int i = 0; i < 20000; i++) {
+        byte_entry *e = &byte_entries[i % 4];
+        xpthread_bytelock_lock(&e->lock);
+        long t = e->total;
+        if (i % 512 == 0) {
+            // sleep while holding the lock so the others have to park
+            struct timespec nap = { 0, 100000L };
+            xpthread_park(&nap);
+        }
+        e->total = t + 1;
+        xpthread_bytelock_unlock(&e->lock);
+    }
+    return NULL;
+}
+
+// Byte condition variable test: bounded counter handoff
+static xpthread_bytelock_t bq_lock = XPTHREAD_BYTELOCK_INITIALIZER;
+static xpthread_bytecond_t bq_nonempty = XPTHREAD_BYTECOND_INITIALIZER;
+static xpthread_bytecond_t bq_nonfull = XPTHREAD_BYTECOND_INITIALIZER;
+static int bq_count = 0;
+static long bq_consumed = 0;
+
+void *bq_producer(void *arg) {
+    (void)arg;
+    for (int i = 0; i < 5000; i++) {
+        xpthread_bytelock_lock(&bq_lock);
+        while (bq_count == 4) xpthread_bytecond_wait(&bq_nonfull, &bq_lock);
+        bq_count++;
+        xpthread_bytecond_signal(&bq_nonempty);
+        xpthread_bytelock_unlock(&bq_lock);
+    }
+    return NULL;
+}
+
+void *bq_consumer(void *arg) {
+    (void)arg;
+    for (int i = 0; i < 5000; i++) {
+        xpthread_bytelock_lock(&bq_lock);
+        while (bq_count == 0) xpthread_bytecond_wait(&bq_nonempty, &bq_lock);
+        bq_count--;
+        bq_consumed++;
+        xpthread_bytecond_signal(&bq_nonfull);
+        xpthread_bytelock_unlock(&bq_lock);
+    }
+    return NULL;
+}
+
+// Byte condition broadcast test: short timed waits racing broadcasts
+static xpthread_bytelock_t race_lock = XPTHREAD_BYTELOCK_INITIALIZER;
+static xpthread_bytecond_t race_cond = XPTHREAD_BYTECOND_INITIALIZER;
+static volatile int race_stop = 0;
+static long race_waits = 0;
+
+void *race_waiter(void *arg) {
+    (void)arg;
+    struct timespec tiny = { 0, 1000L };
+    for (int i = 0; i < 20000; i++) {
+        xpthread_bytelock_lock(&race_lock);
+        int ret = xpthread_bytecond_timedwait(&race_cond, &race_lock, &tiny);
+        if (ret == 0 || ret == ETIMEDOUT) race_waits++;
+        xpthread_bytelock_unlock(&race_lock);
+    }
+    return NULL;
+}
+
+void *race_broadcaster(void *arg) {
+    (void)arg;
+    while (!race_stop) xpthread_bytecond_broadcast(&race_cond);
+    return NULL;
+}
+
+// Byte lock fairness test: a thread that relocks at once vs. a waiter
+static xpthread_bytelock_t hog_lock = XPTHREAD_BYTELOCK_INITIALIZER;
+static volatile int hog_stop = 0;
+
+void *lock_hog(void *arg) {
+    (void)arg;
+    struct timespec hold = { 0, 200000L };
+    while (!hog_stop) {
+        xpthread_bytelock_lock(&hog_lock);
+        xpthread_park(&hold);
+        xpthread_bytelock_unlock(&hog_lock);
+    }
+    return NULL;
+}
+
+void *fair_waiter(void *arg) {
+    *(volatile int *)arg = 1;
+    xpthread_bytelock_lock(&hog_lock);
+    *(volatile int *)arg = 2;
+    xpthread_bytelock_unlock(&hog_lock);
+    return NULL;
+}
+
+static uint64_t test_clock_us(void) {
+    struct timespec ts;
+    xpthread_get_realtime(&ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+
+// xpthread_mutex_lock_n test: transfers between sharded accounts
+enum { ACCOUNTS = 6 };
+static xpthread_mutex_t account_locks[ACCOUNTS];
+static long account_balance[ACCOUNTS];
+
+void *transfer_worker(void *arg) {
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    for (int i = 0; i < 20000; i++) {
+        seed = seed * 1103515245u + 12345u;
+        int from = (int)(seed >> 16) % ACCOUNTS;
+        int to = (int)(seed >> 8) % ACCOUNTS;
+        int fee = (int)(seed >> 4) % ACCOUNTS;
+        // callers pass the locks in whatever order; duplicates allowed
+        xpthread_mutex_t *locks[3] = { &account_locks[to], &account_locks[fee], &account_locks[from] };
+        xpthread_mutex_lock_n(locks, 3);
+        account_balance[from] -= 3;
+        account_balance[to] += 2;
+        account_balance[fee] += 1;
+        xpthread_mutex_unlock_n(locks, 3);
+    }
+    return NULL;
+}
+
+// Parks once; the permit was given right after xpthread_create()
+void *park_once(void *arg) {
+    (void)arg;
+    struct timespec limit = { 5, 0 };
+    return (void *)(intptr_t)xpthread_park(&limit);
+}
+
 // Function for xpthread_once test
 void once_func(void) {
     printf("xpthread_once: called exactly once\n");
@@ -92,6 +650,546 @@ int main(void) {
         printf("Trylock failed\n");
     }
 
+    // --- Test spinlocks ---
+    for (int i = 0; i < N; i++)
+        xpthread_create(&threads[i], NULL, spin_func, NULL);
+    for (int i = 0; i < N; i++)
+        xpthread_join(threads[i], NULL);
+    printf("Spinlock counters: ttas = %d, ticket = %d\n", spin_counter, ticket_counter);
+    if (spin_counter != N * 10000 || ticket_counter != N * 10000) {
+        fprintf(stderr, "Spinlock counters mismatch\n");
+        return 1;
+    }
+
+    int spin_try = xpthread_spin_trylock(&spin) == 0 && xpthread_spin_trylock(&spin) == EBUSY;
+    xpthread_spin_unlock(&spin);
+    int ticket_try = xpthread_ticket_trylock(&ticket) == 0 && xpthread_ticket_trylock(&ticket) == EBUSY;
+    xpthread_ticket_unlock(&ticket);
+    printf("Spin trylock = %d, ticket trylock = %d\n", spin_try, ticket_try);
+    if (!spin_try || !ticket_try) {
+        fprintf(stderr, "Spinlock trylock mismatch\n");
+        return 1;
+    }
+
+    // --- Test flat combining ---
+    xpthread_fc_init(&fc, &fc_counter, fc_add);
+    for (int i = 0; i < N; i++)
+        xpthread_create(&threads[i], NULL, fc_func, NULL);
+    for (int i = 0; i < N; i++)
+        xpthread_join(threads[i], NULL);
+    printf("Flat combining counter = %ld\n", fc_counter);
+    if (fc_counter != N * 10000 || xpthread_fc_destroy(&fc) != 0) {
+        fprintf(stderr, "Flat combining counter mismatch\n");
+        return 1;
+    }
+
+    // --- Test delegation server ---
+    if (xpthread_delegate_init(&delegate, &delegate_counter, N, 0) != 0) {
+        fprintf(stderr, "Failed to start delegation server\n");
+        return 1;
+    }
+    for (int i = 0; i < N; i++)
+        xpthread_create(&threads[i], NULL, delegate_func, NULL);
+    for (int i = 0; i < N; i++)
+        xpthread_join(threads[i], NULL);
+    void *bad_client = xpthread_delegate_call(&delegate, N, delegate_add, (void *)1);
+    xpthread_delegate_destroy(&delegate);
+    xpthread_delegate_t bad_delegate;
+    int bad_cpu = xpthread_delegate_init(&bad_delegate, &delegate_counter, 1, 1 << 20);
+    printf("Delegation counter = %ld, bad cpu = %d\n", delegate_counter, bad_cpu);
+    if (delegate_counter != N * 1000 || bad_client != NULL || bad_cpu != EINVAL) {
+        fprintf(stderr, "Delegation counter mismatch\n");
+        return 1;
+    }
+
+    // --- Test hazard pointers ---
+    for (int i = 0; i < N; i++)
+        xpthread_create(&threads[i], NULL, hp_func, NULL);
+    for (int i = 0; i < N; i++)
+        xpthread_join(threads[i], NULL);
+    xpthread_hazard_scan(); // adopts what exited threads left behind
+    printf("Hazard pointers: allocated = %ld, freed = %ld\n", hp_allocated, hp_freed);
+    if (hp_freed != hp_allocated - 1) {
+        fprintf(stderr, "Hazard pointers leaked nodes\n");
+        return 1;
+    }
+    free((void *)hp_shared);
+    if (xpthread_hazard_protect(-1, (void *const volatile *)&hp_shared) != NULL ||
+        xpthread_hazard_set(XPTHREAD_HAZARD_SLOTS, NULL) != EINVAL ||
+        xpthread_hazard_clear(XPTHREAD_HAZARD_SLOTS) != EINVAL) {
+        fprintf(stderr, "Hazard slot out of range was accepted\n");
+        return 1;
+    }
+
+    // --- Test epoch-based reclamation ---
+    for (int i = 0; i < N; i++)
+        xpthread_create(&threads[i], NULL, ebr_func, NULL);
+    for (int i = 0; i < N; i++)
+        xpthread_join(threads[i], NULL);
+    xpthread_epoch_barrier();
+    printf("Epoch reclamation: allocated = %ld, freed = %ld\n", ebr_allocated, ebr_freed);
+    if (ebr_freed != ebr_allocated - 1) {
+        fprintf(stderr, "Epoch reclamation leaked nodes\n");
+        return 1;
+    }
+    free((void *)ebr_shared);
+    for (int i = 0; i < 8; i++)
+        xpthread_epoch_retire(malloc(16), ebr_park_free);
+    xpthread_epoch_barrier();
+    printf("Epoch reclamation with blocking free: freed = %ld\n", ebr_park_freed);
+    if (ebr_park_freed != 8) {
+        fprintf(stderr, "Epoch reclamation with blocking free mismatch\n");
+        return 1;
+    }
+
+    // --- Test RCU ---
+    for (int i = 0; i < N; i++)
+        xpthread_create(&threads[i], NULL, rcu_func, NULL);
+    for (int i = 0; i < N; i++)
+        xpthread_join(threads[i], NULL);
+    xpthread_synchronize_rcu();
+    xpthread_rcu_barrier();
+    int rcu_null = xpthread_call_rcu(NULL, rcu_free);
+    printf("RCU: freed = %ld, null head = %d\n", rcu_freed, rcu_null);
+    if (rcu_freed != N * 100 - 1 || rcu_null != EINVAL) {
+        fprintf(stderr, "RCU callbacks missing\n");
+        return 1;
+    }
+    free(rcu_shared);
+
+    // --- Test seqlock ---
+    for (int i = 0; i < N; i++)
+        xpthread_create(&threads[i], NULL, seq_reader, NULL);
+    for (long i = 1; i <= 100000; i++) {
+        xpthread_seqlock_write_lock(&seqlock);
+        seq_snapshot.a = i;
+        seq_snapshot.b = -i;
+        xpthread_seqlock_write_unlock(&seqlock);
+    }
+    seq_done = 1;
+    for (int i = 0; i < N; i++)
+        xpthread_join(threads[i], NULL);
+    printf("Seqlock: torn reads = %d\n", seq_torn);
+    if (seq_torn) {
+        fprintf(stderr, "Seqlock returned a torn snapshot\n");
+        return 1;
+    }
+
+    // --- Test left-right ---
+    seq_done = 0;
+    xpthread_lr_init(&lr, &lr_replicas[0], &lr_replicas[1]);
+    for (int i = 0; i < N; i++)
+        xpthread_create(&threads[i], NULL, lr_reader, NULL);
+    for (long i = 1; i <= 10000; i++)
+        xpthread_lr_write(&lr, lr_update, &i);
+    seq_done = 1;
+    for (int i = 0; i < N; i++)
+        xpthread_join(threads[i], NULL);
+    xpthread_lr_destroy(&lr);
+    printf("Left-right: torn reads = %d, value = %ld\n", seq_torn, lr_replicas[0].a);
+    if (seq_torn || lr_replicas[0].a != 10000 || lr_replicas[1].a != 10000) {
+        fprintf(stderr, "Left-right returned an inconsistent replica\n");
+        return 1;
+    }
+
+    // --- Test parallel for / reduce ---
+    const size_t PN = 1000000;
+    pfor_hits = calloc(PN, 1);
+    xpthread_parallel_for(0, PN, 0, pfor_mark, NULL);
+    for (size_t i = 0; i < PN; i++) {
+        if (pfor_hits[i] != 1) {
+            fprintf(stderr, "Parallel for visited index %zu %d times\n", i, pfor_hits[i]);
+            return 1;
+        }
+    }
+    free(pfor_hits);
+
+    unsigned long long sum = 0, zero = 0;
+    xpthread_parallel_reduce(0, PN, 0, &sum, sizeof(sum), &zero, preduce_sum, preduce_combine, NULL);
+    // one accumulator per index over the whole size_t range cannot be sized
+    unsigned char big_acc[64], big_zero[64] = { 0 };
+    int overflow = xpthread_parallel_reduce(0, SIZE_MAX, 1, big_acc, sizeof(big_acc), big_zero,
+                                            preduce_sum, preduce_combine, NULL);
+    printf("Parallel reduce: sum = %llu, overflow = %d\n", sum, overflow);
+    if (sum != (unsigned long long)PN * (PN - 1) / 2 || overflow != ENOMEM) {
+        fprintf(stderr, "Parallel reduce mismatch\n");
+        return 1;
+    }
+
+    // --- Test parallel sort / scan ---
+    unsigned int *keys = malloc(PN * sizeof(*keys));
+    unsigned int seed = 12345;
+    for (size_t i = 0; i < PN; i++) {
+        seed = seed * 1103515245u + 12345u;
+        keys[i] = seed >> 8;
+    }
+    // a sequential sort of the same input is the expected permutation
+    unsigned int *expected = malloc(PN * sizeof(*expected));
+    memcpy(expected, keys, PN * sizeof(*keys));
+    qsort(expected, PN, sizeof(*expected), psort_cmp);
+    xpthread_parallel_sort(keys, PN, sizeof(*keys), psort_cmp);
+    for (size_t i = 0; i < PN; i++) {
+        if (keys[i] != expected[i]) {
+            fprintf(stderr, "Parallel sort mismatch at %zu\n", i);
+            return 1;
+        }
+    }
+    free(expected);
+    free(keys);
+
+    unsigned long long *prefix = malloc(PN * sizeof(*prefix));
+    for (size_t i = 0; i < PN; i++)
+        prefix[i] = 1;
+    xpthread_parallel_scan(prefix, PN, sizeof(*prefix), pscan_add, NULL);
+    for (size_t i = 0; i < PN; i++) {
+        if (prefix[i] != i + 1) {
+            fprintf(stderr, "Parallel scan mismatch at %zu\n", i);
+            return 1;
+        }
+    }
+    free(prefix);
+    printf("Parallel sort and scan ok\n");
+
+    // --- Test task graph ---
+    xpthread_graph_t *graph;
+    xpthread_graph_create(&graph, NULL);
+    for (size_t f = 0; f < GRAPH_FILES; f++) {
+        size_t ids[3];
+        for (size_t st = 0; st < 3; st++)
+            xpthread_graph_add_task(graph, graph_step, (void *)(f * 3 + st), &ids[st]);
+        xpthread_graph_add_edge(graph, ids[0], ids[1]);
+        xpthread_graph_add_edge(graph, ids[1], ids[2]);
+    }
+    for (int run = 0; run < 2; run++) {
+        for (size_t f = 0; f < GRAPH_FILES; f++)
+            graph_stage[f] = 0;
+        xpthread_graph_run(graph);
+        for (size_t f = 0; f < GRAPH_FILES; f++)
+            if (graph_stage[f] != 3) graph_order_ok = 0;
+    }
+    xpthread_graph_add_edge(graph, 2, 0); // cycle
+    if (xpthread_graph_run(graph) != EDEADLK) graph_order_ok = 0;
+    xpthread_graph_destroy(graph);
+    printf("Task graph: order %s\n", graph_order_ok ? "ok" : "broken");
+    if (!graph_order_ok) return 1;
+
+    // --- Test futures ---
+    xpthread_future_t *futs[N], *all, *any, *chained;
+    for (int i = 0; i < N; i++)
+        xpthread_future_async(NULL, future_square, (void *)(size_t)(i + 2), &futs[i]);
+    xpthread_future_then(futs[0], future_add_one, NULL, XPTHREAD_FUTURE_INLINE, &chained);
+    xpthread_future_when_all(futs, N, &all);
+    xpthread_future_when_any(futs, N, &any);
+
+    void *fval = NULL;
+    xpthread_future_wait(all, NULL);
+    xpthread_future_wait(chained, &fval);
+    printf("Futures: then = %zu, any ready = %d\n", (size_t)fval, xpthread_future_is_ready(any));
+    if ((size_t)fval != 5 || !xpthread_future_is_ready(any)) {
+        fprintf(stderr, "Future results mismatch\n");
+        return 1;
+    }
+    for (int i = 0; i < N; i++) {
+        xpthread_future_try_get(futs[i], &fval);
+        if ((size_t)fval != (size_t)(i + 2) * (i + 2)) {
+            fprintf(stderr, "Future %d returned %zu\n", i, (size_t)fval);
+            return 1;
+        }
+        xpthread_future_release(futs[i]);
+    }
+    xpthread_future_release(chained);
+    xpthread_future_release(all);
+    xpthread_future_wait(any, NULL);
+    xpthread_future_release(any);
+
+    // --- Test task groups ---
+    fib_frame fib = { .n = 20 };
+    fib_task(&fib.spawn);
+    printf("Task group: fib(20) = %lu\n", fib.result);
+    if (fib.result != 6765) {
+        fprintf(stderr, "Task group result mismatch\n");
+        return 1;
+    }
+
+    // --- Test timers ---
+    {
+        enum { TN = 1000 };
+        static xpthread_timer_t timers[TN];
+        static volatile long fired[TN];
+        volatile long ticks = 0;
+        xpthread_timer_t every = XPTHREAD_TIMER_INITIALIZER;
+        for (int i = 0; i < TN; i++) {
+            xpthread_timer_init(&timers[i]);
+            xpthread_schedule_after(&timers[i], 50 + (unsigned long)(i * 37 % 200), timer_cb, (void *)&fired[i]);
+        }
+        // every other timer is cancelled before it can fire
+        int cancelled = 0;
+        for (int i = 0; i < TN; i += 2)
+            if (xpthread_timer_cancel(&timers[i]) == 0) cancelled++;
+        xpthread_schedule_every(&every, 10, timer_cb, (void *)&ticks);
+
+        xpthread_timer_t done = XPTHREAD_TIMER_INITIALIZER;
+        xpthread_schedule_after(&done, 350, timer_cb, (void *)&timer_fired);
+        struct timespec nap = { 0, 10000000L };
+        uint32_t nap_word = 0;
+        while (!__atomic_load_n(&timer_fired, __ATOMIC_SEQ_CST))
+            xpthread_futex_wait(&nap_word, 0, &nap);
+        int every_cancel = xpthread_timer_cancel(&every);
+
+        int wrong = 0;
+        for (int i = 0; i < TN; i++)
+            if (fired[i] != i % 2)
+                wrong++;
+        printf("Timers: cancelled = %d, periodic ticks = %ld, wrong = %d\n", cancelled, ticks, wrong);
+        if (wrong || cancelled != TN / 2 || every_cancel != 0 || ticks < 5 || xpthread_timer_cancel(&done) != ESRCH) {
+            fprintf(stderr, "Timer result mismatch\n");
+            return 1;
+        }
+    }
+
+    // --- Test pipeline ---
+    {
+        xpthread_pipeline_t *pipe;
+        xpthread_pipeline_create(&pipe, NULL);
+        xpthread_pipeline_add_stage(pipe, pipe_source, NULL, XPTHREAD_STAGE_SERIAL);
+        xpthread_pipeline_add_stage(pipe, pipe_square, NULL, XPTHREAD_STAGE_PARALLEL);
+        xpthread_pipeline_add_stage(pipe, pipe_filter, NULL, XPTHREAD_STAGE_PARALLEL);
+        xpthread_pipeline_add_stage(pipe, pipe_sink, NULL, XPTHREAD_STAGE_SERIAL);
+        int ret = xpthread_pipeline_run(pipe, 8);
+        xpthread_pipeline_destroy(pipe);
+
+        long expect = 0;
+        for (long i = 0; i < PIPE_N; i++)
+            if ((i * 2 + 1) % 3) expect += i * 2 + 1;
+        printf("Pipeline: sum = %ld, out of order = %d\n", pipe_sum, pipe_out_of_order);
+        if (ret || pipe_sum != expect || pipe_out_of_order) {
+            fprintf(stderr, "Pipeline result mismatch\n");
+            return 1;
+        }
+    }
+
+    // --- Test fibers ---
+    {
+        static xpthread_fiber_t *fibers[FIBERS];
+        int bad = 0;
+        for (intptr_t i = 0; i < FIBERS; i++)
+            if (xpthread_fiber_create(&fibers[i], 0, i % 2 ? fiber_parent : fiber_fn, (void *)i)) bad++;
+        for (intptr_t i = 0; i < FIBERS; i++) {
+            void *ret = NULL;
+            xpthread_fiber_join(fibers[i], &ret);
+            if ((intptr_t)ret != i + i % 2) bad++;
+        }
+        printf("Fibers: steps = %ld, bad = %d\n", fiber_steps, bad);
+        if (bad || fiber_steps != FIBERS * FIBER_YIELDS) {
+            fprintf(stderr, "Fiber result mismatch\n");
+            return 1;
+        }
+    }
+
+    // --- Test fiber mutex / condition variable ---
+    {
+        xpthread_fiber_t *fms[FM_FIBERS];
+        for (long i = 0; i < FM_FIBERS; i++)
+            xpthread_fiber_create(&fms[i], 0, fm_fiber, (void *)(intptr_t)i);
+        fm_fiber((void *)(intptr_t)FM_FIBERS); // this thread takes the last turn
+        for (int i = 0; i < FM_FIBERS; i++)
+            xpthread_fiber_join(fms[i], NULL);
+        printf("Fiber mutex: turns = %ld\n", fm_count);
+        if (fm_count != (FM_FIBERS + 1) * FM_ROUNDS || xpthread_fmutex_destroy(&fm_lock)) {
+            fprintf(stderr, "Fiber mutex result mismatch\n");
+            return 1;
+        }
+    }
+
+    // --- Test xpthread_once_arg ---
+    {
+        lazy_singleton lazy = { 0, 0 };
+        int failed = 0;
+        for (int i = 0; i < N; i++)
+            xpthread_create(&threads[i], NULL, lazy_user, &lazy);
+        for (int i = 0; i < N; i++) {
+            void *ret;
+            xpthread_join(threads[i], &ret);
+            if (ret) failed++;
+        }
+        if (xpthread_once_arg(NULL, lazy_init, &lazy) != EINVAL) failed++;
+        printf("Once with argument: inits = %d, failed = %d\n", lazy.inits, failed);
+        if (lazy.inits != 1 || failed) {
+            fprintf(stderr, "Once result mismatch\n");
+            return 1;
+        }
+    }
+
+    // --- Test xpthread_park / xpthread_unpark ---
+    {
+        struct timespec short_wait = { 0, 2000000 };
+        int early = xpthread_park(&short_wait);
+        xpthread_unpark(xpthread_self());
+        int permit = xpthread_park(&short_wait);
+        int timeout = xpthread_park(&short_wait);
+
+        park_pingpong pp = { xpthread_park_handle_self(), 0, 2000 };
+        int null_handle = xpthread_unpark_handle(NULL);
+        xpthread_t partner;
+        xpthread_create(&partner, NULL, park_partner, &pp);
+        for (int i = 0; i < pp.rounds; i++) {
+            pp.turn = 1;
+            xpthread_unpark(partner);
+            while (pp.turn != 0) xpthread_park(NULL);
+        }
+        xpthread_join(partner, NULL);
+
+        int early_unpark = 0;
+        for (int i = 0; i < 50; i++) {
+            void *ret;
+            xpthread_create(&partner, NULL, park_once, NULL);
+            if (xpthread_unpark(partner) != 0) early_unpark++;
+            xpthread_join(partner, &ret);
+            if (ret) early_unpark++;
+        }
+        printf("Park: timeout = %d, permit = %d, timeout after = %d, rounds = %d, lost unparks = %d\n",
+               early == ETIMEDOUT, permit == 0, timeout == ETIMEDOUT, pp.rounds, early_unpark);
+        if (early != ETIMEDOUT || permit != 0 || timeout != ETIMEDOUT || early_unpark ||
+            !pp.main_handle || null_handle != EINVAL) {
+            fprintf(stderr, "Park result mismatch\n");
+            return 1;
+        }
+    }
+
+    // --- Test byte locks and condition variables ---
+    {
+        long total = 0;
+        for (int i = 0; i < N; i++)
+            xpthread_create(&threads[i], NULL, byte_worker, NULL);
+        for (int i = 0; i < N; i++)
+            xpthread_join(threads[i], NULL);
+        for (int i = 0; i < 4; i++) total += byte_entries[i].total;
+
+        xpthread_t prod[2], cons[2];
+        for (int i = 0; i < 2; i++) {
+            xpthread_create(&prod[i], NULL, bq_producer, NULL);
+            xpthread_create(&cons[i], NULL, bq_consumer, NULL);
+        }
+        for (int i = 0; i < 2; i++) {
+            xpthread_join(prod[i], NULL);
+            xpthread_join(cons[i], NULL);
+        }
+
+        struct timespec short_wait = { 0, 2000000 };
+        xpthread_bytelock_lock(&bq_lock);
+        int timed = xpthread_bytecond_timedwait(&bq_nonempty, &bq_lock, &short_wait);
+        int relocked = xpthread_bytelock_trylock(&bq_lock);
+        xpthread_bytelock_unlock(&bq_lock);
+
+        printf("Byte locks: size = %zu, total = %ld (expected %ld), consumed = %ld, timeout = %d\n",
+               sizeof(xpthread_bytelock_t), total, (long)N * 20000, bq_consumed, timed == ETIMEDOUT);
+        if (sizeof(xpthread_bytelock_t) != 1 || total != (long)N * 20000 || bq_consumed != 10000 ||
+            timed != ETIMEDOUT || relocked != EBUSY) {
+            fprintf(stderr, "Byte lock result mismatch\n");
+            return 1;
+        }
+    }
+
+    // --- Test byte condition broadcast against timeouts ---
+    {
+        xpthread_t bcast[2];
+        for (int i = 0; i < N; i++)
+            xpthread_create(&threads[i], NULL, race_waiter, NULL);
+        for (int i = 0; i < 2; i++)
+            xpthread_create(&bcast[i], NULL, race_broadcaster, NULL);
+        for (int i = 0; i < N; i++)
+            xpthread_join(threads[i], NULL);
+        race_stop = 1;
+        for (int i = 0; i < 2; i++)
+            xpthread_join(bcast[i], NULL);
+
+        printf("Byte cond broadcast race: waits = %ld (expected %ld)\n", race_waits, (long)N * 20000);
+        if (race_waits != (long)N * 20000) {
+            fprintf(stderr, "Byte cond broadcast race mismatch\n");
+            return 1;
+        }
+    }
+
+    // --- Test byte lock fairness ---
+    {
+        // unlock_fair hands the lock to the parked thread
+        volatile int got = 0;
+        xpthread_t waiter;
+        xpthread_bytelock_lock(&hog_lock);
+        xpthread_create(&waiter, NULL, fair_waiter, (void *)&got);
+        struct timespec nap = { 0, 20000000L };
+        while (!got) xpthread_park(&nap);
+        xpthread_park(&nap); // long enough for the waiter to park
+        xpthread_bytelock_unlock_fair(&hog_lock);
+        int handed_off = xpthread_bytelock_trylock(&hog_lock) == EBUSY;
+        xpthread_join(waiter, NULL);
+
+        // without the handoff a thread that relocks at once can starve a waiter
+        xpthread_t hog;
+        struct timespec ms = { 0, 1000000L };
+        xpthread_bytelock_setstarvation(0);
+        xpthread_create(&hog, NULL, lock_hog, NULL);
+        xpthread_park(&ms);
+        int starved = 0;
+        got = 0;
+        xpthread_create(&waiter, NULL, fair_waiter, (void *)&got);
+        xpthread_park(&nap);
+        xpthread_park(&nap);
+        starved = got != 2;
+
+        // the waiter's first park counts, so enabling the handoff lets it in
+        uint64_t start = test_clock_us();
+        xpthread_bytelock_setstarvation(1000000);
+        while (got != 2 && test_clock_us() - start < 1000000) xpthread_park(&ms);
+        uint64_t rescue = test_clock_us() - start;
+        xpthread_join(waiter, NULL);
+
+        // and bounds the wait of every lock call behind the hog
+        uint64_t worst = 0;
+        for (int i = 0; i < 20; i++) {
+            start = test_clock_us();
+            xpthread_bytelock_lock(&hog_lock);
+            uint64_t waited = test_clock_us() - start;
+            xpthread_bytelock_unlock(&hog_lock);
+            if (waited > worst) worst = waited;
+            xpthread_park(&ms);
+        }
+        hog_stop = 1;
+        xpthread_join(hog, NULL);
+
+        printf("Byte lock fairness: handoff = %d, starved without handoff = %d, "
+               "rescued after = %llu us, worst wait = %llu us\n",
+               handed_off, starved, (unsigned long long)rescue, (unsigned long long)worst);
+        if (!handed_off || got != 2 || rescue > 5000 || worst > 5000) {
+            fprintf(stderr, "Byte lock fairness mismatch\n");
+            return 1;
+        }
+    }
+
+    // --- Test xpthread_mutex_lock_n ---
+    {
+        long total = 0;
+        for (int i = 0; i < ACCOUNTS; i++) {
+            xpthread_mutex_init(&account_locks[i]);
+            account_balance[i] = 1000;
+        }
+        for (int i = 0; i < N; i++)
+            xpthread_create(&threads[i], NULL, transfer_worker, (void *)(uintptr_t)(i + 1));
+        for (int i = 0; i < N; i++)
+            xpthread_join(threads[i], NULL);
+        for (int i = 0; i < ACCOUNTS; i++) {
+            total += account_balance[i];
+            if (xpthread_mutex_trylock(&account_locks[i]) != 0) total = -1;
+            else xpthread_mutex_unlock(&account_locks[i]);
+            xpthread_mutex_destroy(&account_locks[i]);
+        }
+        printf("Lock n: total balance = %ld (expected %d)\n", total, ACCOUNTS * 1000);
+        if (total != ACCOUNTS * 1000) {
+            fprintf(stderr, "Lock n result mismatch\n");
+            return 1;
+        }
+    }
+
     printf("xpthread test finished\n");
     return 0;
 }